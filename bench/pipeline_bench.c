@@ -0,0 +1,415 @@
+// pipeline_bench.c
+// Runs the decode -> scale -> encode -> mux pipeline on a deterministic
+// synthetic MJPEG clip (or a recorded file) as fast as it will go and reports
+// per-rendition throughput and per-stage latency percentiles as text and JSON.
+#include "../include/cleanup.h"
+#include "../include/cores.h"
+#include "../include/decoder.h"
+#include "../include/encoder.h"
+#include "../include/latency.h"
+#include "../include/pool.h"
+#include "../include/presets.h"
+#include "../include/processor.h"
+#include "../include/scaler.h"
+#include "../include/scene.h"
+#include "../include/simd_scale.h"
+#include "../include/source.h"
+#include "../include/utils.h"
+#include "../include/workpool.h"
+#include <getopt.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+
+#ifndef BENCH_GIT_REV
+#define BENCH_GIT_REV "unknown"
+#endif
+
+typedef struct BenchOptions {
+  const char *input;
+  const char *output_dir;
+  const char *json_path;
+  const char *video_size;
+  const char *framerate;
+  int frames;
+  int huge_pages;
+} BenchOptions;
+
+static volatile int keep_running = 1;
+
+// Encodes frames of the lavfi testsrc2 pattern to an MJPEG elementary stream
+// with the same yuvj422p layout webcams deliver.
+static int write_synthetic_clip(const BenchOptions *opts, const char *path) {
+  TranscoderContext src = {0};
+  src.source.type = SOURCE_LAVFI;
+  src.source.video_size = opts->video_size;
+  src.source.framerate = opts->framerate;
+
+  AVCodecContext *mjpeg = NULL;
+  struct SwsContext *sws = NULL;
+  AVFrame *yuv = NULL;
+  AVPacket *pkt = av_packet_alloc();
+  FILE *out = NULL;
+  int written = 0;
+
+  int ret = open_input(&src);
+  if (ret < 0 || (ret = init_decoder(&src)) < 0)
+    goto end;
+
+  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+  mjpeg = avcodec_alloc_context3(codec);
+  src.frame = av_frame_alloc();
+  src.packet = av_packet_alloc();
+  yuv = av_frame_alloc();
+  if (!codec || !mjpeg || !src.frame || !src.packet || !yuv || !pkt) {
+    ret = AVERROR(ENOMEM);
+    goto end;
+  }
+
+  mjpeg->width = src.dec_ctx->width;
+  mjpeg->height = src.dec_ctx->height;
+  mjpeg->pix_fmt = AV_PIX_FMT_YUVJ422P;
+  mjpeg->time_base = av_inv_q(
+      src.input_ctx->streams[src.video_stream_index]->avg_frame_rate);
+  mjpeg->flags |= AV_CODEC_FLAG_QSCALE;
+  mjpeg->global_quality = 4 * FF_QP2LAMBDA;
+  if ((ret = avcodec_open2(mjpeg, codec, NULL)) < 0)
+    goto end;
+
+  yuv->format = mjpeg->pix_fmt;
+  yuv->width = mjpeg->width;
+  yuv->height = mjpeg->height;
+  if ((ret = av_frame_get_buffer(yuv, 32)) < 0)
+    goto end;
+
+  sws = sws_getContext(src.dec_ctx->width, src.dec_ctx->height,
+                       src.dec_ctx->pix_fmt, yuv->width, yuv->height,
+                       mjpeg->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+  out = fopen(path, "wb");
+  if (!sws || !out) {
+    ret = AVERROR(EIO);
+    goto end;
+  }
+
+  while (written < opts->frames &&
+         (ret = av_read_frame(src.input_ctx, src.packet)) >= 0) {
+    ret = avcodec_send_packet(src.dec_ctx, src.packet);
+    av_packet_unref(src.packet);
+    while (ret >= 0 && avcodec_receive_frame(src.dec_ctx, src.frame) >= 0) {
+      sws_scale(sws, (const uint8_t *const *)src.frame->data,
+                src.frame->linesize, 0, src.frame->height, yuv->data,
+                yuv->linesize);
+      yuv->pts = written;
+      if ((ret = avcodec_send_frame(mjpeg, yuv)) < 0)
+        break;
+      while (avcodec_receive_packet(mjpeg, pkt) >= 0) {
+        fwrite(pkt->data, 1, pkt->size, out);
+        av_packet_unref(pkt);
+      }
+      written++;
+    }
+  }
+  ret = written == opts->frames ? 0 : ret < 0 ? ret : AVERROR_EOF;
+
+end:
+  if (out)
+    fclose(out);
+  sws_freeContext(sws);
+  av_frame_free(&yuv);
+  av_packet_free(&pkt);
+  avcodec_free_context(&mjpeg);
+  av_frame_free(&src.frame);
+  av_packet_free(&src.packet);
+  avcodec_free_context(&src.dec_ctx);
+  avformat_close_input(&src.input_ctx);
+  buffer_pool_uninit(&src.frame_pool);
+  return ret;
+}
+
+static void print_stage(const char *name, LatencyHistogram *h) {
+  printf("  %-16s %8" PRIuFAST64 " calls  mean %8.1f  p50 %8.1f  p95 %8.1f  "
+         "p99 %8.1f us\n",
+         name, atomic_load(&h->count), latency_mean(h) / 1000.0,
+         latency_percentile(h, 50) / 1000.0,
+         latency_percentile(h, 95) / 1000.0,
+         latency_percentile(h, 99) / 1000.0);
+}
+
+static void json_stage(FILE *f, const char *name, LatencyHistogram *h,
+                       int last) {
+  fprintf(f,
+          "        \"%s\": {\"count\": %" PRIuFAST64 ", \"mean_us\": %.2f, "
+          "\"p50_us\": %.2f, \"p95_us\": %.2f, \"p99_us\": %.2f, "
+          "\"max_us\": %.2f}%s\n",
+          name, atomic_load(&h->count), latency_mean(h) / 1000.0,
+          latency_percentile(h, 50) / 1000.0,
+          latency_percentile(h, 95) / 1000.0,
+          latency_percentile(h, 99) / 1000.0,
+          atomic_load(&h->max_ns) / 1000.0, last ? "" : ",");
+}
+
+static void print_pool(const PoolInfo *pool) {
+  printf("  %-14s %-6s %8" PRIuFAST64 " requests  hit rate %6.2f%%  "
+         "resident %8.1f KiB\n",
+         pool->name, pool->rendition ? pool->rendition : "",
+         atomic_load(&pool->stats->requests), pool_hit_rate(pool->stats),
+         atomic_load(&pool->stats->resident) / 1024.0);
+}
+
+static void cpu_model(char *buf, size_t size) {
+  snprintf(buf, size, "unknown");
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (!f)
+    return;
+
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    char *colon = strchr(line, ':');
+    if (!strncmp(line, "model name", 10) && colon) {
+      snprintf(buf, size, "%s", colon + 2);
+      buf[strcspn(buf, "\n")] = '\0';
+      break;
+    }
+  }
+  fclose(f);
+}
+
+static int write_json(const BenchOptions *opts, TranscoderContext *ctx,
+                      double wall_seconds) {
+  FILE *f = fopen(opts->json_path, "w");
+  if (!f) {
+    fprintf(stderr, "Cannot write %s\n", opts->json_path);
+    return AVERROR(EIO);
+  }
+
+  struct utsname host;
+  uname(&host);
+  char cpu[128];
+  cpu_model(cpu, sizeof(cpu));
+
+  fprintf(f, "{\n");
+  fprintf(f, "  \"git_rev\": \"%s\",\n", BENCH_GIT_REV);
+  fprintf(f, "  \"timestamp\": %lld,\n", (long long)time(NULL));
+  fprintf(f, "  \"host\": \"%s\",\n", host.nodename);
+  fprintf(f, "  \"cpu\": \"%s\",\n", cpu);
+  fprintf(f, "  \"cpus\": %d,\n", av_cpu_count());
+  fprintf(f, "  \"input\": \"%s\",\n", opts->input ? opts->input : "synthetic");
+  int64_t decoded = atomic_load(&ctx->decoded_frames);
+  fprintf(f, "  \"frames\": %" PRId64 ",\n", decoded);
+  fprintf(f, "  \"wall_seconds\": %.3f,\n", wall_seconds);
+  fprintf(f, "  \"input_fps\": %.2f,\n", decoded / wall_seconds);
+  fprintf(f, "  \"stages\": {\n");
+  json_stage(f, "read", &ctx->read_latency, 0);
+  json_stage(f, "decode", &ctx->decode_latency, 0);
+  json_stage(f, "decode_delay", &ctx->decode_delay, 1);
+  fprintf(f, "  },\n");
+  fprintf(f, "  \"renditions\": [\n");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    uint64_t frames = atomic_load(&enc->encoded_frames);
+    fprintf(f, "    {\n");
+    fprintf(f, "      \"name\": \"%s\",\n", enc->preset->name);
+    fprintf(f, "      \"frames\": %" PRIu64 ",\n", frames);
+    fprintf(f, "      \"fps\": %.2f,\n", frames / wall_seconds);
+    fprintf(f, "      \"scaler\": \"%s\",\n",
+            enc->passthrough ? "none"
+            : enc->use_simd  ? simd_level_name(enc->simd.level)
+                             : "swscale");
+    fprintf(f, "      \"stages\": {\n");
+    json_stage(f, "scale", &enc->scale_latency, 0);
+    json_stage(f, "send_frame", &enc->send_latency, 0);
+    json_stage(f, "receive_packet", &enc->receive_latency, 0);
+    json_stage(f, "write_frame", &enc->write_latency, 0);
+    json_stage(f, "capture_to_publish", &enc->publish_age, 1);
+    fprintf(f, "      }\n");
+    fprintf(f, "    }%s\n", i + 1 < ctx->renditions ? "," : "");
+  }
+  fprintf(f, "  ],\n");
+  PoolInfo pools[POOL_COUNT];
+  int pool_count = pool_list(ctx, pools);
+  fprintf(f, "  \"huge_pages\": %s,\n", opts->huge_pages ? "true" : "false");
+  fprintf(f, "  \"pools\": [\n");
+  for (int i = 0; i < pool_count; i++) {
+    PoolStats *stats = pools[i].stats;
+    fprintf(f,
+            "    {\"name\": \"%s\", \"rendition\": \"%s\", "
+            "\"requests\": %" PRIuFAST64 ", \"misses\": %" PRIuFAST64
+            ", \"resident_bytes\": %" PRIdFAST64 "}%s\n",
+            pools[i].name, pools[i].rendition ? pools[i].rendition : "",
+            atomic_load(&stats->requests), atomic_load(&stats->misses),
+            atomic_load(&stats->resident), i + 1 < pool_count ? "," : "");
+  }
+  fprintf(f, "  ]\n");
+  fprintf(f, "}\n");
+  fclose(f);
+  return 0;
+}
+
+static void print_results(TranscoderContext *ctx, double wall_seconds) {
+  int64_t decoded = atomic_load(&ctx->decoded_frames);
+  printf("\n%" PRId64 " frames in %.2f s (%.1f fps in)\n", decoded,
+         wall_seconds, decoded / wall_seconds);
+  print_stage("read", &ctx->read_latency);
+  print_stage("decode", &ctx->decode_latency);
+  print_stage("decode_delay", &ctx->decode_delay);
+
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    uint64_t frames = atomic_load(&enc->encoded_frames);
+    printf("%s: %" PRIu64 " frames, %.1f fps\n", enc->preset->name, frames,
+           frames / wall_seconds);
+    print_stage("scale", &enc->scale_latency);
+    print_stage("send_frame", &enc->send_latency);
+    print_stage("receive_packet", &enc->receive_latency);
+    print_stage("write_frame", &enc->write_latency);
+    print_stage("capture_to_publish", &enc->publish_age);
+  }
+
+  PoolInfo pools[POOL_COUNT];
+  int pool_count = pool_list(ctx, pools);
+  printf("Pools:\n");
+  for (int i = 0; i < pool_count; i++)
+    print_pool(&pools[i]);
+}
+
+static int parse_bench_options(int argc, char *argv[], BenchOptions *opts) {
+  static const struct option long_options[] = {
+      {"frames", required_argument, NULL, 'n'},
+      {"input", required_argument, NULL, 'i'},
+      {"output-dir", required_argument, NULL, 'o'},
+      {"json", required_argument, NULL, 'j'},
+      {"video-size", required_argument, NULL, 's'},
+      {"framerate", required_argument, NULL, 'r'},
+      {"huge-pages", no_argument, NULL, 'H'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "n:i:o:j:s:r:H", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      opts->frames = atoi(optarg);
+      break;
+    case 'i':
+      opts->input = optarg;
+      break;
+    case 'o':
+      opts->output_dir = optarg;
+      break;
+    case 'j':
+      opts->json_path = optarg;
+      break;
+    case 's':
+      opts->video_size = optarg;
+      break;
+    case 'r':
+      opts->framerate = optarg;
+      break;
+    case 'H':
+      opts->huge_pages = 1;
+      break;
+    default:
+      return AVERROR(EINVAL);
+    }
+  }
+  return opts->frames > 0 ? 0 : AVERROR(EINVAL);
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions opts = {
+      .output_dir = "bench_output",
+      .json_path = "bench_results.json",
+      .video_size = DEFAULT_VIDEO_SIZE,
+      .framerate = DEFAULT_FRAMERATE,
+      .frames = 600,
+  };
+  if (parse_bench_options(argc, argv, &opts) < 0) {
+    fprintf(stderr,
+            "Usage: %s [--frames N] [--input FILE] [--output-dir DIR] "
+            "[--json PATH] [--video-size WxH] [--framerate FPS] "
+            "[--huge-pages]\n",
+            argv[0]);
+    return 1;
+  }
+
+  mkdir(opts.output_dir, 0755);
+  pool_set_huge_pages(opts.huge_pages);
+
+  WorkPool pool = {0};
+  TranscoderContext ctx = {0};
+  ctx.pool = &pool;
+  ctx.output_dir = (char *)opts.output_dir;
+  ctx.running = 1;
+  ctx.scale_mode = SCALE_MODE;
+  ctx.last_pts = AV_NOPTS_VALUE;
+  latency_init(&ctx.read_latency);
+  latency_init(&ctx.decode_latency);
+  scene_init(&ctx.scene);
+  ctx.startup.started = av_gettime_relative();
+  select_renditions(&ctx, NULL);
+
+  char clip[1024];
+  int ret;
+  if (opts.input) {
+    ctx.source.type = SOURCE_FILE;
+    ctx.source.url = opts.input;
+  } else {
+    snprintf(clip, sizeof(clip), "%s/synthetic.mjpeg", opts.output_dir);
+    printf("Generating %d frame synthetic MJPEG clip...\n", opts.frames);
+    if ((ret = write_synthetic_clip(&opts, clip)) < 0) {
+      fprintf(stderr, "Could not generate clip: %s\n", av_err2str(ret));
+      return 1;
+    }
+    ctx.source.type = SOURCE_FILE;
+    ctx.source.url = clip;
+    ctx.source.format = "mjpeg";
+    ctx.source.framerate = opts.framerate;
+  }
+
+  if ((ret = work_pool_init(&pool, cores_plan(&ctx, 1))) < 0 ||
+      (ret = open_input(&ctx)) < 0 || (ret = init_decoder(&ctx)) < 0)
+    goto end;
+
+  // Every frame must be encoded for the numbers to be comparable
+  for (int i = 0; i < ctx.renditions; i++) {
+    ctx.presets[i].drop_policy = DROP_POLICY_BLOCK;
+    ctx.presets[i].threads = ctx.encoders[i].cores.count;
+    if ((ret = init_encoder(&ctx.encoders[i], &ctx.presets[i])) < 0 ||
+        (ret = init_encoder_output(&ctx.encoders[i], ctx.output_dir, NULL)) <
+            0)
+      goto end;
+  }
+  if ((ret = init_scaling_graph(&ctx)) < 0)
+    goto end;
+  write_master_playlist(ctx.output_dir, ctx.presets, ctx.renditions, 0);
+
+  ctx.frame = av_frame_alloc();
+  ctx.packet = av_packet_alloc();
+  if (!ctx.frame || !ctx.packet) {
+    ret = AVERROR(ENOMEM);
+    goto end;
+  }
+
+  ctx.start_time = av_gettime();
+  int64_t start = av_gettime_relative();
+  if ((ret = start_encoder_workers(&ctx)) < 0)
+    goto end;
+  ret = run_input_loop(&ctx, &keep_running, opts.frames);
+  stop_encoder_workers(&ctx);
+  double wall_seconds = (av_gettime_relative() - start) / 1000000.0;
+  if (ret < 0)
+    goto end;
+
+  print_results(&ctx, wall_seconds);
+  ret = write_json(&opts, &ctx, wall_seconds);
+  if (ret >= 0)
+    printf("\nResults written to %s\n", opts.json_path);
+
+end:
+  cleanup(&ctx);
+  work_pool_uninit(&pool);
+  return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,13 @@
+// audio.h
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include "types.h"
+
+int audio_open(TranscoderContext *ctx);
+int audio_start(TranscoderContext *ctx);
+void audio_stop(TranscoderContext *ctx);
+void audio_free(AudioContext *a);
+int audio_claimed_elsewhere(const char *output_dir);
+
+#endif // AUDIO_H
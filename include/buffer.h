@@ -4,7 +4,12 @@
 
 #include "types.h"
 
-int init_buffer_manager(BufferManager *mgr);
-void free_buffer_manager(BufferManager *mgr);
+int init_ring_buffer(RingBuffer *rb, size_t depth, RingItemType type);
+void free_ring_buffer(RingBuffer *rb);
+int ring_buffer_full(RingBuffer *rb);
+int ring_buffer_push(RingBuffer *rb, void *item);
+void *ring_buffer_pop(RingBuffer *rb);
+size_t ring_buffer_count(RingBuffer *rb);
+void ring_buffer_note_drop(RingBuffer *rb);
 
 #endif // BUFFER_H
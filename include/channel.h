@@ -0,0 +1,16 @@
+// channel.h
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "types.h"
+
+int load_channels(const char *path, TranscoderContext **channels, int *count);
+void free_channels(TranscoderContext *channels, int count);
+void channel_set_fast_start(int enable);
+const char *startup_milestone_name(int milestone);
+void channel_mark_startup(TranscoderContext *ctx, StartupMilestone milestone);
+int channel_open(TranscoderContext *ctx, WorkPool *pool);
+int channel_start(TranscoderContext *ctx, volatile int *keep_running);
+int channel_wait(TranscoderContext *ctx);
+
+#endif // CHANNEL_H
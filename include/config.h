@@ -5,10 +5,82 @@
 #define PART_DURATION 0.2         // 200ms parts for LL-HLS
 #define SEGMENT_DURATION 1        // 1 second segments
 #define MAX_SEGMENTS_IN_LIST 6    // Keep 6 segments in playlist
-#define BUFFER_SIZE (8192 * 1024) // 8MB buffer
 #define GOP_SIZE 60               // GOP size for keyframes
 #define MAX_QUALITY_LEVELS 3      // Number of quality levels
+#define FRAME_QUEUE_DEPTH 4       // Decoded frames queued per encoder
+#define WRITE_QUEUE_DEPTH 256     // Encoded packets buffered ahead of the muxer
+#define DECODE_QUEUE_DEPTH 8      // Packets read ahead of the decoder
+#define FAST_START 1              // Quick probe, encoders opened in parallel
+#define FAST_START_PROBESIZE 32   // Probe bytes for live inputs (the minimum)
+#define V4L2_BUFFERS 8            // Driver buffers the capture thread drains
+#define V4L2_PREFER_RAW 1         // Capture NV12/YUYV when the bus allows
+#define V4L2_BUS_USABLE 0.6       // Share of USB bandwidth raw video may use
+#define CAPTURE_PRIORITY 10       // SCHED_FIFO priority for live capture
+#define CAPTURE_NICE -10          // Nice value if SCHED_FIFO is not allowed
+#define CAPTURE_GAP 1.5           // Frame intervals between frames for a drop
+#define CAPTURE_CLOCK_SKEW 10     // Seconds a driver timestamp may be off
+#define BUS_SLOTS 12              // Frames in a shared-memory frame bus
+#define BUS_LEASE 2               // Seconds before a reader's slot is taken
+#define BUS_WAIT_MS 100           // Reader wait before checking the producer
+#define TRACE_FRAMES 256          // Frames awaiting publish traced per encoder
+#define LATENCY_STAMPS 0          // Embed capture time (SEI) and prft boxes
+#define DECODE_THREADING DECODE_THREADING_AUTO // Default decode threading
+#define DECODE_MAX_DELAY 2        // Frames frame threading may hold back
+#define DECODE_STAMPS 64          // Packets tracked for the decode delay
+#define TASK_BATCH 4              // Items a task handles before yielding
+#define CORE_BUDGET 0             // Cores to use, 0 for every allowed CPU
+#define PIN_THREADS 0             // Pin input, pool and x264 threads to cores
+#define MAX_CORES 256             // Largest CPU number that can be planned
+#define MAX_CHANNELS 64           // Channels per process
+#define KEYFRAME_ALIGN 1          // Same IDR source frames in all renditions
+#define KEYFRAME_PARTS 0          // Also at part boundaries: independent parts
+#define KEYFRAME_ALIGN_INTERVAL                                                \
+  (KEYFRAME_PARTS ? PART_DURATION : SEGMENT_DURATION)
+#define ALIGN_HISTORY 16          // Boundaries kept for the alignment check
+#define FRAME_RATE_CFR 1          // Duplicate frames across input gaps
+#define MAX_DUPLICATE_FRAMES 4    // Longest gap filled, in output frames
+#define OVERLOAD_CONTROL 1        // Degrade renditions that miss deadlines
+#define OVERLOAD_HIGH 0.9         // Load (busy time / frame time) to degrade
+#define OVERLOAD_LOW 0.6          // Load the next level up must stay under
+#define OVERLOAD_RAISE_FRAMES 5   // Frames over OVERLOAD_HIGH before degrading
+#define OVERLOAD_LOWER_FRAMES 90  // Frames under OVERLOAD_LOW before recovering
+#define STREAM_COPY 1             // Remux the source for a rung it matches
+#define STREAM_COPY_FPS_SLACK 1.01 // Source rate over the preset's still copied
+#define STREAM_COPY_BITRATE_SLACK 1.1 // Likewise for the bitrate
+#define SCALE_MODE SCALE_MODE_CASCADE // Default scaling graph
+#define SIMD_SCALING 1            // Fused kernels for the fixed ladder ratios
+#define SIMD_MAX_PERIOD 8         // Largest horizontal filter period
+#define SIMD_MAX_HTAPS 4          // Horizontal taps per output pixel
+#define SIMD_MAX_VTAPS 8          // Vertical taps per output row
+#define SCENE_DETECT 1            // Reuse scaled frames while nothing changes
+#define SCENE_BLOCK_SAD 3         // Mean difference per byte a block may have
+#define SCENE_ROW_STEP 2          // Rows compared, 1 in N (N divides 16)
+#define AUDIO 1                   // Encode the input's audio track, if any
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_CHANNELS 2
+#define AUDIO_BITRATE 128000      // AAC-LC, shared by every rendition
+#define AUDIO_QUEUE_DEPTH 64      // Packets read ahead of the audio encoder
+#define AUDIO_CAPTURE_PERIOD 0.01 // Seconds a capture device buffers per read
+#define AUDIO_MAX_DRIFT 0.02      // Seconds off before samples are padded
+#define CACHE_LINE_SIZE 64        // Padding for cross-thread ring indices
+#define POOL_ALIGN 64             // Pooled buffer and plane alignment
+#define POOL_HUGE_PAGES 0         // Back pools with 2 MB pages by default
+#define HUGE_PAGE_SIZE (2 << 20)
+#define QUEUE_SPARE_SHELLS 4      // Recycled frames/packets beyond capacity
+#define LATENCY_SUB_BUCKETS 16    // Histogram resolution per power of two
+#define LATENCY_BUCKETS (40 * LATENCY_SUB_BUCKETS) // Up to 2^43 ns, ~2.4 h
 #define MONITORING_INTERVAL 1     // Stats update interval (seconds)
+#define METRICS_POLL_INTERVAL_MS 200 // Metrics/HTTP thread shutdown latency
+#define HTTP_MAX_CONNECTIONS 64   // Concurrent origin/metrics clients
+#define HTTP_IDLE_TIMEOUT 5       // Keep-alive idle timeout (seconds)
+#define ORIGIN_SEGMENTS 24        // Segments kept in RAM per rendition
+#define ORIGIN_MAX_SEGMENT_PARTS 32 // Longest segment, in parts
+#define OFFLINE_CHUNK_DURATION 10 // Seconds per offline chunk, whole segments
+#define OFFLINE_CHUNKS_PER_WORKER 2 // Encoded ahead of the muxer, per worker
+#define OFFLINE_PRESET "veryfast" // x264 preset when nobody waits on frames
 #define DEBUG_MODE 1              // Enable debug output
+#define DEFAULT_VIDEO_DEVICE "/dev/video0"
+#define DEFAULT_VIDEO_SIZE "1920x1080"
+#define DEFAULT_FRAMERATE "30"    // Used when a source does not report one
 
 #endif // CONFIG_H
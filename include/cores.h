@@ -0,0 +1,18 @@
+// cores.h
+#ifndef CORES_H
+#define CORES_H
+
+#include "types.h"
+
+void cores_set_budget(int cores);
+void cores_set_pinning(int enable);
+int cores_available(void);
+int cores_plan(TranscoderContext *channels, int count);
+void cores_pin_thread(const CoreSet *cores, const char *name);
+void cores_raise_priority(const char *name);
+int cores_open_codec(AVCodecContext *avctx, const AVCodec *codec,
+                     AVDictionary **opts, const CoreSet *cores,
+                     const char *name);
+void cores_print_usage(void);
+
+#endif // CORES_H
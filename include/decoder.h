@@ -4,7 +4,13 @@
 
 #include "types.h"
 
-int open_input(TranscoderContext *ctx);
+int parse_decode_threading(const char *name, DecodeThreading *threading);
 int init_decoder(TranscoderContext *ctx);
+void decoder_packet_sent(TranscoderContext *ctx, const AVPacket *packet,
+                         int64_t now);
+int decoder_wrap_raw(TranscoderContext *ctx, const AVPacket *packet,
+                     AVFrame *frame);
+void decoder_frame_out(TranscoderContext *ctx, const AVFrame *frame,
+                       int64_t now);
 
 #endif // DECODER_H
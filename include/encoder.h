@@ -4,7 +4,21 @@
 
 #include "types.h"
 
-int init_encoder(EncoderContext *enc, AVCodecContext *dec_ctx,
-                 QualityPreset *preset, const char *output_dir);
+void encoder_set_latency_stamps(int enable);
+int init_hls_output(AVFormatContext **fmt_ctx, AVStream **stream,
+                    const AVCodecContext *enc_ctx, const char *name,
+                    const char *output_dir, int vod);
+int encoder_open_offline(AVCodecContext **enc_ctx,
+                         const QualityPreset *preset);
+int init_vod_output(EncoderContext *enc, QualityPreset *preset,
+                    const char *output_dir);
+int init_encoder(EncoderContext *enc, QualityPreset *preset);
+int encoder_follow_source(EncoderContext *enc);
+int encoder_can_copy(const AVCodecParameters *par, AVRational frame_rate,
+                     const QualityPreset *preset);
+int init_copy(EncoderContext *enc, QualityPreset *preset,
+              const AVCodecParameters *par, AVRational time_base);
+int init_encoder_output(EncoderContext *enc, const char *output_dir,
+                        OriginStream *origin);
 
 #endif // ENCODER_H
@@ -0,0 +1,16 @@
+// frame_bus.h
+#ifndef FRAME_BUS_H
+#define FRAME_BUS_H
+
+#include "types.h"
+
+int frame_bus_create(FrameBus *bus, const AVCodecContext *dec,
+                     AVRational time_base, AVRational frame_rate);
+int frame_bus_publish(FrameBus *bus, const AVFrame *frame);
+int frame_bus_attach(FrameBus *bus, const char *name, AVRational *time_base,
+                     AVRational *frame_rate);
+void frame_bus_describe(const FrameBus *bus, AVCodecParameters *par);
+int frame_bus_read(FrameBus *bus, AVPacket *packet);
+void frame_bus_close(FrameBus *bus);
+
+#endif // FRAME_BUS_H
@@ -0,0 +1,22 @@
+// frame_queue.h
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include "types.h"
+
+int init_frame_queue(FrameQueue *q, int capacity, DropPolicy policy);
+void free_frame_queue(FrameQueue *q);
+int frame_queue_push(FrameQueue *q, const AVFrame *frame);
+AVFrame *frame_queue_try_pop(FrameQueue *q);
+void frame_queue_release(FrameQueue *q, AVFrame *frame);
+void frame_queue_close(FrameQueue *q);
+int frame_queue_finished(FrameQueue *q);
+
+// Packet queues are closed and freed with the frame queue functions
+int init_packet_queue(PacketQueue *q, int capacity, DropPolicy policy);
+int packet_queue_push(PacketQueue *q, AVPacket *packet);
+AVPacket *packet_queue_pop(PacketQueue *q);
+AVPacket *packet_queue_try_pop(PacketQueue *q);
+void packet_queue_release(PacketQueue *q, AVPacket *packet);
+
+#endif // FRAME_QUEUE_H
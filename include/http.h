@@ -0,0 +1,22 @@
+// http.h
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "types.h"
+
+int http_server_start(HttpServer *srv, const char *addr, HttpHandler handler,
+                      void *opaque);
+void http_server_stop(HttpServer *srv);
+int http_send_head(int fd, const HttpRequest *req, int status,
+                   const char *content_type, const char *extra_headers,
+                   size_t content_length);
+int http_send_data(int fd, const void *data, size_t size);
+int http_send_response(int fd, const HttpRequest *req, int status,
+                       const char *content_type, const char *extra_headers,
+                       const void *body, size_t size);
+int http_send_error(int fd, const HttpRequest *req, int status);
+int http_query_int(const HttpRequest *req, const char *name, int64_t *value);
+int http_query_has(const HttpRequest *req, const char *name,
+                   const char *value);
+
+#endif // HTTP_H
@@ -0,0 +1,15 @@
+// latency.h
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "types.h"
+
+void latency_init(LatencyHistogram *h);
+void latency_record(LatencyHistogram *h, int64_t ns);
+int64_t latency_since(LatencyHistogram *h, int64_t start_ns);
+int64_t latency_now_ns(void);
+int64_t latency_percentile(LatencyHistogram *h, double percentile);
+double latency_mean(LatencyHistogram *h);
+uint64_t latency_count_le(LatencyHistogram *h, int64_t value);
+
+#endif // LATENCY_H
@@ -0,0 +1,12 @@
+// metrics.h
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "types.h"
+#include <libavutil/bprint.h>
+
+void metrics_render(TranscoderContext *ctx, AVBPrint *bp);
+int metrics_start(TranscoderContext *ctx);
+void metrics_stop(TranscoderContext *ctx);
+
+#endif // METRICS_H
@@ -0,0 +1,9 @@
+// offline.h
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include "types.h"
+
+int offline_transcode(TranscoderContext *ctx, volatile int *keep_running);
+
+#endif // OFFLINE_H
@@ -0,0 +1,11 @@
+// options.h
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "types.h"
+
+void print_usage(const char *prog);
+int parse_options(int argc, char *argv[], TranscoderContext *ctx,
+                  const char **channels_file);
+
+#endif // OPTIONS_H
@@ -0,0 +1,13 @@
+// origin.h
+#ifndef ORIGIN_H
+#define ORIGIN_H
+
+#include "types.h"
+
+int origin_open_stream(OriginStream *s, const char *name,
+                       const AVCodecContext *enc_ctx, int prft);
+int origin_write_packet(OriginStream *s, AVPacket *packet);
+int origin_start(TranscoderContext *ctx);
+void origin_stop(TranscoderContext *ctx);
+
+#endif // ORIGIN_H
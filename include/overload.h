@@ -0,0 +1,16 @@
+// overload.h
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include "types.h"
+
+void overload_init(OverloadControl *oc, const QualityPreset *preset,
+                   int can_shed);
+int overload_admit(OverloadControl *oc, size_t queued, int keyframe);
+void overload_update(OverloadControl *oc, int64_t busy_ns, size_t queued,
+                     size_t depth);
+int overload_take_resume(OverloadControl *oc);
+const char *overload_level_name(int level);
+const char *overload_skip_name(int skip);
+
+#endif // OVERLOAD_H
@@ -0,0 +1,22 @@
+// pool.h
+#ifndef POOL_H
+#define POOL_H
+
+#include "types.h"
+
+// Decoded frames, plus scaled frames, packet data, frame shells and packet
+// shells per rendition
+#define POOL_COUNT (1 + 4 * MAX_QUALITY_LEVELS)
+
+void pool_set_huge_pages(int enable);
+void buffer_pool_init(BufferPool *p, const char *name);
+void buffer_pool_uninit(BufferPool *p);
+AVBufferRef *buffer_pool_get(BufferPool *p, size_t size);
+int buffer_pool_get_frame(BufferPool *p, AVFrame *frame, int width,
+                          int height);
+void pool_attach_decoder(BufferPool *p, AVCodecContext *dec_ctx);
+void pool_attach_encoder(BufferPool *p, AVCodecContext *enc_ctx);
+double pool_hit_rate(PoolStats *stats);
+int pool_list(TranscoderContext *ctx, PoolInfo *pools);
+
+#endif // POOL_H
@@ -6,4 +6,6 @@
 
 extern QualityPreset QUALITY_PRESETS[MAX_QUALITY_LEVELS];
 
+int select_renditions(TranscoderContext *ctx, const char *list);
+
 #endif // PRESETS_H
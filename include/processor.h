@@ -4,6 +4,10 @@
 
 #include "types.h"
 
+int start_encoder_workers(TranscoderContext *ctx);
+void stop_encoder_workers(TranscoderContext *ctx);
 int process_frame(TranscoderContext *ctx, AVFrame *frame);
+int run_input_loop(TranscoderContext *ctx, volatile int *keep_running,
+                   int64_t max_frames);
 
 #endif // PROCESSOR_H
@@ -0,0 +1,13 @@
+// scaler.h
+#ifndef SCALER_H
+#define SCALER_H
+
+#include "types.h"
+
+int init_scaler(EncoderContext *enc, int src_width, int src_height,
+                enum AVPixelFormat src_fmt);
+int init_scaling_graph(TranscoderContext *ctx);
+int get_scaled_buffer(EncoderContext *enc, AVFrame *frame);
+int scale_frame(EncoderContext *enc, const AVFrame *src, AVFrame *dst);
+
+#endif // SCALER_H
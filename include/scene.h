@@ -0,0 +1,12 @@
+// scene.h
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "types.h"
+
+void scene_init(SceneDetector *d);
+void scene_free(SceneDetector *d);
+int scene_mark(SceneDetector *d, AVFrame *frame);
+int scene_unchanged(const EncoderContext *enc, const AVFrame *frame);
+
+#endif // SCENE_H
@@ -0,0 +1,17 @@
+// simd_scale.h
+#ifndef SIMD_SCALE_H
+#define SIMD_SCALE_H
+
+#include "types.h"
+
+SimdLevel simd_detect_level(void);
+const char *simd_level_name(SimdLevel level);
+int simd_scaler_init(SimdScaler *s, int src_width, int src_height,
+                     enum AVPixelFormat src_fmt, int dst_width, int dst_height,
+                     enum AVPixelFormat dst_fmt, SimdLevel level);
+void simd_scaler_free(SimdScaler *s);
+void simd_scale(SimdScaler *s, const uint8_t *const src[],
+                const int src_stride[], uint8_t *const dst[],
+                const int dst_stride[]);
+
+#endif // SIMD_SCALE_H
@@ -0,0 +1,16 @@
+// source.h
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include "types.h"
+
+int parse_source_type(const char *name, SourceType *type);
+const char *source_type_name(SourceType type);
+int source_is_live(const SourceConfig *cfg);
+int source_open_demuxer(const SourceConfig *cfg, int quick_probe,
+                        AVFormatContext **input_ctx);
+int open_input(TranscoderContext *ctx);
+void pace_packet(TranscoderContext *ctx, const AVPacket *packet);
+void capture_note_packet(TranscoderContext *ctx, AVPacket *packet);
+
+#endif // SOURCE_H
@@ -6,6 +6,238 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+typedef enum DropPolicy {
+  DROP_POLICY_NEWEST, // Discard the incoming frame when the queue is full
+  DROP_POLICY_BLOCK,  // Make the producer wait for a free slot
+} DropPolicy;
+
+typedef enum SourceType {
+  SOURCE_V4L2,  // Capture device
+  SOURCE_FILE,  // Recorded footage, any container FFmpeg can probe
+  SOURCE_LAVFI, // Synthetic test pattern from a libavfilter graph
+  SOURCE_PIPE,  // Container or elementary stream on stdin
+  SOURCE_RAW,   // Headerless raw video from a file or stdin
+  SOURCE_BUS,   // Decoded frames another process publishes on a frame bus
+} SourceType;
+
+typedef struct SourceConfig {
+  SourceType type;
+  const char *url;          // Device, path, filter graph or "-" for stdin
+  const char *format;       // Demuxer override
+  const char *video_size;   // e.g. "1920x1080"
+  const char *framerate;    // e.g. "30"
+  const char *pixel_format; // V4L2 input_format or rawvideo pixel format
+  int realtime;             // Pace reads at the native frame rate
+} SourceConfig;
+
+// What the capture thread sees of the source. Frames missing between two
+// captured ones were dropped by the driver because no buffer was free;
+// frames captured but discarded because decoding fell behind are counted
+// by the decode queue.
+typedef struct CaptureStats {
+  atomic_uint_fast64_t frames;
+  atomic_uint_fast64_t driver_dropped;
+  atomic_uint_fast64_t gaps; // Times one or more frames went missing
+  int64_t last_ts;           // Previous frame's time, AV_TIME_BASE units
+} CaptureStats;
+
+// One end of a frame bus: a ring of decoded frames in POSIX shared memory
+// that a capture process fills and encoder processes read in place.
+typedef struct FrameBus {
+  const char *name;              // Shared memory object, without the slash
+  const char *size;              // Producer: WxH to pre-scale to, or NULL
+  struct FrameBusHeader *header; // Mapping, NULL when not open
+  size_t map_size;
+  int producer;
+  uint64_t next;                 // Consumer: next sequence number to read
+  struct SwsContext *sws;        // Producer: pre-scaler, NULL to copy as is
+  atomic_uint_fast64_t frames;   // Published, or read by a consumer
+  atomic_uint_fast64_t busy;     // Producer: slots passed over while read
+  atomic_uint_fast64_t missed;   // Consumer: frames overwritten unread
+} FrameBus;
+
+typedef enum ScaleMode {
+  SCALE_MODE_DIRECT,  // Every rendition scales from the decoded frame
+  SCALE_MODE_CASCADE, // Each rendition scales from the one above it
+} ScaleMode;
+
+// Log-linear histogram of durations in nanoseconds (or any other
+// non-negative quantity, e.g. queue depth or bytes): LATENCY_SUB_BUCKETS
+// linear buckets per power of two, so every bucket is within ~6% of its
+// value. Recording is a couple of relaxed atomic adds, safe from any thread.
+typedef struct LatencyHistogram {
+  atomic_uint_fast64_t buckets[LATENCY_BUCKETS];
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t sum_ns;
+  atomic_int_fast64_t max_ns;
+} LatencyHistogram;
+
+typedef enum SimdLevel {
+  SIMD_LEVEL_SCALAR,
+  SIMD_LEVEL_SSE41,
+  SIMD_LEVEL_AVX2,
+} SimdLevel;
+
+// One plane of a fused resize + chroma subsampling + range conversion pass.
+// The horizontal filter repeats every period_in source pixels, which is what
+// lets the SIMD paths use fixed shuffle masks.
+typedef struct SimdPlaneScaler {
+  int src_width;
+  int src_height;
+  int dst_width;
+  int dst_height;
+  int period_in;
+  int period_out;
+  int htaps;
+  uint8_t htap_offset[SIMD_MAX_PERIOD][SIMD_MAX_HTAPS];
+  int8_t htap_weight[SIMD_MAX_PERIOD][SIMD_MAX_HTAPS];
+  int windows;       // 16-byte source loads per 8 outputs
+  int window_inputs; // Source pixels between those loads
+  int group_inputs;  // Source pixels consumed per 8 outputs
+  uint8_t shuffle[2][2][16];
+  int8_t weights[2][16];
+  int *vtap_first;
+  int *vtap_count;
+  int16_t *vtap_weight;
+  uint8_t *line;
+  uint16_t range_mul;
+  uint16_t range_bias;
+  uint8_t range_offset;
+} SimdPlaneScaler;
+
+typedef struct SimdScaler {
+  SimdPlaneScaler planes[3];
+  SimdLevel level;
+} SimdScaler;
+
+// Tells decoded frames that still show the last scene from those that change
+// it, by the SAD of each block of plane 0 against a copy of every
+// SCENE_ROW_STEP-th row of the frame that started the scene. Frames carry
+// the scene's marker in opaque_ref, so a rendition can tell whether the
+// picture it scaled last is still current.
+typedef struct SceneDetector {
+  SimdLevel level;
+  uint8_t *reference; // Sampled rows of the frame that started the scene
+  unsigned reference_size;
+  int width, height, format; // Of that frame
+  uint32_t *sad;             // Per block of the block row being compared
+  unsigned sad_size;
+  AVBufferRef *scene; // Marker of the current scene, new for every change
+  atomic_uint_fast64_t frames;
+  atomic_uint_fast64_t static_frames; // Found to show the scene before
+  LatencyHistogram detect_latency;
+} SceneDetector;
+
+typedef enum TaskState {
+  TASK_IDLE,
+  TASK_QUEUED,
+  TASK_RUNNING,
+  TASK_RERUN, // Scheduled again while running
+} TaskState;
+
+// A unit of work for the shared pool. A task is queued at most once and never
+// runs on two threads at the same time, so its function can own per-task
+// state (a codec context, a queue's consumer side) without locking.
+typedef struct Task {
+  void (*run)(struct Task *task);
+  void *opaque;
+  atomic_int state;
+} Task;
+
+// One worker's share of queued tasks. The owner takes the newest task, which
+// keeps a cascade's next rendition on the core that just produced its input;
+// idle workers steal the oldest.
+typedef struct WorkQueue {
+  pthread_mutex_t lock;
+  Task **tasks;
+  size_t head;
+  size_t count;
+  size_t capacity;
+} WorkQueue;
+
+typedef struct WorkPool {
+  WorkQueue *queues;
+  pthread_t *threads;
+  int thread_count;
+  int started;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  atomic_int pending; // Tasks sitting in a queue
+  atomic_uint next_queue;
+  atomic_int stopping;
+  atomic_uint_fast64_t runs;
+  atomic_uint_fast64_t steals;
+} WorkPool;
+
+typedef enum DecodeThreading {
+  DECODE_THREADING_AUTO,  // Slices if the decoder has them, else frames
+  DECODE_THREADING_NONE,  // Decode on the decode task's thread only
+  DECODE_THREADING_SLICE, // Split each frame; adds no delay
+  DECODE_THREADING_FRAME, // Frames in parallel; adds threads - 1 frames
+} DecodeThreading;
+
+typedef struct DecodeConfig {
+  DecodeThreading threading;
+  int threads;   // 0 for one per core in the budget
+  int max_delay; // Frames frame threading may add, 0 for DECODE_MAX_DELAY
+} DecodeConfig;
+
+// When a packet still in the decoder was sent, to measure how long the
+// decoder holds on to it
+typedef struct DecodeStamp {
+  int64_t pts;
+  int64_t sent_ns;
+} DecodeStamp;
+
+// Cheaper ways to run a rendition, tried in order while it keeps missing
+// its frame deadline.
+typedef enum OverloadLevel {
+  OVERLOAD_NONE,      // Every frame encoded
+  OVERLOAD_HALF_RATE, // Every other frame encoded
+  OVERLOAD_DROP_LATE, // Half rate, and frames with newer ones queued skipped
+  OVERLOAD_SHED,      // Not encoded; renditions scaled from it still fed
+  OVERLOAD_LEVELS,
+} OverloadLevel;
+
+typedef enum OverloadSkip {
+  OVERLOAD_SKIP_RATE, // Decimated at half rate
+  OVERLOAD_SKIP_LATE, // Superseded by a newer queued frame
+  OVERLOAD_SKIP_SHED, // Rendition shed
+  OVERLOAD_SKIPS,
+} OverloadSkip;
+
+typedef struct OverloadControl {
+  int enabled;   // Only renditions allowed to drop frames degrade
+  int max_level; // The last rendition of a ladder is never shed
+  double deadline_ns;
+  double load; // Moving average of busy time over the frame budget
+  int over;    // Consecutive frames above OVERLOAD_HIGH
+  int under;   // Consecutive frames below OVERLOAD_LOW
+  uint64_t frames;
+  int resume; // Next encoded frame must be a keyframe
+  atomic_int level;
+  atomic_int load_percent;
+  atomic_uint_fast64_t raised;
+  atomic_uint_fast64_t lowered;
+  atomic_uint_fast64_t skipped[OVERLOAD_SKIPS];
+} OverloadControl;
+
+// Source PTS each recent keyframe boundary landed on, so every rendition
+// can check that it put its keyframe on the same source frame.
+typedef struct KeyframeTimeline {
+  pthread_mutex_t lock;
+  int64_t boundary[ALIGN_HISTORY]; // Index, or next to a copy the source pts
+  int64_t pts[ALIGN_HISTORY];
+} KeyframeTimeline;
+
+// CPUs a thread (and every thread it starts) may run on; empty for any.
+typedef struct CoreSet {
+  int cpus[MAX_CORES];
+  int count;
+} CoreSet;
 
 typedef struct QualityPreset {
   int width;
@@ -14,49 +246,321 @@ typedef struct QualityPreset {
   int bitrate;
   const char *name;
   int keyframe_interval;
-  int dropped_frames;
-  int total_frames;
+  int scale_flags;
+  int queue_depth;
+  DropPolicy drop_policy;
+  int threads; // Encoder threads, 0 lets x264 decide
 } QualityPreset;
 
-typedef struct BufferManager {
-  uint8_t *buffer;
-  size_t size;
-  size_t write_pos;
-  size_t read_pos;
-  pthread_mutex_t mutex;
-  int is_full;
-} BufferManager;
+typedef enum RingItemType {
+  RING_ITEM_FRAME,  // AVFrame references
+  RING_ITEM_PACKET, // AVPacket references
+} RingItemType;
+
+// Single-producer/single-consumer ring of frame or packet references. The
+// indices only ever increase; each lives on its own cache line next to the
+// side's cached copy of the other index, so the fast path never touches a
+// line owned by the other thread.
+typedef struct RingBuffer {
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // Written by the producer
+  size_t cached_head;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // Written by the consumer
+  size_t cached_tail;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t high_water;
+  atomic_uint_fast64_t dropped;
+  void **slots;
+  size_t depth;
+  RingItemType type;
+} RingBuffer;
+
+typedef struct PoolStats {
+  atomic_uint_fast64_t requests;
+  atomic_uint_fast64_t misses;  // Requests served by a fresh allocation
+  atomic_int_fast64_t resident; // Bytes currently allocated
+} PoolStats;
+
+// Fixed-size buffers recycled through an AVBufferPool, optionally backed by
+// huge pages. The pool grows when asked for a larger buffer.
+typedef struct BufferPool {
+  const char *name;
+  AVBufferPool *pool;
+  size_t size; // Size of every buffer in pool
+  pthread_mutex_t lock;
+  PoolStats stats;
+} BufferPool;
+
+typedef struct PoolInfo {
+  const char *name;
+  const char *rendition; // NULL for pools shared by all renditions
+  PoolStats *stats;
+} PoolInfo;
+
+typedef struct FrameQueue {
+  RingBuffer ring;
+  sem_t items; // Frames ready for the consumer
+  sem_t slots; // Free slots, only waited on with DROP_POLICY_BLOCK
+  atomic_int closed;
+  DropPolicy drop_policy;
+  RingBuffer spare; // Blank frames/packets handed back by the consumer
+  PoolStats shells;
+} FrameQueue;
+
+// Same machinery holding AVPackets; the ring knows which type it frees
+typedef FrameQueue PacketQueue;
+
+typedef struct HttpRequest {
+  char method[8];
+  char path[512];    // Without the query string
+  const char *query; // Points into path storage, "" if there is none
+  int keep_alive;
+} HttpRequest;
+
+// Writes the complete response to fd. Returning < 0 closes the connection.
+typedef int (*HttpHandler)(void *opaque, const HttpRequest *req, int fd);
+
+typedef struct HttpServer {
+  const char *addr; // host:port or unix:/path
+  HttpHandler handler;
+  void *opaque;
+  int listen_fd;
+  pthread_t thread;
+  int thread_running;
+  atomic_int stopping;
+  atomic_int connections;
+} HttpServer;
+
+typedef struct MetricsExporter {
+  const char *listen; // host:port or unix:/path, NULL to disable
+  const char *file;   // Rewritten every MONITORING_INTERVAL, NULL to disable
+  HttpServer server;
+  pthread_t thread;
+  int thread_running;
+} MetricsExporter;
+
+typedef struct OriginPart {
+  AVBufferRef *data; // One moof+mdat fragment
+  double duration;
+  int independent; // Starts with a keyframe
+} OriginPart;
+
+typedef struct OriginSegment {
+  int64_t msn; // Media sequence number
+  OriginPart parts[ORIGIN_MAX_SEGMENT_PARTS];
+  int part_count;
+  double duration;
+  int64_t program_date_time; // Wall clock at the first frame, in us
+  int complete;
+} OriginSegment;
+
+// One rendition held in RAM: an fMP4 fragmenter cutting parts on the writer
+// thread, and the recent segments that HTTP clients read. Everything below
+// lock is shared with the server threads.
+typedef struct OriginStream {
+  const char *name;
+  AVFormatContext *mux;
+  int64_t part_target;    // PART_DURATION in stream time base
+  int64_t segment_target; // SEGMENT_DURATION in stream time base
+  int64_t part_start;     // pts of the first packet in the open part
+  int64_t segment_start;
+  int64_t last_end; // pts + duration of the last packet written
+  int part_keyframe;
+  int part_packets;
+  uint64_t parts_published; // Writer thread only
+  int target_duration;
+
+  pthread_mutex_t lock;
+  pthread_cond_t updated;
+  AVBufferRef *init;
+  OriginSegment segments[ORIGIN_SEGMENTS]; // Indexed by msn % ORIGIN_SEGMENTS
+  int64_t next_msn; // Segment currently being filled, -1 before the first
+  int closed;
+} OriginStream;
+
+typedef struct Origin {
+  const char *listen; // host:port or unix:/path, NULL to write files
+  const char *output_dir;
+  const QualityPreset *presets;
+  int renditions;
+  OriginStream streams[MAX_QUALITY_LEVELS];
+  OriginStream audio; // Shared by every rendition, unused without audio
+  HttpServer server;
+} Origin;
+
+// Audio encoded once per channel and muxed as a rendition of its own, which
+// the master playlist groups with every video rendition. Everything but the
+// counters belongs to the audio thread while it runs.
+typedef struct AudioContext {
+  const char *source; // "input", "none" or format:device; NULL for auto
+  AVFormatContext *device_ctx; // Capture device, when not the input's track
+  int stream_index;            // Input track fed through queue, or -1
+  PacketQueue queue;           // Packets the input thread read for it
+  AVRational time_base;        // Of the packets decoded
+  AVCodecContext *dec_ctx;
+  AVCodecContext *enc_ctx;
+  struct SwrContext *swr;
+  struct AVAudioFifo *fifo; // Resampled samples not yet encoded
+  AVFrame *frame;           // Decoded
+  AVFrame *enc_frame;       // One encoder frame of samples
+  AVPacket *packet;         // Read from the device
+  AVPacket *encoded;
+  int64_t next_pts; // First sample in fifo, AV_NOPTS_VALUE until placed
+  AVFormatContext *fmt_ctx;
+  AVStream *stream;
+  OriginStream *origin; // NULL when the HLS muxer writes to disk
+  int lock_fd;          // Holds audio/ against other processes, or -1
+  pthread_t thread;
+  int thread_running;
+  atomic_int stop;
+  LatencyHistogram encode_latency; // Encode and mux, per encoder frame
+  LatencyHistogram sync_offset;    // Samples off their timestamps
+  atomic_uint_fast64_t encoded_frames;
+  atomic_uint_fast64_t dropped_packets; // Not decoded or not muxed
+  atomic_uint_fast64_t bytes_out;
+} AudioContext;
 
 typedef struct EncoderContext {
   AVCodecContext *enc_ctx;
   AVStream *stream;
   AVFormatContext *fmt_ctx;
   struct SwsContext *sws_ctx;
+  SimdScaler simd;
+  int use_simd;
+  int passthrough;       // Source already in the encoder's size and format
+  int copy;              // Source packets remuxed as they are, nothing encoded
+  int follow_source;     // Keyframes only where the source has them
+  int64_t copy_origin;   // Source pts of the first packet copied
+  AVBufferRef *scene;    // Scene of the last frame scaled, see SceneDetector
+  int64_t scale_avg_ns;  // Recent scale and encode time of frames that
+  int64_t encode_avg_ns; // changed the scene, to estimate the savings
   AVFrame *scaled_frame;
-  BufferManager buffer_mgr;
+  AVPacket *packet;       // Reused for every packet the encoder returns
+  BufferPool frame_pool;  // Scaled frames
+  BufferPool packet_pool; // Encoded packet data
+  LatencyHistogram scale_latency;
+  LatencyHistogram send_latency;
+  LatencyHistogram receive_latency;
+  LatencyHistogram write_latency;
+  LatencyHistogram encode_latency;    // send_frame + receive_packet per frame
+  LatencyHistogram publish_latency;   // Write that closes a segment
+  LatencyHistogram queue_depth;       // Frames waiting, sampled at each pop
+  LatencyHistogram packet_size;       // Bytes per muxed packet
+  LatencyHistogram write_queue_depth; // Packets waiting, sampled at each pop
+  LatencyHistogram publish_age;       // Capture to the frame's part published
+  int64_t traced[TRACE_FRAMES]; // Capture times of frames not yet published
+  int latency_stamps;           // Capture time SEI on every frame
+  int traced_count;
+  atomic_uint_fast64_t encoded_frames;
+  atomic_uint_fast64_t dropped_frames;
+  atomic_uint_fast64_t decimated_frames;  // Input frames beyond the preset fps
+  atomic_uint_fast64_t duplicated_frames; // Encoded again to fill input gaps
+  atomic_uint_fast64_t static_frames;     // Previous scaled frame reused
+  atomic_uint_fast64_t static_saved_ns;   // Scale and encode time not spent
+  atomic_uint_fast64_t bytes_out;
+  atomic_uint_fast64_t segments;
+  OriginStream *origin; // NULL when the HLS muxer writes to disk
+  struct EncoderContext *downstream;
+  int has_upstream;
+  FrameQueue input_queue;
+  Task task; // Scales and encodes whatever input_queue holds
+  int task_running;
+  int flushed;
+  CoreSet cores; // Where its x264 threads run, one thread per core
+  OverloadControl overload;
+  struct TranscoderContext *channel;
+  PacketQueue write_queue; // Encoded packets waiting for the muxer
+  pthread_t writer_thread;
+  int writer_running;
+  AVRational src_time_base;
   QualityPreset *preset;
-  int64_t next_pts;
+  int64_t next_pts;        // First output slot not yet filled
+  int64_t next_boundary;   // Next keyframe boundary of the shared timeline
+  int64_t first_write_pts; // First packet muxed, for startup milestones
+  atomic_uint_fast64_t forced_keyframes;
+  atomic_uint_fast64_t misaligned_keyframes; // On another source frame
   int64_t last_dts;
   int64_t last_pts;
   double segment_start_time;
   int segment_index;
   double frame_time;
-  int64_t first_pts;
 } EncoderContext;
 
+// Points in a channel's start viewers wait for
+typedef enum StartupMilestone {
+  STARTUP_FIRST_FRAME,    // First input frame handed to the encoders
+  STARTUP_FIRST_PART,     // First part of any rendition complete
+  STARTUP_FIRST_PLAYLIST, // A playlist a player can start from
+  STARTUP_MILESTONES,
+} StartupMilestone;
+
+typedef struct StartupTimes {
+  int64_t started; // When channel_open() began, av_gettime_relative()
+  atomic_int_fast64_t reached[STARTUP_MILESTONES]; // Us after, 0 until then
+} StartupTimes;
+
+// One input and its ladder. Any number of channels share a WorkPool.
 typedef struct TranscoderContext {
   AVFormatContext *input_ctx;
   AVCodecContext *dec_ctx;
   AVFrame *frame;
   AVPacket *packet;
+  QualityPreset presets[MAX_QUALITY_LEVELS]; // The ones this process runs
+  int renditions;
+  int copies; // Renditions remuxed from the source rather than encoded
+  WorkPool *pool;
+  PacketQueue decode_queue; // Packets read but not yet decoded
+  Task decode_task;
+  sem_t decode_done;
+  int decode_flushed;
+  atomic_int decode_error;
+  sem_t tasks_done; // Posted by each encoder task once flushed
+  pthread_t input_thread; // Capture: reads the input into decode_queue
+  CoreSet input_cores;
+  CaptureStats capture;
+  int input_running;
+  int input_result;
+  volatile int *keep_running;
+  char *args; // Channel file line the options point into
+  BufferPool frame_pool; // Decoded frames
   EncoderContext encoders[MAX_QUALITY_LEVELS];
+  AudioContext audio;
+  SourceConfig source;
+  FrameBus bus;          // Frames published to, or read from, other processes
+  AVRational time_base;  // Of input timestamps
+  AVRational frame_rate; // Of the input, as probed or given
+  int64_t pace_wall_start;
+  int64_t pace_pts_start;
   char *output_dir;
+  ScaleMode scale_mode;
   int video_stream_index;
+  LatencyHistogram read_latency;
+  LatencyHistogram decode_latency;
+  LatencyHistogram decode_delay; // Packet sent to its frame coming out
+  int raw_input;                 // Frames are wrapped, not decoded
+  DecodeConfig decode;
+  DecodeStamp decode_stamps[DECODE_STAMPS];
+  int decode_stamp_next;
+  atomic_int decode_in_flight; // Packets sent without a frame out yet
+  atomic_int_fast64_t decoded_frames;
+  SceneDetector scene;
   pthread_t monitor_thread;
+  int monitor_running;
+  MetricsExporter metrics;
+  Origin origin;
   volatile int running;
   int64_t start_time;
   double frame_duration;
   int64_t last_pts;
+  int64_t first_pts; // Origin of the keyframe timeline and output PTS
+  // Where the output timeline starts, for the audio to be placed on: the
+  // first video frame's pts in time_base and its capture time. Both are
+  // set before timeline_ready.
+  int64_t timeline_pts;
+  int64_t timeline_captured;
+  atomic_int timeline_ready;
+  int fast_start;    // Limit probing and open encoders alongside the input
+  int offline;       // Transcode a file in parallel chunks, see offline.c
+  StartupTimes startup;
+  KeyframeTimeline timeline;
 } TranscoderContext;
 
 #endif // TYPES_H
@@ -2,12 +2,18 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include "types.h"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/bprint.h>
 
 char *ts_to_str(int64_t ts);
 char *time_to_str(int64_t ts, AVRational *tb);
 void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt);
-void write_master_playlist(const char *output_dir);
+void print_master_playlist(AVBPrint *bp, const QualityPreset *presets,
+                           int count, int audio);
+void write_master_playlist(const char *output_dir,
+                           const QualityPreset *presets, int count,
+                           int audio);
 
 #endif // UTILS_H
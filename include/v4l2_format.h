@@ -0,0 +1,10 @@
+// v4l2_format.h
+#ifndef V4L2_FORMAT_H
+#define V4L2_FORMAT_H
+
+#include "types.h"
+
+int v4l2_negotiate_format(const char *device, int width, int height,
+                          AVRational *rate, const char **format);
+
+#endif // V4L2_FORMAT_H
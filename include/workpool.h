@@ -0,0 +1,14 @@
+// workpool.h
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include "types.h"
+
+int work_pool_init(WorkPool *pool, int threads);
+void work_pool_uninit(WorkPool *pool);
+void task_init(Task *task, void (*run)(Task *task), void *opaque);
+void work_pool_schedule(WorkPool *pool, Task *task);
+int work_pool_on_worker(void);
+int work_pool_help(void);
+
+#endif // WORKPOOL_H
@@ -0,0 +1,532 @@
+// audio.c
+// Audio is encoded once per channel, however many renditions there are, on
+// a thread of its own: decoded, resampled to the encoder's format, encoded
+// to AAC and muxed as an audio-only rendition that the master playlist
+// groups with every video rendition. Samples are placed on the video's
+// output timeline, so a player keeps the two in sync at any rendition.
+#include "../include/audio.h"
+#include "../include/cores.h"
+#include "../include/encoder.h"
+#include "../include/frame_queue.h"
+#include "../include/latency.h"
+#include "../include/origin.h"
+#include "../include/source.h"
+#include <libavdevice/avdevice.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Opens the capture device spec names as format:device (e.g. alsa:hw:1 or
+// pulse:default), asking for the encoder's rate and channels so that
+// resampling is usually a plain sample format conversion.
+static int open_device(AudioContext *a, const char *spec) {
+  const char *device = strchr(spec, ':');
+  char format[32];
+  if (!device || device == spec || device - spec >= (int)sizeof(format)) {
+    fprintf(stderr, "Audio source must be input, none or format:device, "
+                    "not %s\n",
+            spec);
+    return AVERROR(EINVAL);
+  }
+  snprintf(format, sizeof(format), "%.*s", (int)(device - spec), spec);
+
+  avdevice_register_all();
+  const AVInputFormat *input_format = av_find_input_format(format);
+  if (!input_format) {
+    fprintf(stderr, "Audio input format %s not found\n", format);
+    return AVERROR_DEMUXER_NOT_FOUND;
+  }
+
+  // A short capture period keeps PulseAudio from buffering ahead of us
+  AVDictionary *options = NULL;
+  av_dict_set_int(&options, "sample_rate", AUDIO_SAMPLE_RATE, 0);
+  av_dict_set_int(&options, "channels", AUDIO_CHANNELS, 0);
+  av_dict_set_int(&options, "fragment_size",
+                  (int)(AUDIO_SAMPLE_RATE * AUDIO_CHANNELS * 2 *
+                        AUDIO_CAPTURE_PERIOD),
+                  0);
+  int ret = avformat_open_input(&a->device_ctx, device + 1, input_format,
+                                &options);
+  av_dict_free(&options);
+  if (ret < 0) {
+    fprintf(stderr, "Cannot open audio input %s: %s\n", spec,
+            av_err2str(ret));
+    return ret;
+  }
+  if (a->device_ctx->nb_streams < 1)
+    return AVERROR_STREAM_NOT_FOUND;
+  a->time_base = a->device_ctx->streams[0]->time_base;
+  return 0;
+}
+
+static int open_decoder(AudioContext *a, const AVCodecParameters *par) {
+  const AVCodec *decoder = avcodec_find_decoder(par->codec_id);
+  if (!decoder) {
+    fprintf(stderr, "No decoder for the audio stream\n");
+    return AVERROR_DECODER_NOT_FOUND;
+  }
+  a->dec_ctx = avcodec_alloc_context3(decoder);
+  if (!a->dec_ctx)
+    return AVERROR(ENOMEM);
+  int ret = avcodec_parameters_to_context(a->dec_ctx, par);
+  if (ret < 0)
+    return ret;
+  a->dec_ctx->pkt_timebase = a->time_base;
+
+  ret = avcodec_open2(a->dec_ctx, decoder, NULL);
+  if (ret < 0)
+    fprintf(stderr, "Could not open audio decoder: %s\n", av_err2str(ret));
+  return ret;
+}
+
+// AAC-LC from the native encoder. Each frame of 1024 samples (21 ms) is
+// encoded as soon as it is complete, with the fast coder, which takes a
+// fraction of the default one's time.
+static int open_encoder(AudioContext *a) {
+  const AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
+  if (!encoder) {
+    fprintf(stderr, "Could not find AAC encoder\n");
+    return AVERROR_ENCODER_NOT_FOUND;
+  }
+  AVCodecContext *enc_ctx = a->enc_ctx = avcodec_alloc_context3(encoder);
+  if (!enc_ctx)
+    return AVERROR(ENOMEM);
+
+  enc_ctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+  enc_ctx->sample_rate = AUDIO_SAMPLE_RATE;
+  av_channel_layout_default(&enc_ctx->ch_layout, AUDIO_CHANNELS);
+  enc_ctx->bit_rate = AUDIO_BITRATE;
+  enc_ctx->time_base = (AVRational){1, AUDIO_SAMPLE_RATE};
+  // Packets carry their capture time to the origin, like video packets
+  enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER | AV_CODEC_FLAG_COPY_OPAQUE;
+
+  AVDictionary *opts = NULL;
+  av_dict_set(&opts, "aac_coder", "fast", 0);
+  int ret = avcodec_open2(enc_ctx, encoder, &opts);
+  av_dict_free(&opts);
+  if (ret < 0) {
+    fprintf(stderr, "Could not open audio encoder: %s\n", av_err2str(ret));
+    return ret;
+  }
+
+  a->enc_frame = av_frame_alloc();
+  if (!a->enc_frame)
+    return AVERROR(ENOMEM);
+  a->enc_frame->format = enc_ctx->sample_fmt;
+  a->enc_frame->sample_rate = enc_ctx->sample_rate;
+  a->enc_frame->nb_samples = enc_ctx->frame_size;
+  if ((ret = av_channel_layout_copy(&a->enc_frame->ch_layout,
+                                    &enc_ctx->ch_layout)) < 0)
+    return ret;
+  return av_frame_get_buffer(a->enc_frame, 0);
+}
+
+// Samples further than AUDIO_MAX_DRIFT from where their timestamps put
+// them, as after a capture overrun or a gap in a recording, are made up
+// with silence or dropped, so the audio never slides away from the video.
+static int open_resampler(AudioContext *a) {
+  AVCodecContext *dec = a->dec_ctx, *enc = a->enc_ctx;
+  AVChannelLayout in_layout;
+  if (dec->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+    av_channel_layout_default(&in_layout, dec->ch_layout.nb_channels);
+  else if (av_channel_layout_copy(&in_layout, &dec->ch_layout) < 0)
+    return AVERROR(ENOMEM);
+
+  int ret = swr_alloc_set_opts2(&a->swr, &enc->ch_layout, enc->sample_fmt,
+                                enc->sample_rate, &in_layout,
+                                dec->sample_fmt, dec->sample_rate, 0, NULL);
+  av_channel_layout_uninit(&in_layout);
+  if (ret < 0)
+    return ret;
+  av_opt_set_double(a->swr, "min_comp", AUDIO_MAX_DRIFT, 0);
+  av_opt_set_double(a->swr, "min_hard_comp", AUDIO_MAX_DRIFT, 0);
+  if ((ret = swr_init(a->swr)) < 0) {
+    fprintf(stderr, "Could not initialize resampler: %s\n", av_err2str(ret));
+    return ret;
+  }
+
+  a->fifo = av_audio_fifo_alloc(enc->sample_fmt, enc->ch_layout.nb_channels,
+                                enc->frame_size);
+  return a->fifo ? 0 : AVERROR(ENOMEM);
+}
+
+static int open_lock(const char *output_dir, int flags) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/audio/.lock", output_dir);
+  return open(path, flags | O_CLOEXEC, 0644);
+}
+
+// Processes that split the ladder over a frame bus share one output
+// directory, and only one of them may write audio/ in it. The writer holds
+// an exclusive lock on audio/.lock, which goes with the process however it
+// ends. Returns 0 if another process holds it.
+static int claim_rendition(AudioContext *a, const char *output_dir) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/audio", output_dir);
+  mkdir(path, 0755);
+
+  int fd = open_lock(output_dir, O_RDWR | O_CREAT);
+  if (fd < 0)
+    return AVERROR(errno);
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    int err = errno;
+    close(fd);
+    return err == EWOULDBLOCK ? 0 : AVERROR(err);
+  }
+  a->lock_fd = fd;
+  return 1;
+}
+
+// True while some other process writes the audio rendition in output_dir.
+int audio_claimed_elsewhere(const char *output_dir) {
+  int fd = open_lock(output_dir, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  int held = flock(fd, LOCK_SH | LOCK_NB) < 0 && errno == EWOULDBLOCK;
+  close(fd);
+  return held;
+}
+
+// Picks the audio source and opens everything the audio thread needs. By
+// default that is the input's audio track, and a channel whose input has
+// none, or whose output directory already has its audio written by another
+// process, stays video only.
+int audio_open(TranscoderContext *ctx) {
+  AudioContext *a = &ctx->audio;
+  const AVCodecParameters *par;
+  int ret;
+
+  a->stream_index = -1;
+  if (a->source ? !strcmp(a->source, "none") : !AUDIO)
+    return 0;
+
+  int device = a->source && strcmp(a->source, "input");
+  int index = -1;
+  if (!device) {
+    index = ctx->input_ctx
+                ? av_find_best_stream(ctx->input_ctx, AVMEDIA_TYPE_AUDIO, -1,
+                                      ctx->video_stream_index, NULL, 0)
+                : AVERROR_STREAM_NOT_FOUND;
+    if (index < 0) {
+      if (!a->source)
+        return 0;
+      fprintf(stderr, "Input has no audio stream\n");
+      return AVERROR_STREAM_NOT_FOUND;
+    }
+  }
+
+  if (!ctx->origin.listen &&
+      (ret = claim_rendition(a, ctx->output_dir)) <= 0) {
+    if (ret < 0)
+      return ret;
+    if (!a->source) {
+      printf("Another process writes %s/audio, staying video only\n",
+             ctx->output_dir);
+      return 0;
+    }
+    fprintf(stderr, "Another process already writes %s/audio\n",
+            ctx->output_dir);
+    return AVERROR(EBUSY);
+  }
+
+  if (device) {
+    if ((ret = open_device(a, a->source)) < 0)
+      return ret;
+    par = a->device_ctx->streams[0]->codecpar;
+  } else {
+    AVStream *stream = ctx->input_ctx->streams[index];
+    par = stream->codecpar;
+    a->time_base = stream->time_base;
+
+    // Like the decode queue: a live input drops rather than waits
+    ret = init_packet_queue(&a->queue, AUDIO_QUEUE_DEPTH,
+                            source_is_live(&ctx->source) ? DROP_POLICY_NEWEST
+                                                         : DROP_POLICY_BLOCK);
+    if (ret < 0)
+      return ret;
+    a->stream_index = index;
+  }
+
+  if ((ret = open_decoder(a, par)) < 0 || (ret = open_encoder(a)) < 0 ||
+      (ret = open_resampler(a)) < 0)
+    return ret;
+
+  a->frame = av_frame_alloc();
+  a->packet = av_packet_alloc();
+  a->encoded = av_packet_alloc();
+  if (!a->frame || !a->packet || !a->encoded)
+    return AVERROR(ENOMEM);
+
+  if (ctx->origin.listen) {
+    ret = origin_open_stream(&ctx->origin.audio, "audio", a->enc_ctx, 0);
+    if (ret < 0)
+      return ret;
+    a->origin = &ctx->origin.audio;
+    a->fmt_ctx = a->origin->mux;
+    a->stream = a->origin->mux->streams[0];
+  } else if ((ret = init_hls_output(&a->fmt_ctx, &a->stream, a->enc_ctx,
+                                    "audio", ctx->output_dir, 0)) < 0) {
+    return ret;
+  }
+
+  a->next_pts = AV_NOPTS_VALUE;
+  latency_init(&a->encode_latency);
+  latency_init(&a->sync_offset);
+  atomic_init(&a->stop, 0);
+  atomic_init(&a->encoded_frames, 0);
+  atomic_init(&a->dropped_packets, 0);
+  atomic_init(&a->bytes_out, 0);
+
+  printf("Initialized audio from %s: %d Hz, %d channels -> AAC %d Hz, %d "
+         "channels, %d kbps\n",
+         a->device_ctx ? a->source : "input", a->dec_ctx->sample_rate,
+         a->dec_ctx->ch_layout.nb_channels, AUDIO_SAMPLE_RATE, AUDIO_CHANNELS,
+         AUDIO_BITRATE / 1000);
+  return 0;
+}
+
+// Muxes one encoded packet, on the audio thread, which is the only one that
+// touches its muxer.
+static int write_packet(AudioContext *a, AVPacket *packet) {
+  int size = packet->size;
+  packet->stream_index = 0;
+  av_packet_rescale_ts(packet, a->enc_ctx->time_base, a->stream->time_base);
+
+  int ret = a->origin ? origin_write_packet(a->origin, packet)
+                      : av_interleaved_write_frame(a->fmt_ctx, packet);
+  av_packet_unref(packet);
+  if (ret < 0)
+    return ret;
+  atomic_fetch_add(&a->bytes_out, size);
+  atomic_fetch_add(&a->encoded_frames, 1);
+  return 0;
+}
+
+// Sends frame (or NULL to flush) to the encoder and muxes what comes out.
+static int encode_and_write(AudioContext *a, AVFrame *frame) {
+  int64_t start = latency_now_ns();
+  int ret = avcodec_send_frame(a->enc_ctx, frame);
+  while (ret >= 0) {
+    ret = avcodec_receive_packet(a->enc_ctx, a->encoded);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      ret = 0;
+    else if (ret >= 0 && (ret = write_packet(a, a->encoded)) >= 0)
+      continue;
+    break;
+  }
+  if (frame)
+    latency_since(&a->encode_latency, start);
+  return ret;
+}
+
+// Encodes every whole encoder frame in the FIFO, and with flush the rest and
+// whatever the encoder still holds. Each frame carries the time its first
+// sample was captured, by the video's clock, for the origin to date
+// segments with.
+static int encode_samples(TranscoderContext *ctx, int flush) {
+  AudioContext *a = &ctx->audio;
+  AVFrame *frame = a->enc_frame;
+  int frame_size = a->enc_ctx->frame_size;
+  int ret = 0;
+
+  while (av_audio_fifo_size(a->fifo) >= (flush ? 1 : frame_size)) {
+    if ((ret = av_frame_make_writable(frame)) < 0)
+      return ret;
+    frame->nb_samples =
+        av_audio_fifo_read(a->fifo, (void **)frame->data, frame_size);
+    frame->pts = a->next_pts;
+    frame->opaque =
+        (void *)(intptr_t)(ctx->timeline_captured +
+                           av_rescale(a->next_pts, AV_TIME_BASE,
+                                      AUDIO_SAMPLE_RATE));
+    a->next_pts += frame->nb_samples;
+    if ((ret = encode_and_write(a, frame)) < 0)
+      return ret;
+  }
+  return flush ? encode_and_write(a, NULL) : 0;
+}
+
+// Time of frame on the output timeline in microseconds, or AV_NOPTS_VALUE
+// if it has none. The input's own track runs on the video's clock. Capture
+// devices stamp samples with the wall clock, as v4l2 does frames, so theirs
+// is placed through the first video frame's capture time.
+static int64_t timeline_time(TranscoderContext *ctx, const AVFrame *frame) {
+  AudioContext *a = &ctx->audio;
+  if (frame->pts == AV_NOPTS_VALUE)
+    return AV_NOPTS_VALUE;
+
+  int64_t t = av_rescale_q(frame->pts, a->time_base, AV_TIME_BASE_Q);
+  if (a->device_ctx)
+    return t - ctx->timeline_captured;
+  return t - av_rescale_q(ctx->timeline_pts, ctx->time_base, AV_TIME_BASE_Q);
+}
+
+// Resamples a decoded frame into the FIFO. Samples from before the first
+// video frame have no place on the timeline and are dropped. From then on
+// the resampler keeps the samples where their timestamps say; how far off
+// they were before that is recorded as the sync offset.
+static int resample_frame(TranscoderContext *ctx, AVFrame *frame) {
+  AudioContext *a = &ctx->audio;
+  if (!atomic_load(&ctx->timeline_ready))
+    return 0;
+
+  int in_rate = a->dec_ctx->sample_rate;
+  int64_t t = timeline_time(ctx, frame);
+  int64_t in_pts = INT64_MIN; // Carries on from the previous frame
+  if (t != AV_NOPTS_VALUE) {
+    in_pts = av_rescale(t, (int64_t)in_rate * AUDIO_SAMPLE_RATE, AV_TIME_BASE);
+    if (a->next_pts != AV_NOPTS_VALUE) {
+      int64_t due = av_rescale(t, AUDIO_SAMPLE_RATE, AV_TIME_BASE);
+      int64_t queued = a->next_pts + av_audio_fifo_size(a->fifo) +
+                       swr_get_delay(a->swr, AUDIO_SAMPLE_RATE);
+      latency_record(&a->sync_offset, av_rescale(llabs(due - queued),
+                                                 1000000000,
+                                                 AUDIO_SAMPLE_RATE));
+    }
+  } else if (a->next_pts == AV_NOPTS_VALUE) {
+    return 0; // Nothing to place the first samples by
+  }
+  int64_t out_pts = swr_next_pts(a->swr, in_pts);
+
+  AVFrame *out = av_frame_alloc();
+  if (!out)
+    return AVERROR(ENOMEM);
+  out->format = a->enc_ctx->sample_fmt;
+  out->sample_rate = a->enc_ctx->sample_rate;
+  int ret = av_channel_layout_copy(&out->ch_layout, &a->enc_ctx->ch_layout);
+  if (ret >= 0)
+    ret = swr_convert_frame(a->swr, out, frame);
+  if (ret >= 0 && out->nb_samples > 0 &&
+      av_audio_fifo_write(a->fifo, (void **)out->data, out->nb_samples) <
+          out->nb_samples)
+    ret = AVERROR(ENOMEM);
+  av_frame_free(&out);
+  if (ret < 0)
+    return ret;
+
+  if (a->next_pts == AV_NOPTS_VALUE)
+    a->next_pts = av_rescale(out_pts, 1, in_rate);
+  if (a->next_pts < 0) {
+    int drop = (int)FFMIN(-a->next_pts, av_audio_fifo_size(a->fifo));
+    av_audio_fifo_drain(a->fifo, drop);
+    a->next_pts += drop;
+  }
+  return 0;
+}
+
+// Decodes packet (NULL to drain) and resamples and encodes what comes out.
+static int decode_packet(TranscoderContext *ctx, const AVPacket *packet) {
+  AudioContext *a = &ctx->audio;
+  int ret = avcodec_send_packet(a->dec_ctx, packet);
+  while (ret >= 0) {
+    ret = avcodec_receive_frame(a->dec_ctx, a->frame);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      return 0;
+    if (ret < 0)
+      return ret;
+    ret = resample_frame(ctx, a->frame);
+    av_frame_unref(a->frame);
+    if (ret >= 0)
+      ret = encode_samples(ctx, 0);
+  }
+  return ret;
+}
+
+// Takes the next packet from the capture device, or from the input thread.
+// Returns NULL once the audio is to stop.
+static AVPacket *next_packet(AudioContext *a) {
+  if (!a->device_ctx)
+    return packet_queue_pop(&a->queue);
+
+  while (!atomic_load(&a->stop)) {
+    int ret = av_read_frame(a->device_ctx, a->packet);
+    if (ret >= 0)
+      return a->packet;
+    if (ret != AVERROR(EAGAIN)) {
+      fprintf(stderr, "Audio capture stopped: %s\n", av_err2str(ret));
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void *audio_thread_func(void *arg) {
+  TranscoderContext *ctx = arg;
+  AudioContext *a = &ctx->audio;
+  AVPacket *packet;
+
+  cores_pin_thread(NULL, "audio");
+  while ((packet = next_packet(a))) {
+    if (decode_packet(ctx, packet) < 0)
+      atomic_fetch_add(&a->dropped_packets, 1);
+    if (a->device_ctx)
+      av_packet_unref(packet);
+    else
+      packet_queue_release(&a->queue, packet);
+  }
+
+  // Everything captured is muxed before the thread exits
+  if (decode_packet(ctx, NULL) < 0 || encode_samples(ctx, 1) < 0)
+    atomic_fetch_add(&a->dropped_packets, 1);
+  return NULL;
+}
+
+// Decoding, resampling and encoding audio takes a small part of one core,
+// so one thread does all of it, muxing included.
+int audio_start(TranscoderContext *ctx) {
+  AudioContext *a = &ctx->audio;
+  if (!a->enc_ctx)
+    return 0;
+  if (pthread_create(&a->thread, NULL, audio_thread_func, ctx) != 0) {
+    fprintf(stderr, "Could not start audio thread\n");
+    return -1;
+  }
+  a->thread_running = 1;
+  return 0;
+}
+
+// Call once the input thread has stopped. Stops capturing, or lets the
+// audio thread drain what the input thread queued, and waits for it to mux
+// the rest.
+void audio_stop(TranscoderContext *ctx) {
+  AudioContext *a = &ctx->audio;
+  if (!a->thread_running)
+    return;
+  atomic_store(&a->stop, 1);
+  if (a->queue.ring.slots)
+    frame_queue_close(&a->queue);
+  pthread_join(a->thread, NULL);
+  a->thread_running = 0;
+}
+
+void audio_free(AudioContext *a) {
+  if (a->fmt_ctx) {
+    av_write_trailer(a->fmt_ctx);
+    if (a->fmt_ctx->pb)
+      avio_closep(&a->fmt_ctx->pb);
+    avformat_free_context(a->fmt_ctx);
+    a->fmt_ctx = NULL;
+  }
+  avcodec_free_context(&a->dec_ctx);
+  avcodec_free_context(&a->enc_ctx);
+  swr_free(&a->swr);
+  if (a->fifo) {
+    av_audio_fifo_free(a->fifo);
+    a->fifo = NULL;
+  }
+  av_frame_free(&a->frame);
+  av_frame_free(&a->enc_frame);
+  av_packet_free(&a->packet);
+  av_packet_free(&a->encoded);
+  if (a->device_ctx)
+    avformat_close_input(&a->device_ctx);
+  free_frame_queue(&a->queue);
+  if (a->lock_fd >= 0) {
+    close(a->lock_fd);
+    a->lock_fd = -1;
+  }
+}
@@ -3,23 +3,102 @@
 #include "../include/config.h"
 #include <libavutil/avutil.h>
 
-int init_buffer_manager(BufferManager *mgr) {
-  mgr->buffer = av_malloc(BUFFER_SIZE);
-  if (!mgr->buffer) {
+int init_ring_buffer(RingBuffer *rb, size_t depth, RingItemType type) {
+  rb->slots = av_calloc(depth, sizeof(*rb->slots));
+  if (!rb->slots) {
     return AVERROR(ENOMEM);
   }
-  mgr->size = BUFFER_SIZE;
-  mgr->write_pos = 0;
-  mgr->read_pos = 0;
-  mgr->is_full = 0;
-  pthread_mutex_init(&mgr->mutex, NULL);
+  rb->depth = depth;
+  rb->type = type;
+  rb->cached_head = 0;
+  rb->cached_tail = 0;
+  atomic_init(&rb->head, 0);
+  atomic_init(&rb->tail, 0);
+  atomic_init(&rb->high_water, 0);
+  atomic_init(&rb->dropped, 0);
   return 0;
 }
 
-void free_buffer_manager(BufferManager *mgr) {
-  if (mgr->buffer) {
-    av_free(mgr->buffer);
-    mgr->buffer = NULL;
+static void free_item(RingBuffer *rb, void *item) {
+  if (rb->type == RING_ITEM_FRAME) {
+    AVFrame *frame = item;
+    av_frame_free(&frame);
+  } else {
+    AVPacket *packet = item;
+    av_packet_free(&packet);
   }
-  pthread_mutex_destroy(&mgr->mutex);
+}
+
+// Must only be called once both sides have stopped.
+void free_ring_buffer(RingBuffer *rb) {
+  if (!rb->slots)
+    return;
+
+  void *item;
+  while ((item = ring_buffer_pop(rb)))
+    free_item(rb, item);
+  av_freep(&rb->slots);
+}
+
+// Producer side. Lets the producer skip preparing an item that would only
+// be dropped.
+int ring_buffer_full(RingBuffer *rb) {
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+
+  if (tail - rb->cached_head == rb->depth)
+    rb->cached_head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  return tail - rb->cached_head == rb->depth;
+}
+
+// Producer side. Takes ownership of item on success; returns AVERROR(EAGAIN)
+// without touching item when the ring is full.
+int ring_buffer_push(RingBuffer *rb, void *item) {
+  if (ring_buffer_full(rb))
+    return AVERROR(EAGAIN);
+
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  rb->slots[tail % rb->depth] = item;
+  atomic_store_explicit(&rb->tail, tail + 1, memory_order_release);
+
+  // cached_head lags the consumer, so it can only overstate the items
+  // queued. Only a count past the peak is checked against the consumer's
+  // actual position; any other push stays on the producer's lines. Only the
+  // producer writes high_water, so a plain compare is enough.
+  size_t peak = atomic_load_explicit(&rb->high_water, memory_order_relaxed);
+  if (tail + 1 - rb->cached_head > peak) {
+    rb->cached_head = atomic_load_explicit(&rb->head, memory_order_acquire);
+    size_t used = tail + 1 - rb->cached_head;
+    if (used > peak)
+      atomic_store_explicit(&rb->high_water, used, memory_order_relaxed);
+  }
+
+  return 0;
+}
+
+// Consumer side. Returns NULL when the ring is empty.
+void *ring_buffer_pop(RingBuffer *rb) {
+  size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+
+  if (head == rb->cached_tail) {
+    rb->cached_tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    if (head == rb->cached_tail)
+      return NULL;
+  }
+
+  size_t slot = head % rb->depth;
+  void *item = rb->slots[slot];
+  rb->slots[slot] = NULL;
+  atomic_store_explicit(&rb->head, head + 1, memory_order_release);
+  return item;
+}
+
+// Safe from any thread; the result may be stale by the time it is used.
+size_t ring_buffer_count(RingBuffer *rb) {
+  size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  return tail - head;
+}
+
+void ring_buffer_note_drop(RingBuffer *rb) {
+  atomic_fetch_add_explicit(&rb->dropped, 1, memory_order_relaxed);
 }
@@ -0,0 +1,363 @@
+// channel.c
+// A channel is one input and its rendition ladder. Every channel in the
+// process reads on a thread of its own and decodes, scales and encodes on
+// the shared work pool.
+#include "../include/channel.h"
+#include "../include/audio.h"
+#include "../include/cores.h"
+#include "../include/decoder.h"
+#include "../include/encoder.h"
+#include "../include/frame_bus.h"
+#include "../include/latency.h"
+#include "../include/metrics.h"
+#include "../include/monitor.h"
+#include "../include/options.h"
+#include "../include/origin.h"
+#include "../include/presets.h"
+#include "../include/processor.h"
+#include "../include/scaler.h"
+#include "../include/scene.h"
+#include "../include/source.h"
+#include "../include/utils.h"
+#include <fcntl.h>
+#include <libavutil/time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_CHANNEL_ARGS 64
+
+// Splits line into whitespace-separated options and parses them as if they
+// had been given on the command line. The options point into ctx->args.
+static int parse_channel(TranscoderContext *ctx, const char *path, int lineno,
+                         const char *line) {
+  char *argv[MAX_CHANNEL_ARGS + 1];
+  int argc = 0;
+  char *save;
+
+  ctx->args = av_strdup(line);
+  if (!ctx->args)
+    return AVERROR(ENOMEM);
+
+  argv[argc++] = (char *)path;
+  for (char *tok = strtok_r(ctx->args, " \t\r\n", &save); tok;
+       tok = strtok_r(NULL, " \t\r\n", &save)) {
+    if (argc == MAX_CHANNEL_ARGS) {
+      fprintf(stderr, "%s:%d: Too many options\n", path, lineno);
+      return AVERROR(EINVAL);
+    }
+    argv[argc++] = tok;
+  }
+  argv[argc] = NULL;
+
+  if (parse_options(argc, argv, ctx, NULL) < 0) {
+    fprintf(stderr, "%s:%d: Invalid channel\n", path, lineno);
+    return AVERROR(EINVAL);
+  }
+  return 0;
+}
+
+// Reads one channel per line of path. Blank lines and lines starting with #
+// are skipped.
+int load_channels(const char *path, TranscoderContext **channels,
+                  int *count) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return AVERROR(errno);
+  }
+
+  *count = 0;
+  *channels = av_calloc(MAX_CHANNELS, sizeof(**channels));
+  if (!*channels) {
+    fclose(file);
+    return AVERROR(ENOMEM);
+  }
+
+  char *line = NULL;
+  size_t size = 0;
+  int lineno = 0;
+  int ret = 0;
+
+  while (getline(&line, &size, file) != -1) {
+    lineno++;
+    const char *start = line + strspn(line, " \t\r\n");
+    if (!*start || *start == '#')
+      continue;
+
+    if (*count == MAX_CHANNELS) {
+      fprintf(stderr, "%s: More than %d channels\n", path, MAX_CHANNELS);
+      ret = AVERROR(EINVAL);
+      break;
+    }
+    TranscoderContext *ctx = &(*channels)[(*count)++];
+    if ((ret = parse_channel(ctx, path, lineno, start)) < 0)
+      break;
+  }
+
+  free(line);
+  fclose(file);
+
+  if (!ret && !*count) {
+    fprintf(stderr, "%s: No channels\n", path);
+    ret = AVERROR(EINVAL);
+  }
+  if (ret < 0) {
+    free_channels(*channels, *count);
+    *channels = NULL;
+    *count = 0;
+  }
+  return ret;
+}
+
+void free_channels(TranscoderContext *channels, int count) {
+  for (int i = 0; i < count; i++)
+    av_freep(&channels[i].args);
+  av_free(channels);
+}
+
+// Encoder being opened on a thread of its own
+typedef struct RenditionInit {
+  TranscoderContext *ctx;
+  int index;
+  pthread_t thread;
+  int started;
+  int ret;
+} RenditionInit;
+
+static const char *const MILESTONE_NAMES[STARTUP_MILESTONES] = {
+    "first_frame", "first_part", "first_playlist"};
+
+static int fast_start = FAST_START;
+
+void channel_set_fast_start(int enable) { fast_start = enable; }
+
+const char *startup_milestone_name(int milestone) {
+  return MILESTONE_NAMES[milestone];
+}
+
+// Records the first time a channel reaches milestone. Safe from any thread.
+void channel_mark_startup(TranscoderContext *ctx, StartupMilestone milestone) {
+  atomic_int_fast64_t *reached = &ctx->startup.reached[milestone];
+  if (atomic_load(reached))
+    return;
+
+  int_fast64_t expected = 0;
+  int64_t elapsed = FFMAX(av_gettime_relative() - ctx->startup.started, 1);
+  if (atomic_compare_exchange_strong(reached, &expected, elapsed))
+    printf("[%s] Startup: %s after %.0f ms\n", ctx->output_dir,
+           MILESTONE_NAMES[milestone], elapsed / 1000.0);
+}
+
+static int open_rendition(TranscoderContext *ctx, int i) {
+  QualityPreset *preset = &ctx->presets[i];
+
+  // Unpaced recorded input runs as fast as the encoders allow rather than
+  // losing frames to a capture deadline that does not exist
+  if (!source_is_live(&ctx->source))
+    preset->drop_policy = DROP_POLICY_BLOCK;
+  preset->threads = ctx->encoders[i].cores.count;
+
+  printf("Initializing %s encoder...\n", preset->name);
+  return init_encoder(&ctx->encoders[i], preset);
+}
+
+static void *rendition_init_func(void *arg) {
+  RenditionInit *init = arg;
+  init->ret = open_rendition(init->ctx, init->index);
+  return NULL;
+}
+
+static const AVCodecParameters *source_params(TranscoderContext *ctx) {
+  return ctx->input_ctx->streams[ctx->video_stream_index]->codecpar;
+}
+
+// Returns 1 if rendition i can be remuxed from the source rather than
+// encoded. A bus carries decoded frames, so there is nothing to copy.
+static int copies_source(TranscoderContext *ctx, int i) {
+  return ctx->source.type != SOURCE_BUS &&
+         encoder_can_copy(source_params(ctx), ctx->frame_rate,
+                          &ctx->presets[i]);
+}
+
+// Opens the input and decoder and every rendition's encoder and muxer. The
+// encoders do not depend on the input, so with fast start they open on
+// threads of their own while the device starts streaming. A rendition the
+// source turns out to match is then remuxed instead, and its encoder closed
+// again; that costs less than holding every encoder back until the input is
+// open. The decoder is only opened if something needs decoded frames. The
+// audio, if any, is opened last and shared by all renditions.
+static int open_pipeline(TranscoderContext *ctx) {
+  RenditionInit inits[MAX_QUALITY_LEVELS];
+  int copy[MAX_QUALITY_LEVELS] = {0};
+  for (int i = 0; i < ctx->renditions; i++) {
+    inits[i] = (RenditionInit){.ctx = ctx, .index = i};
+    inits[i].started =
+        ctx->fast_start && pthread_create(&inits[i].thread, NULL,
+                                          rendition_init_func, &inits[i]) == 0;
+  }
+
+  printf("Opening input...\n");
+  int ret = open_input(ctx);
+  ctx->copies = 0;
+  for (int i = 0; ret >= 0 && i < ctx->renditions; i++)
+    ctx->copies += copy[i] = copies_source(ctx, i);
+  if (ret >= 0 && (ctx->copies < ctx->renditions || ctx->bus.name)) {
+    printf("Initializing decoder...\n");
+    ret = init_decoder(ctx);
+  }
+
+  // Next to a copy, encoded renditions put keyframes where the source has
+  // them, and an x264 opened early to do otherwise is opened again
+  for (int i = 0; i < ctx->renditions; i++) {
+    if (inits[i].started) {
+      pthread_join(inits[i].thread, NULL);
+    } else if (ret >= 0 && !copy[i]) {
+      ctx->encoders[i].follow_source = ctx->copies > 0;
+      inits[i].ret = open_rendition(ctx, i);
+    }
+    if (ret >= 0 && ctx->copies && !copy[i] && inits[i].ret >= 0)
+      inits[i].ret = encoder_follow_source(&ctx->encoders[i]);
+    if (ret >= 0 && copy[i])
+      ret = init_copy(&ctx->encoders[i], &ctx->presets[i], source_params(ctx),
+                      ctx->time_base);
+    else if (ret >= 0 && inits[i].ret < 0)
+      ret = inits[i].ret;
+  }
+
+  for (int i = 0; ret >= 0 && i < ctx->renditions; i++) {
+    OriginStream *origin = ctx->origin.listen ? &ctx->origin.streams[i] : NULL;
+    ret = init_encoder_output(&ctx->encoders[i], ctx->output_dir, origin);
+  }
+  return ret < 0 ? ret : audio_open(ctx);
+}
+
+// Processes that split the ladder between them over a frame bus each write
+// the whole ladder's master playlist, and list the audio whichever of them
+// writes it. Checking for that writer and writing the playlist happen under
+// one lock, so a process that saw no audio cannot overwrite the playlist of
+// one that opened it since.
+static void publish_master_playlist(TranscoderContext *ctx) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/.master.lock", ctx->output_dir);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd >= 0)
+    flock(fd, LOCK_EX);
+
+  int audio = ctx->audio.enc_ctx || audio_claimed_elsewhere(ctx->output_dir);
+  if (ctx->renditions < MAX_QUALITY_LEVELS)
+    write_master_playlist(ctx->output_dir, QUALITY_PRESETS,
+                          MAX_QUALITY_LEVELS, audio);
+  else
+    write_master_playlist(ctx->output_dir, ctx->presets, ctx->renditions,
+                          audio);
+
+  if (fd >= 0)
+    close(fd);
+}
+
+// Opens the input, decoder and ladder and starts everything but reading.
+// cores_plan() must have run, since it sizes the encoders.
+int channel_open(TranscoderContext *ctx, WorkPool *pool) {
+  int ret;
+
+  ctx->pool = pool;
+  ctx->running = 1;
+  ctx->fast_start = fast_start;
+  ctx->startup.started = av_gettime_relative();
+  for (int i = 0; i < STARTUP_MILESTONES; i++)
+    atomic_init(&ctx->startup.reached[i], 0);
+  latency_init(&ctx->read_latency);
+  latency_init(&ctx->decode_latency);
+  scene_init(&ctx->scene);
+  ctx->scale_mode = SCALE_MODE;
+  ctx->last_pts = AV_NOPTS_VALUE;
+  ctx->audio.lock_fd = -1;
+
+  // Create output directory
+  mkdir(ctx->output_dir, 0755);
+
+  if ((ret = open_pipeline(ctx)) < 0)
+    return ret;
+
+  if ((ret = init_scaling_graph(ctx)) < 0)
+    return ret;
+
+  if (ctx->bus.name) {
+    ret = frame_bus_create(&ctx->bus, ctx->dec_ctx, ctx->time_base,
+                           ctx->frame_rate);
+    if (ret < 0)
+      return ret;
+  }
+
+  // The origin serves the master playlist itself
+  if (ctx->origin.listen) {
+    if ((ret = origin_start(ctx)) < 0)
+      return ret;
+  } else {
+    publish_master_playlist(ctx);
+  }
+
+  ctx->frame = av_frame_alloc();
+  ctx->packet = av_packet_alloc();
+  if (!ctx->frame || !ctx->packet)
+    return AVERROR(ENOMEM);
+
+  if ((ret = start_encoder_workers(ctx)) < 0 || (ret = audio_start(ctx)) < 0)
+    return ret;
+
+  // Start monitoring thread
+  ctx->start_time = av_gettime();
+  if (pthread_create(&ctx->monitor_thread, NULL, monitor_thread_func, ctx) !=
+      0) {
+    fprintf(stderr, "Could not start monitor thread\n");
+    return -1;
+  }
+  ctx->monitor_running = 1;
+
+  if ((ret = metrics_start(ctx)) < 0)
+    return ret;
+
+  if (ctx->origin.listen)
+    printf("Play with: ffplay -fflags nobuffer -flags low_delay "
+           "http://%s/master.m3u8\n",
+           ctx->origin.listen);
+  else
+    printf("Play with: ffplay -fflags nobuffer -flags low_delay "
+           "%s/master.m3u8\n",
+           ctx->output_dir);
+  return 0;
+}
+
+static void *input_thread_func(void *arg) {
+  TranscoderContext *ctx = arg;
+  cores_pin_thread(&ctx->input_cores, "input");
+  if (source_is_live(&ctx->source))
+    cores_raise_priority("input");
+  ctx->input_result = run_input_loop(ctx, ctx->keep_running, 0);
+  return NULL;
+}
+
+// Captures the input on a thread of its own until it ends or *keep_running
+// drops to zero. The thread only reads and queues, so it is back at the
+// device as soon as the next frame is ready.
+int channel_start(TranscoderContext *ctx, volatile int *keep_running) {
+  ctx->keep_running = keep_running;
+  if (pthread_create(&ctx->input_thread, NULL, input_thread_func, ctx) != 0) {
+    fprintf(stderr, "Could not start input thread for %s\n",
+            ctx->output_dir);
+    return -1;
+  }
+  ctx->input_running = 1;
+  return 0;
+}
+
+// Waits for the input to end and returns the input loop's result. Safe to
+// call more than once.
+int channel_wait(TranscoderContext *ctx) {
+  if (ctx->input_running) {
+    pthread_join(ctx->input_thread, NULL);
+    ctx->input_running = 0;
+  }
+  return ctx->input_result;
+}
@@ -1,28 +1,37 @@
 #include "../include/cleanup.h"
-#include "../include/buffer.h"
+#include "../include/audio.h"
+#include "../include/frame_bus.h"
+#include "../include/frame_queue.h"
+#include "../include/metrics.h"
 #include "../include/monitor.h"
+#include "../include/origin.h"
+#include "../include/pool.h"
+#include "../include/processor.h"
+#include "../include/scene.h"
+#include "../include/simd_scale.h"
 #include <libswscale/swscale.h>
 void cleanup(TranscoderContext *ctx) {
   ctx->running = 0;
-  pthread_join(ctx->monitor_thread, NULL);
+  if (ctx->monitor_running)
+    pthread_join(ctx->monitor_thread, NULL);
+
+  // Workers drain their queues and flush their encoders before exiting
+  stop_encoder_workers(ctx);
+  audio_stop(ctx);
+  origin_stop(ctx);
+  metrics_stop(ctx);
 
   print_stats(ctx);
 
-  for (int i = 0; i < MAX_QUALITY_LEVELS; i++) {
+  for (int i = 0; i < ctx->renditions; i++) {
     EncoderContext *enc = &ctx->encoders[i];
 
-    // Flush encoders
-    avcodec_send_frame(enc->enc_ctx, NULL);
-    AVPacket *packet = av_packet_alloc();
-    while (avcodec_receive_packet(enc->enc_ctx, packet) >= 0) {
-      av_packet_unref(packet);
-    }
-    av_packet_free(&packet);
-
     if (enc->scaled_frame)
       av_frame_free(&enc->scaled_frame);
     if (enc->sws_ctx)
       sws_freeContext(enc->sws_ctx);
+    simd_scaler_free(&enc->simd);
+    av_buffer_unref(&enc->scene);
     if (enc->enc_ctx)
       avcodec_free_context(&enc->enc_ctx);
     if (enc->fmt_ctx) {
@@ -31,9 +40,16 @@ void cleanup(TranscoderContext *ctx) {
         avio_closep(&enc->fmt_ctx->pb);
       avformat_free_context(enc->fmt_ctx);
     }
-    free_buffer_manager(&enc->buffer_mgr);
+    if (enc->packet)
+      av_packet_free(&enc->packet);
+    free_frame_queue(&enc->input_queue);
+    free_frame_queue(&enc->write_queue);
+    buffer_pool_uninit(&enc->frame_pool);
+    buffer_pool_uninit(&enc->packet_pool);
   }
 
+  audio_free(&ctx->audio);
+
   if (ctx->frame)
     av_frame_free(&ctx->frame);
   if (ctx->packet)
@@ -42,4 +58,9 @@ void cleanup(TranscoderContext *ctx) {
     avcodec_free_context(&ctx->dec_ctx);
   if (ctx->input_ctx)
     avformat_close_input(&ctx->input_ctx);
+  buffer_pool_uninit(&ctx->frame_pool);
+  scene_free(&ctx->scene);
+
+  // Last, since packets read from a bus point into its mapping
+  frame_bus_close(&ctx->bus);
 }
@@ -0,0 +1,377 @@
+// cores.c
+// Splits a core budget between capture and the encoders in proportion to
+// their pixel rate, so the process runs about one busy thread per core, and
+// optionally pins every thread to its share.
+#define _GNU_SOURCE
+#include "../include/cores.h"
+#include <dirent.h>
+#include <libavutil/cpu.h>
+#include <libavutil/time.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_THREAD_GROUPS 64
+
+// CPU time seen for one thread at the last report
+typedef struct ThreadSample {
+  int tid;
+  uint64_t ticks;
+} ThreadSample;
+
+// Threads sharing a name, like all of one rendition's x264 threads
+typedef struct ThreadGroup {
+  char name[16];
+  int threads;
+  uint64_t ticks;
+  CoreSet cpus; // Where they were last seen running
+} ThreadGroup;
+
+static int budget = CORE_BUDGET;
+static int pinning = PIN_THREADS;
+
+static pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadSample *samples;
+static int sample_count;
+static int64_t sampled_at;
+
+void cores_set_budget(int cores) { budget = cores; }
+
+void cores_set_pinning(int enable) { pinning = enable; }
+
+static void core_set_add(CoreSet *set, int cpu) {
+  int i = set->count;
+  for (; i > 0 && set->cpus[i - 1] >= cpu; i--)
+    if (set->cpus[i - 1] == cpu)
+      return;
+  if (set->count == MAX_CORES)
+    return;
+  memmove(&set->cpus[i + 1], &set->cpus[i],
+          (set->count - i) * sizeof(set->cpus[0]));
+  set->cpus[i] = cpu;
+  set->count++;
+}
+
+// Writes cores as a cpulist, e.g. "0-3,8".
+static void format_cores(const CoreSet *cores, char *buf, size_t size) {
+  size_t len = 0;
+  buf[0] = '\0';
+  for (int i = 0; i < cores->count && len < size; i++) {
+    int first = cores->cpus[i];
+    while (i + 1 < cores->count && cores->cpus[i + 1] == cores->cpus[i] + 1)
+      i++;
+    if (first == cores->cpus[i])
+      len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", first);
+    else
+      len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", first,
+                      cores->cpus[i]);
+  }
+}
+
+static int cpu_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (!dir)
+    return 0;
+
+  int node = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)))
+    if (sscanf(entry->d_name, "node%d", &node) == 1)
+      break;
+  closedir(dir);
+  return node;
+}
+
+// Lists the CPUs this process may run on, grouped by NUMA node so that
+// consecutive cores share a memory controller.
+static int usable_cpus(int *cpus) {
+  cpu_set_t allowed;
+  int nodes[MAX_CORES];
+  int n = 0;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < MAX_CORES; cpu++)
+      if (CPU_ISSET(cpu, &allowed))
+        cpus[n++] = cpu;
+  }
+  if (!n)
+    for (; n < av_cpu_count() && n < MAX_CORES; n++)
+      cpus[n] = n;
+
+  for (int i = 0; i < n; i++) {
+    int cpu = cpus[i];
+    int node = cpu_node(cpu);
+    int j = i;
+    for (; j > 0 && nodes[j - 1] > node; j--) {
+      cpus[j] = cpus[j - 1];
+      nodes[j] = nodes[j - 1];
+    }
+    cpus[j] = cpu;
+    nodes[j] = node;
+  }
+  return n;
+}
+
+// Number of cores in the budget.
+int cores_available(void) {
+  int cpus[MAX_CORES];
+  int n = usable_cpus(cpus);
+  return budget > 0 && budget < n ? budget : n;
+}
+
+static double pixel_rate(const QualityPreset *preset) {
+  return (double)preset->width * preset->height * preset->fps;
+}
+
+static void apply_affinity(const CoreSet *cores) {
+  if (!pinning || !cores || !cores->count)
+    return;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int i = 0; i < cores->count; i++)
+    CPU_SET(cores->cpus[i], &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Gives every channel's input thread and encoders their cores and sets each
+// encoder's thread count to its share. Each channel gets a core of its own
+// for capture if that still leaves one per encoder; encoder shares follow
+// the pixel rate of their rendition. A channel's ladder takes consecutive
+// cores, which keeps it on one NUMA node when it fits. The calling thread
+// is pinned to the whole budget, so threads it starts later inherit that.
+// Returns the number of cores in the budget.
+int cores_plan(TranscoderContext *channels, int count) {
+  int cpus[MAX_CORES];
+  usable_cpus(cpus);
+  int n = cores_available();
+
+  // Every rendition any channel runs, in order
+  const QualityPreset *presets[MAX_CHANNELS * MAX_QUALITY_LEVELS];
+  int renditions = 0;
+  for (int c = 0; c < count; c++)
+    for (int i = 0; i < channels[c].renditions; i++)
+      presets[renditions++] = &channels[c].presets[i];
+  int inputs = n - count >= renditions ? count : 0;
+  int shared = n - inputs;
+
+  // Largest quotient first: each extra core goes to the encoder with the
+  // most pixels per thread
+  int threads[MAX_CHANNELS * MAX_QUALITY_LEVELS];
+  for (int j = 0; j < renditions; j++)
+    threads[j] = 1;
+  for (int left = renditions ? shared - renditions : 0; left > 0; left--) {
+    int best = 0;
+    for (int j = 1; j < renditions; j++)
+      if (pixel_rate(presets[j]) / threads[j] >
+          pixel_rate(presets[best]) / threads[best])
+        best = j;
+    threads[best]++;
+  }
+
+  CoreSet all = {.count = n};
+  memcpy(all.cpus, cpus, n * sizeof(cpus[0]));
+  apply_affinity(&all);
+
+  char list[256];
+  format_cores(&all, list, sizeof(list));
+  printf("Cores: %d (%s)%s\n", n, list, pinning ? ", pinned" : "");
+
+  int next = 0, j = 0;
+  for (int c = 0; c < count; c++) {
+    TranscoderContext *ctx = &channels[c];
+    if (inputs) {
+      ctx->input_cores.count = 1;
+      ctx->input_cores.cpus[0] = cpus[c];
+    } else {
+      ctx->input_cores = all;
+    }
+
+    for (int i = 0; i < ctx->renditions; i++, j++) {
+      CoreSet *cores = &ctx->encoders[i].cores;
+      cores->count = 0;
+      for (int k = 0; k < threads[j]; k++)
+        cores->cpus[cores->count++] = cpus[inputs + (next + k) % shared];
+      next += threads[j];
+
+      format_cores(cores, list, sizeof(list));
+      printf("  %s%s%s: %d x264 thread%s on cores %s\n",
+             count > 1 ? ctx->output_dir : "", count > 1 ? "/" : "",
+             ctx->presets[i].name, cores->count,
+             cores->count > 1 ? "s" : "", list);
+    }
+  }
+  if (inputs)
+    printf("  Input: one core per channel from core %d\n", cpus[0]);
+
+  return n;
+}
+
+// Names the calling thread and, when pinning, moves it to cores. A NULL
+// cores only names it.
+void cores_pin_thread(const CoreSet *cores, const char *name) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%s", name);
+  pthread_setname_np(pthread_self(), buf);
+  apply_affinity(cores);
+}
+
+// Moves the calling thread ahead of the pool and encoder threads so a busy
+// host delays it last: SCHED_FIFO if permitted, otherwise a lower nice
+// value. Needs CAP_SYS_NICE or a matching RLIMIT_RTPRIO / RLIMIT_NICE.
+void cores_raise_priority(const char *name) {
+  struct sched_param param = {.sched_priority = CAPTURE_PRIORITY};
+  if (CAPTURE_PRIORITY > 0 &&
+      pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) {
+    printf("%s thread: SCHED_FIFO priority %d\n", name, CAPTURE_PRIORITY);
+    return;
+  }
+
+  // Linux applies a thread id's nice value to that thread alone
+  if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), CAPTURE_NICE) == 0) {
+    printf("%s thread: nice %d\n", name, CAPTURE_NICE);
+    return;
+  }
+  fprintf(stderr, "Could not raise %s thread priority: %s\n", name,
+          strerror(errno));
+}
+
+// Opens a codec with the calling thread temporarily named name and placed
+// on cores. Threads the codec starts while opening (x264's frame and slice
+// threads) inherit both, which is the only hook there is to place them.
+int cores_open_codec(AVCodecContext *avctx, const AVCodec *codec,
+                     AVDictionary **opts, const CoreSet *cores,
+                     const char *name) {
+  char saved_name[16] = "";
+  cpu_set_t saved_set;
+  pthread_getname_np(pthread_self(), saved_name, sizeof(saved_name));
+  int saved = pthread_getaffinity_np(pthread_self(), sizeof(saved_set),
+                                     &saved_set) == 0;
+
+  cores_pin_thread(cores, name);
+  int ret = avcodec_open2(avctx, codec, opts);
+
+  pthread_setname_np(pthread_self(), saved_name);
+  if (pinning && saved)
+    pthread_setaffinity_np(pthread_self(), sizeof(saved_set), &saved_set);
+  return ret;
+}
+
+// Reads a thread's name, user + system CPU ticks and the CPU it last ran
+// on from /proc/self/task/<tid>/stat.
+static int read_thread_stat(int tid, char *name, uint64_t *ticks, int *cpu) {
+  char path[64], line[1024];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return -1;
+  char *ok = fgets(line, sizeof(line), file);
+  fclose(file);
+  if (!ok)
+    return -1;
+
+  // The name may contain spaces and parentheses; it ends at the last ')'
+  char *open = strchr(line, '(');
+  char *close = strrchr(line, ')');
+  if (!open || !close || close < open)
+    return -1;
+  snprintf(name, 16, "%.*s", (int)(close - open - 1), open + 1);
+
+  uint64_t utime = 0, stime = 0;
+  char *save;
+  int field = 3;
+  for (char *tok = strtok_r(close + 2, " ", &save); tok;
+       tok = strtok_r(NULL, " ", &save), field++) {
+    if (field == 14)
+      utime = strtoull(tok, NULL, 10);
+    else if (field == 15)
+      stime = strtoull(tok, NULL, 10);
+    else if (field == 39)
+      *cpu = atoi(tok);
+  }
+  *ticks = utime + stime;
+  return 0;
+}
+
+static uint64_t previous_ticks(int tid) {
+  for (int i = 0; i < sample_count; i++)
+    if (samples[i].tid == tid)
+      return samples[i].ticks;
+  return 0;
+}
+
+// Prints CPU usage per thread name since the previous report. Every
+// channel's monitor calls this; only the first call in an interval prints.
+void cores_print_usage(void) {
+  pthread_mutex_lock(&usage_lock);
+  int64_t now = av_gettime_relative();
+  if (sampled_at && now - sampled_at < MONITORING_INTERVAL * 1000000LL / 2) {
+    pthread_mutex_unlock(&usage_lock);
+    return;
+  }
+
+  DIR *dir = opendir("/proc/self/task");
+  if (!dir) {
+    pthread_mutex_unlock(&usage_lock);
+    return;
+  }
+
+  ThreadGroup groups[MAX_THREAD_GROUPS];
+  int group_count = 0;
+  ThreadSample *next = NULL;
+  int next_count = 0;
+  struct dirent *entry;
+
+  while ((entry = readdir(dir))) {
+    int tid = atoi(entry->d_name);
+    char name[16];
+    uint64_t ticks;
+    int cpu = 0;
+    if (tid <= 0 || read_thread_stat(tid, name, &ticks, &cpu) < 0)
+      continue;
+
+    ThreadSample *grown =
+        av_realloc_array(next, next_count + 1, sizeof(*next));
+    if (!grown)
+      break;
+    next = grown;
+    next[next_count++] = (ThreadSample){tid, ticks};
+
+    int g = 0;
+    while (g < group_count && strcmp(groups[g].name, name))
+      g++;
+    if (g == group_count) {
+      if (group_count == MAX_THREAD_GROUPS)
+        continue;
+      memset(&groups[g], 0, sizeof(groups[g]));
+      memcpy(groups[g].name, name, sizeof(name));
+      group_count++;
+    }
+    groups[g].threads++;
+    groups[g].ticks += ticks - previous_ticks(tid);
+    core_set_add(&groups[g].cpus, cpu);
+  }
+  closedir(dir);
+
+  double elapsed = (now - sampled_at) / 1000000.0;
+  if (sampled_at && elapsed > 0) {
+    long hz = sysconf(_SC_CLK_TCK);
+    printf("Threads:\n");
+    for (int g = 0; g < group_count; g++) {
+      char list[256];
+      format_cores(&groups[g].cpus, list, sizeof(list));
+      printf("  %-15s x%-3d %6.1f%% CPU, on cores %s\n", groups[g].name,
+             groups[g].threads, 100.0 * groups[g].ticks / hz / elapsed,
+             list);
+    }
+  }
+
+  av_free(samples);
+  samples = next;
+  sample_count = next_count;
+  sampled_at = now;
+  pthread_mutex_unlock(&usage_lock);
+}
@@ -1,79 +1,130 @@
 // decoder.c
 #include "../include/decoder.h"
-#include <libavdevice/avdevice.h>
+#include "../include/cores.h"
+#include "../include/frame_bus.h"
+#include "../include/latency.h"
+#include "../include/pool.h"
+#include <libavutil/imgutils.h>
 
-int open_input(TranscoderContext *ctx) {
-  avdevice_register_all();
+static const char *const THREADING_NAMES[] = {"auto", "none", "slice",
+                                              "frame"};
 
-  const AVInputFormat *input_format = av_find_input_format("v4l2");
-  if (!input_format) {
-    fprintf(stderr, "V4L2 not found\n");
-    return -1;
+int parse_decode_threading(const char *name, DecodeThreading *threading) {
+  for (int i = 0; i < (int)FF_ARRAY_ELEMS(THREADING_NAMES); i++) {
+    if (!strcmp(name, THREADING_NAMES[i])) {
+      *threading = i;
+      return 0;
+    }
   }
+  return AVERROR(EINVAL);
+}
 
-  AVDictionary *options = NULL;
-  av_dict_set(&options, "input_format", "mjpeg", 0);
-  av_dict_set(&options, "video_size", "1920x1080", 0);
-  // Let the camera use its native framerate
-  av_dict_set(&options, "num_buffers", "3", 0);
+// Picks the threading mode and thread count. Decoding runs on the pool,
+// which spans the core budget, so by default so does the decoder. Frame
+// threading holds back up to thread_count - 1 frames, so its thread count
+// is capped by the allowed delay; slice threading adds none.
+static void configure_threads(TranscoderContext *ctx, const AVCodec *decoder) {
+  DecodeConfig *config = &ctx->decode;
+  DecodeThreading mode =
+      config->threading ? config->threading : DECODE_THREADING;
+  int slices = decoder->capabilities & AV_CODEC_CAP_SLICE_THREADS;
+  int frames = decoder->capabilities & AV_CODEC_CAP_FRAME_THREADS;
+  int threads = config->threads ? config->threads : cores_available();
+  int max_delay = config->max_delay ? config->max_delay : DECODE_MAX_DELAY;
 
-  int ret = avformat_open_input(&ctx->input_ctx, "/dev/video0", input_format,
-                                &options);
-  if (ret < 0) {
-    fprintf(stderr, "Cannot open webcam: %s\n", av_err2str(ret));
-    av_dict_free(&options);
-    return ret;
+  if (mode == DECODE_THREADING_AUTO)
+    mode = slices   ? DECODE_THREADING_SLICE
+           : frames ? DECODE_THREADING_FRAME
+                    : DECODE_THREADING_NONE;
+  if ((mode == DECODE_THREADING_SLICE && !slices) ||
+      (mode == DECODE_THREADING_FRAME && !frames)) {
+    fprintf(stderr, "%s decoder has no %s threading, decoding on one thread\n",
+            decoder->name, THREADING_NAMES[mode]);
+    mode = DECODE_THREADING_NONE;
   }
-  av_dict_free(&options);
 
-  ret = avformat_find_stream_info(ctx->input_ctx, NULL);
-  if (ret < 0) {
-    fprintf(stderr, "Cannot find stream info: %s\n", av_err2str(ret));
-    return ret;
+  if (mode == DECODE_THREADING_FRAME)
+    threads = FFMIN(threads, max_delay + 1);
+  if (mode == DECODE_THREADING_NONE || threads < 2) {
+    mode = DECODE_THREADING_NONE;
+    threads = 1;
   }
 
-  ctx->video_stream_index =
-      av_find_best_stream(ctx->input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
-  if (ctx->video_stream_index < 0) {
-    fprintf(stderr, "Cannot find video stream\n");
-    return AVERROR_STREAM_NOT_FOUND;
-  }
+  ctx->dec_ctx->thread_count = threads;
+  ctx->dec_ctx->thread_type = mode == DECODE_THREADING_SLICE   ? FF_THREAD_SLICE
+                              : mode == DECODE_THREADING_FRAME ? FF_THREAD_FRAME
+                                                               : 0;
+  printf("Decoder: %s, %s threading, %d thread%s\n", decoder->name,
+         THREADING_NAMES[mode], threads, threads > 1 ? "s" : "");
+}
 
-  AVStream *stream = ctx->input_ctx->streams[ctx->video_stream_index];
+// Frames from a bus arrive decoded, as rawvideo packets pointing into it.
+static int describe_bus(TranscoderContext *ctx) {
+  AVCodecParameters *par = avcodec_parameters_alloc();
+  ctx->dec_ctx = avcodec_alloc_context3(NULL);
+  if (!par || !ctx->dec_ctx) {
+    avcodec_parameters_free(&par);
+    return AVERROR(ENOMEM);
+  }
+  frame_bus_describe(&ctx->bus, par);
+  int ret = avcodec_parameters_to_context(ctx->dec_ctx, par);
+  avcodec_parameters_free(&par);
+  return ret;
+}
 
-  // Calculate frame duration from actual stream timebase and framerate
-  AVRational frame_rate = stream->avg_frame_rate;
-  ctx->frame_duration = av_q2d(av_inv_q(frame_rate));
-  ctx->last_pts = AV_NOPTS_VALUE;
+int init_decoder(TranscoderContext *ctx) {
+  int ret;
+  const AVCodec *decoder = NULL;
 
-  printf("Input format: %dx%d @ %d/%d fps (%.3f ms per frame)\n",
-         stream->codecpar->width, stream->codecpar->height, frame_rate.num,
-         frame_rate.den, ctx->frame_duration * 1000);
+  if (ctx->source.type == SOURCE_BUS) {
+    if ((ret = describe_bus(ctx)) < 0)
+      return ret;
+  } else {
+    AVStream *stream = ctx->input_ctx->streams[ctx->video_stream_index];
+    decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!decoder) {
+      fprintf(stderr, "Cannot find decoder\n");
+      return -1;
+    }
 
-  return 0;
-}
+    ctx->dec_ctx = avcodec_alloc_context3(decoder);
+    if (!ctx->dec_ctx) {
+      fprintf(stderr, "Cannot allocate decoder context\n");
+      return AVERROR(ENOMEM);
+    }
 
-int init_decoder(TranscoderContext *ctx) {
-  AVStream *stream = ctx->input_ctx->streams[ctx->video_stream_index];
-  const AVCodec *decoder = avcodec_find_decoder(stream->codecpar->codec_id);
-  if (!decoder) {
-    fprintf(stderr, "Cannot find decoder\n");
-    return -1;
+    ret = avcodec_parameters_to_context(ctx->dec_ctx, stream->codecpar);
+    if (ret < 0) {
+      fprintf(stderr, "Cannot copy decoder params: %s\n", av_err2str(ret));
+      return ret;
+    }
   }
 
-  ctx->dec_ctx = avcodec_alloc_context3(decoder);
-  if (!ctx->dec_ctx) {
-    fprintf(stderr, "Cannot allocate decoder context\n");
-    return AVERROR(ENOMEM);
+  // Raw frames go to the scaler as they are; the context only describes them
+  ctx->raw_input = ctx->dec_ctx->codec_id == AV_CODEC_ID_RAWVIDEO;
+  if (ctx->raw_input) {
+    printf("Decoder: none, raw %s frames go straight to the scaler\n",
+           av_get_pix_fmt_name(ctx->dec_ctx->pix_fmt));
+    latency_init(&ctx->decode_delay);
+    atomic_init(&ctx->decode_in_flight, 0);
+    return 0;
   }
 
-  int ret = avcodec_parameters_to_context(ctx->dec_ctx, stream->codecpar);
-  if (ret < 0) {
-    fprintf(stderr, "Cannot copy decoder params: %s\n", av_err2str(ret));
-    return ret;
-  }
+  // Decoded frames are written straight into pooled buffers that the
+  // encoders then reference, never copied. The pool is thread-safe, as
+  // frame threading requires of get_buffer2.
+  buffer_pool_init(&ctx->frame_pool, "decoded");
+  pool_attach_decoder(&ctx->frame_pool, ctx->dec_ctx);
+  configure_threads(ctx, decoder);
+  ctx->dec_ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
 
-  ret = avcodec_open2(ctx->dec_ctx, decoder, NULL);
+  latency_init(&ctx->decode_delay);
+  atomic_init(&ctx->decode_in_flight, 0);
+  ctx->decode_stamp_next = 0;
+  for (int i = 0; i < DECODE_STAMPS; i++)
+    ctx->decode_stamps[i].pts = AV_NOPTS_VALUE;
+
+  ret = cores_open_codec(ctx->dec_ctx, decoder, NULL, NULL, "decode");
   if (ret < 0) {
     fprintf(stderr, "Cannot open decoder: %s\n", av_err2str(ret));
     return ret;
@@ -81,3 +132,64 @@ int init_decoder(TranscoderContext *ctx) {
 
   return 0;
 }
+
+// Notes when packet went into the decoder. Packets without a pts cannot be
+// matched to their frame and are not tracked.
+void decoder_packet_sent(TranscoderContext *ctx, const AVPacket *packet,
+                         int64_t now) {
+  if (!packet || packet->pts == AV_NOPTS_VALUE)
+    return;
+
+  DecodeStamp *stamp = &ctx->decode_stamps[ctx->decode_stamp_next];
+  ctx->decode_stamp_next = (ctx->decode_stamp_next + 1) % DECODE_STAMPS;
+  if (stamp->pts == AV_NOPTS_VALUE)
+    atomic_fetch_add(&ctx->decode_in_flight, 1);
+  stamp->pts = packet->pts;
+  stamp->sent_ns = now;
+}
+
+// Records how long the packet behind frame spent in the decoder. With
+// frame threading this includes the time it was held back behind others.
+void decoder_frame_out(TranscoderContext *ctx, const AVFrame *frame,
+                       int64_t now) {
+  if (frame->pts == AV_NOPTS_VALUE)
+    return;
+
+  for (int i = 0; i < DECODE_STAMPS; i++) {
+    DecodeStamp *stamp = &ctx->decode_stamps[i];
+    if (stamp->pts == frame->pts) {
+      latency_record(&ctx->decode_delay, now - stamp->sent_ns);
+      stamp->pts = AV_NOPTS_VALUE;
+      atomic_fetch_sub(&ctx->decode_in_flight, 1);
+      return;
+    }
+  }
+}
+
+// Points frame at the raw picture in packet instead of decoding it. The
+// frame holds a reference to the packet's buffer, which for V4L2 is the
+// mmap'd capture buffer itself while the driver still has others to fill.
+int decoder_wrap_raw(TranscoderContext *ctx, const AVPacket *packet,
+                     AVFrame *frame) {
+  AVCodecContext *dec = ctx->dec_ctx;
+  int size = av_image_fill_arrays(frame->data, frame->linesize, packet->data,
+                                  dec->pix_fmt, dec->width, dec->height, 1);
+  if (size < 0)
+    return size;
+  if (packet->size < size) {
+    fprintf(stderr, "Short raw frame: %d of %d bytes\n", packet->size, size);
+    return AVERROR(EAGAIN);
+  }
+
+  frame->buf[0] = av_buffer_ref(packet->buf);
+  if (!frame->buf[0])
+    return AVERROR(ENOMEM);
+  frame->format = dec->pix_fmt;
+  frame->width = dec->width;
+  frame->height = dec->height;
+  frame->color_range = dec->color_range;
+  frame->colorspace = dec->colorspace;
+  frame->pts = packet->pts;
+  frame->opaque = packet->opaque;
+  return 0;
+}
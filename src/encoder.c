@@ -1,180 +1,374 @@
 // encoder.c
 #include "../include/encoder.h"
-#include "../include/buffer.h"
 #include "../include/config.h"
+#include "../include/cores.h"
+#include "../include/frame_queue.h"
+#include "../include/latency.h"
+#include "../include/origin.h"
+#include "../include/pool.h"
 #include <libavutil/opt.h>
-#include <libswscale/swscale.h>
 #include <sys/stat.h>
 
-int init_encoder(EncoderContext *enc, AVCodecContext *dec_ctx,
-                 QualityPreset *preset, const char *output_dir) {
-  int ret;
-
-  // Find encoder
-  const AVCodec *encoder = avcodec_find_encoder_by_name("libx264");
-  if (!encoder) {
-    fprintf(stderr, "Could not find H.264 encoder\n");
-    return -1;
-  }
-
-  // Allocate encoder context
-  enc->enc_ctx = avcodec_alloc_context3(encoder);
-  if (!enc->enc_ctx) {
-    fprintf(stderr, "Could not allocate encoder context\n");
-    return AVERROR(ENOMEM);
-  }
+#define X264_KEYINT_INFINITE (1 << 30) // x264's X264_KEYINT_MAX_INFINITE
 
-  // Set encoder parameters
-  enc->enc_ctx->width = preset->width;
-  enc->enc_ctx->height = preset->height;
-  enc->enc_ctx->time_base = (AVRational){1, preset->fps};
-  enc->enc_ctx->framerate = (AVRational){preset->fps, 1};
-  enc->enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-  enc->enc_ctx->bit_rate = preset->bitrate;
-  enc->enc_ctx->rc_min_rate = preset->bitrate;
-  enc->enc_ctx->rc_max_rate = preset->bitrate;
-  enc->enc_ctx->rc_buffer_size = preset->bitrate / 2;
-  enc->enc_ctx->gop_size = preset->keyframe_interval;
-  enc->enc_ctx->max_b_frames = 0;
-  enc->enc_ctx->refs = 1;
-  enc->enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+static int latency_stamps = LATENCY_STAMPS;
 
-  // Set encoder options
-  AVDictionary *opts = NULL;
-  av_dict_set(&opts, "preset", "ultrafast", 0);
-  av_dict_set(&opts, "tune", "zerolatency", 0);
-  av_dict_set(&opts, "profile", "baseline", 0);
-  av_dict_set(&opts, "x264opts",
-              "no-mbtree:"
-              "sync-lookahead=0:"
-              "rc-lookahead=0:"
-              "sliced-threads=1:"
-              "no-scenecut",
-              0);
+// Embeds each frame's capture time in an SEI message and has the origin
+// write prft boxes, so players can measure glass-to-glass latency.
+void encoder_set_latency_stamps(int enable) { latency_stamps = enable; }
 
-  ret = avcodec_open2(enc->enc_ctx, encoder, &opts);
-  av_dict_free(&opts);
-  if (ret < 0) {
-    fprintf(stderr, "Could not open encoder: %s\n", av_err2str(ret));
-    return ret;
-  }
-
-  // Initialize buffer manager
-  ret = init_buffer_manager(&enc->buffer_mgr);
-  if (ret < 0) {
-    fprintf(stderr, "Could not initialize buffer manager\n");
-    return ret;
-  }
+// Sets up the HLS muxer writing playlists and segments of the stream
+// enc_ctx encodes under output_dir/name: a sliding live playlist, or with
+// vod one listing every segment that is complete once the muxer is.
+int init_hls_output(AVFormatContext **fmt_ctx, AVStream **stream,
+                    const AVCodecContext *enc_ctx, const char *name,
+                    const char *output_dir, int vod) {
+  int ret;
 
   // Create output directory
   char dir_path[1024];
-  snprintf(dir_path, sizeof(dir_path), "%s/%s", output_dir, preset->name);
+  snprintf(dir_path, sizeof(dir_path), "%s/%s", output_dir, name);
   mkdir(dir_path, 0755);
 
   // Initialize output format context
   char output_path[1024];
   snprintf(output_path, sizeof(output_path), "%s/%s/stream.m3u8", output_dir,
-           preset->name);
+           name);
 
-  ret = avformat_alloc_output_context2(&enc->fmt_ctx, NULL, "hls", output_path);
+  ret = avformat_alloc_output_context2(fmt_ctx, NULL, "hls", output_path);
   if (ret < 0) {
     fprintf(stderr, "Could not create output context\n");
     return ret;
   }
+  AVFormatContext *fmt = *fmt_ctx;
 
-  // Add video stream
-  enc->stream = avformat_new_stream(enc->fmt_ctx, NULL);
-  if (!enc->stream) {
+  // Add the stream
+  *stream = avformat_new_stream(fmt, NULL);
+  if (!*stream) {
     fprintf(stderr, "Could not create output stream\n");
     return AVERROR(ENOMEM);
   }
 
-  ret = avcodec_parameters_from_context(enc->stream->codecpar, enc->enc_ctx);
+  ret = avcodec_parameters_from_context((*stream)->codecpar, enc_ctx);
   if (ret < 0) {
     fprintf(stderr, "Could not copy encoder parameters\n");
     return ret;
   }
 
   // Configure HLS
-  av_opt_set(enc->fmt_ctx->priv_data, "hls_time", "1", 0);
-  av_opt_set(enc->fmt_ctx->priv_data, "hls_list_size", "6", 0);
-  av_opt_set(enc->fmt_ctx->priv_data, "hls_flags",
-             "delete_segments+"
-             "append_list+"
-             "discont_start+"
-             "split_by_time+"
-             "program_date_time+"
-             "independent_segments",
-             0);
-  av_opt_set(enc->fmt_ctx->priv_data, "hls_segment_type", "fmp4", 0);
-  av_opt_set(enc->fmt_ctx->priv_data, "hls_fmp4_init_filename", "init.mp4", 0);
+  av_opt_set(fmt->priv_data, "hls_time", "1", 0);
+  if (vod) {
+    av_opt_set(fmt->priv_data, "hls_playlist_type", "vod", 0);
+    av_opt_set(fmt->priv_data, "hls_list_size", "0", 0);
+    av_opt_set(fmt->priv_data, "hls_flags", "independent_segments",
+               0);
+  } else {
+    av_opt_set(fmt->priv_data, "hls_list_size", "6", 0);
+    av_opt_set(fmt->priv_data, "hls_flags",
+               "delete_segments+"
+               "append_list+"
+               "discont_start+"
+               "program_date_time+"
+               "independent_segments",
+               0);
+  }
+  av_opt_set(fmt->priv_data, "hls_segment_type", "fmp4", 0);
+  av_opt_set(fmt->priv_data, "hls_fmp4_init_filename", "init.mp4", 0);
 
   // Set segment filenames
   char segment_path[1024];
   snprintf(segment_path, sizeof(segment_path), "%s/%s/segment_%%d.m4s",
-           output_dir, preset->name);
-  av_opt_set(enc->fmt_ctx->priv_data, "hls_segment_filename", segment_path, 0);
+           output_dir, name);
+  av_opt_set(fmt->priv_data, "hls_segment_filename", segment_path, 0);
 
-  char part_path[1024];
-  snprintf(part_path, sizeof(part_path), "%s/%s/part_%%d.m4s", output_dir,
-           preset->name);
-  av_opt_set(enc->fmt_ctx->priv_data, "hls_part_filename", part_path, 0);
+  // Parts only matter to players at the live edge
+  if (!vod) {
+    char part_path[1024];
+    snprintf(part_path, sizeof(part_path), "%s/%s/part_%%d.m4s", output_dir,
+             name);
+    av_opt_set(fmt->priv_data, "hls_part_filename", part_path, 0);
 
-  // Set part duration
-  char buf[32];
-  snprintf(buf, sizeof(buf), "%f", PART_DURATION);
-  av_opt_set(enc->fmt_ctx->priv_data, "hls_part_target", buf, 0);
+    // Set part duration
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%f", PART_DURATION);
+    av_opt_set(fmt->priv_data, "hls_part_target", buf, 0);
+  }
 
   // Open output file
-  ret = avio_open(&enc->fmt_ctx->pb, output_path, AVIO_FLAG_WRITE);
+  ret = avio_open(&fmt->pb, output_path, AVIO_FLAG_WRITE);
   if (ret < 0) {
     fprintf(stderr, "Could not open output file: %s\n", av_err2str(ret));
     return ret;
   }
 
   // Write format header
-  ret = avformat_write_header(enc->fmt_ctx, NULL);
+  ret = avformat_write_header(fmt, NULL);
   if (ret < 0) {
     fprintf(stderr, "Could not write header: %s\n", av_err2str(ret));
     return ret;
   }
 
-  // Initialize scaler
-  enc->sws_ctx = sws_getContext(dec_ctx->width, dec_ctx->height,
-                                dec_ctx->pix_fmt, enc->enc_ctx->width,
-                                enc->enc_ctx->height, enc->enc_ctx->pix_fmt,
-                                SWS_FAST_BILINEAR, NULL, NULL, NULL);
+  return 0;
+}
 
-  if (!enc->sws_ctx) {
-    fprintf(stderr, "Could not initialize scaler\n");
-    return AVERROR(ENOMEM);
+// Allocates an x264 context for preset's size, rate and bitrate.
+static AVCodecContext *alloc_x264(const QualityPreset *preset,
+                                  const AVCodec **encoder) {
+  *encoder = avcodec_find_encoder_by_name("libx264");
+  if (!*encoder) {
+    fprintf(stderr, "Could not find H.264 encoder\n");
+    return NULL;
   }
 
-  // Allocate frame
-  enc->scaled_frame = av_frame_alloc();
-  if (!enc->scaled_frame) {
-    fprintf(stderr, "Could not allocate frame\n");
-    return AVERROR(ENOMEM);
+  AVCodecContext *enc_ctx = avcodec_alloc_context3(*encoder);
+  if (!enc_ctx) {
+    fprintf(stderr, "Could not allocate encoder context\n");
+    return NULL;
   }
 
-  enc->scaled_frame->format = enc->enc_ctx->pix_fmt;
-  enc->scaled_frame->width = enc->enc_ctx->width;
-  enc->scaled_frame->height = enc->enc_ctx->height;
+  enc_ctx->width = preset->width;
+  enc_ctx->height = preset->height;
+  enc_ctx->time_base = (AVRational){1, preset->fps};
+  enc_ctx->framerate = (AVRational){preset->fps, 1};
+  enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  enc_ctx->bit_rate = preset->bitrate;
+  enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  return enc_ctx;
+}
+
+// Opens an encoder for offline chunks, where nobody waits on a frame: a
+// slower preset, lookahead, B-frames and scene cuts, and one thread, since
+// chunks are what run in parallel. Keyframes the caller forces are IDR
+// frames, so every chunk and segment starts clean.
+int encoder_open_offline(AVCodecContext **enc_ctx,
+                         const QualityPreset *preset) {
+  const AVCodec *encoder;
+  AVCodecContext *ctx = *enc_ctx = alloc_x264(preset, &encoder);
+  if (!ctx)
+    return AVERROR(ENOMEM);
 
-  ret = av_frame_get_buffer(enc->scaled_frame, 32);
+  // VBV over a segment keeps each segment near the advertised bandwidth
+  ctx->rc_max_rate = preset->bitrate;
+  ctx->rc_buffer_size = preset->bitrate * SEGMENT_DURATION;
+  ctx->gop_size = 2 * preset->fps * SEGMENT_DURATION;
+  ctx->thread_count = 1;
+
+  AVDictionary *opts = NULL;
+  av_dict_set(&opts, "preset", OFFLINE_PRESET, 0);
+  av_dict_set(&opts, "profile", "high", 0);
+  av_dict_set(&opts, "forced-idr", "1", 0);
+  int ret = avcodec_open2(ctx, encoder, &opts);
+  av_dict_free(&opts);
+  if (ret < 0)
+    fprintf(stderr, "Could not open %s encoder: %s\n", preset->name,
+            av_err2str(ret));
+  return ret;
+}
+
+// Points enc at a VOD HLS muxer under output_dir, for packets from
+// encoders set up like enc->enc_ctx.
+int init_vod_output(EncoderContext *enc, QualityPreset *preset,
+                    const char *output_dir) {
+  enc->preset = preset;
+  return init_hls_output(&enc->fmt_ctx, &enc->stream, enc->enc_ctx,
+                         preset->name, output_dir, 1);
+}
+
+// Opens enc's x264 for the live edge, on the rendition's cores.
+static int open_x264(EncoderContext *enc, QualityPreset *preset) {
+  int ret;
+
+  const AVCodec *encoder;
+  enc->enc_ctx = alloc_x264(preset, &encoder);
+  if (!enc->enc_ctx)
+    return AVERROR(ENOMEM);
+
+  // Constant bitrate with a short VBV buffer for the live edge
+  enc->enc_ctx->rc_min_rate = preset->bitrate;
+  enc->enc_ctx->rc_max_rate = preset->bitrate;
+  enc->enc_ctx->rc_buffer_size = preset->bitrate / 2;
+  // Aligned keyframes come from the shared timeline; x264's own only step
+  // in if a boundary is missed. Next to a copy of the source they go where
+  // the source's do, however far apart, so x264 adds none of its own.
+  if (enc->follow_source)
+    enc->enc_ctx->gop_size = X264_KEYINT_INFINITE;
+  else if (KEYFRAME_ALIGN)
+    enc->enc_ctx->gop_size = FFMAX(preset->keyframe_interval,
+                                   2 * preset->fps * SEGMENT_DURATION);
+  else
+    enc->enc_ctx->gop_size = preset->keyframe_interval;
+  enc->enc_ctx->max_b_frames = 0;
+  enc->enc_ctx->refs = 1;
+  // Each packet carries its frame's capture time to the writer
+  enc->enc_ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+  enc->enc_ctx->thread_count = preset->threads;
+
+  // Set encoder options
+  AVDictionary *opts = NULL;
+  av_dict_set(&opts, "preset", "ultrafast", 0);
+  av_dict_set(&opts, "tune", "zerolatency", 0);
+  av_dict_set(&opts, "profile", "baseline", 0);
+  av_dict_set(&opts, "x264opts",
+              "no-mbtree:"
+              "sync-lookahead=0:"
+              "rc-lookahead=0:"
+              "sliced-threads=1:"
+              "no-scenecut",
+              0);
+  if (enc->latency_stamps)
+    av_dict_set(&opts, "udu_sei", "1", 0);
+
+  // Packet data comes from a pool sized to the largest packet seen
+  pool_attach_encoder(&enc->packet_pool, enc->enc_ctx);
+
+  // x264 starts its threads here, on this rendition's cores
+  char thread_name[16];
+  snprintf(thread_name, sizeof(thread_name), "x264-%s", preset->name);
+  ret = cores_open_codec(enc->enc_ctx, encoder, &opts, &enc->cores,
+                         thread_name);
+  av_dict_free(&opts);
+  if (ret < 0)
+    fprintf(stderr, "Could not open encoder: %s\n", av_err2str(ret));
+  return ret;
+}
+
+// Opens preset's x264 and the queue feeding it. The output is opened
+// separately by init_encoder_output().
+int init_encoder(EncoderContext *enc, QualityPreset *preset) {
+  enc->preset = preset;
+  enc->latency_stamps = latency_stamps;
+  buffer_pool_init(&enc->frame_pool, "scaled");
+  buffer_pool_init(&enc->packet_pool, "packet");
+  int ret = open_x264(enc, preset);
+  if (ret < 0)
+    return ret;
+
+  // Initialize the queue feeding this encoder's worker thread
+  ret = init_frame_queue(&enc->input_queue, preset->queue_depth,
+                         preset->drop_policy);
   if (ret < 0) {
-    fprintf(stderr, "Could not allocate frame buffers\n");
+    fprintf(stderr, "Could not initialize frame queue\n");
     return ret;
   }
+  return 0;
+}
+
+// Reopens the x264 of a rendition opened before the input was, once a copy
+// of the source turns out to join the ladder, so that it puts keyframes
+// only where the source has them.
+int encoder_follow_source(EncoderContext *enc) {
+  if (enc->follow_source)
+    return 0;
+  enc->follow_source = 1;
+  avcodec_free_context(&enc->enc_ctx);
+  return open_x264(enc, enc->preset);
+}
 
+// Returns 1 if the source stream described by par can stand in for preset's
+// encode as it is: H.264 in 8-bit 4:2:0 at the preset's size and at most its
+// frame rate, with the parameter sets an fMP4 init segment needs. A stream
+// that reports its bitrate must also keep within the preset's; one that
+// does not is taken at its word, as IP cameras rarely say.
+int encoder_can_copy(const AVCodecParameters *par, AVRational frame_rate,
+                     const QualityPreset *preset) {
+  return STREAM_COPY && par->codec_id == AV_CODEC_ID_H264 &&
+         (par->format == AV_PIX_FMT_YUV420P ||
+          par->format == AV_PIX_FMT_YUVJ420P) &&
+         par->width == preset->width && par->height == preset->height &&
+         av_q2d(frame_rate) <= preset->fps * STREAM_COPY_FPS_SLACK &&
+         par->extradata_size > 0 &&
+         par->bit_rate <= preset->bitrate * STREAM_COPY_BITRATE_SLACK;
+}
+
+// Makes enc a rendition that remuxes the source's packets rather than
+// encoding. Its codec context only describes the source stream, with the
+// source's time base. An x264 already opened for it is closed.
+int init_copy(EncoderContext *enc, QualityPreset *preset,
+              const AVCodecParameters *par, AVRational time_base) {
   enc->preset = preset;
+  enc->copy = 1;
+  enc->copy_origin = AV_NOPTS_VALUE;
+
+  avcodec_free_context(&enc->enc_ctx);
+  enc->enc_ctx = avcodec_alloc_context3(NULL);
+  if (!enc->enc_ctx)
+    return AVERROR(ENOMEM);
+  int ret = avcodec_parameters_to_context(enc->enc_ctx, par);
+  if (ret < 0)
+    return ret;
+  enc->enc_ctx->time_base = time_base;
+  return 0;
+}
+
+// Opens the muxer, or the origin stream, that enc's packets are written to,
+// and the queue the writer thread takes them from.
+int init_encoder_output(EncoderContext *enc, const char *output_dir,
+                        OriginStream *origin) {
+  QualityPreset *preset = enc->preset;
+  int ret;
+
+  enc->packet = av_packet_alloc();
+  if (!enc->packet)
+    return AVERROR(ENOMEM);
+
+  // Packets go to the muxer through a writer thread
+  ret = init_packet_queue(&enc->write_queue, WRITE_QUEUE_DEPTH,
+                          DROP_POLICY_BLOCK);
+  if (ret < 0) {
+    fprintf(stderr, "Could not initialize write queue\n");
+    return ret;
+  }
+
+  if (origin) {
+    // The origin fragments in memory; its muxer stands in for the HLS one
+    ret = origin_open_stream(origin, preset->name, enc->enc_ctx,
+                             latency_stamps);
+    if (ret < 0)
+      return ret;
+    enc->origin = origin;
+    enc->fmt_ctx = origin->mux;
+    enc->stream = origin->mux->streams[0];
+  } else if ((ret = init_hls_output(&enc->fmt_ctx, &enc->stream,
+                                    enc->enc_ctx, preset->name, output_dir,
+                                    0)) < 0) {
+    return ret;
+  }
+
+  latency_init(&enc->scale_latency);
+  latency_init(&enc->send_latency);
+  latency_init(&enc->receive_latency);
+  latency_init(&enc->write_latency);
+  latency_init(&enc->encode_latency);
+  latency_init(&enc->publish_latency);
+  latency_init(&enc->queue_depth);
+  latency_init(&enc->packet_size);
+  latency_init(&enc->write_queue_depth);
+  latency_init(&enc->publish_age);
+  enc->traced_count = 0;
+  atomic_init(&enc->encoded_frames, 0);
+  atomic_init(&enc->dropped_frames, 0);
+  atomic_init(&enc->decimated_frames, 0);
+  atomic_init(&enc->duplicated_frames, 0);
+  atomic_init(&enc->static_frames, 0);
+  atomic_init(&enc->static_saved_ns, 0);
+  enc->scale_avg_ns = enc->encode_avg_ns = 0;
+  atomic_init(&enc->bytes_out, 0);
+  atomic_init(&enc->segments, 0);
+
   enc->next_pts = 0;
-  enc->first_pts = AV_NOPTS_VALUE;
+  enc->next_boundary = 0;
+  enc->first_write_pts = AV_NOPTS_VALUE;
+  atomic_init(&enc->forced_keyframes, 0);
+  atomic_init(&enc->misaligned_keyframes, 0);
   enc->frame_time = 1.0 / preset->fps;
 
-  printf("Initialized %s encoder: %dx%d @ %d fps, %.2f Mbps\n", preset->name,
-         preset->width, preset->height, preset->fps,
-         preset->bitrate / 1000000.0);
+  if (enc->copy)
+    printf("Initialized %s stream copy: %dx%d\n", preset->name,
+           enc->enc_ctx->width, enc->enc_ctx->height);
+  else
+    printf("Initialized %s encoder: %dx%d @ %d fps, %.2f Mbps\n",
+           preset->name, preset->width, preset->height, preset->fps,
+           preset->bitrate / 1000000.0);
 
   return 0;
 }
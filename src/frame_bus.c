@@ -0,0 +1,396 @@
+// frame_bus.c
+// A frame bus hands decoded frames from one process to others through a
+// ring of slots in POSIX shared memory, so that parts of the ladder can run
+// in processes of their own (a crash domain, cgroup and CPU set each)
+// without decoding the input again. The producer copies or pre-scales each
+// frame into a slot once; consumers read it in place and hold the slot with
+// a reader count until their encoders let go of it. The producer never
+// waits for a consumer: it passes over slots still being read, and a
+// consumer a whole ring behind skips to the newest frame. Consumers sleep
+// on a futex in the mapping that every publish wakes.
+#include "../include/frame_bus.h"
+#include <fcntl.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define BUS_MAGIC 0x53554246 // "FBUS"
+#define BUS_VERSION 2
+#define SLOT_WRITING UINT64_MAX
+#define LEASE_READERS 0xffffffffu // Low half of a slot's lease
+#define LEASE_GENERATION(lease) ((lease) >> 32)
+
+// Every slot starts with this, followed by the frame's planes packed as
+// rawvideo packs them
+typedef struct BusSlot {
+  _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t tag; // Sequence + 1, 0 empty
+  atomic_uint_fast64_t lease; // Generation << 32 | readers
+  atomic_int_fast64_t leased; // Last taken, av_gettime_relative()
+  int64_t pts;
+  int64_t captured; // Capture time, av_gettime()
+} BusSlot;
+
+// Both sides must be built against the same FFmpeg, since pixel formats and
+// color properties are stored as its enum values.
+typedef struct FrameBusHeader {
+  atomic_uint magic; // Set last, once the rest is filled in
+  uint32_t version;
+  int width;
+  int height;
+  int format; // enum AVPixelFormat
+  int color_range;
+  int colorspace;
+  AVRational time_base;
+  AVRational frame_rate;
+  int slots;
+  int frame_size;
+  size_t slot_size;
+  pid_t producer;
+  atomic_int closed;
+  _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t written; // Next sequence
+  atomic_uint wake; // Futex bumped by every publish
+} FrameBusHeader;
+
+static void shm_path(const char *name, char *path, size_t size) {
+  snprintf(path, size, "/%s", name[0] == '/' ? name + 1 : name);
+}
+
+static size_t slots_offset(void) {
+  return FFALIGN(sizeof(FrameBusHeader), CACHE_LINE_SIZE);
+}
+
+static BusSlot *slot_at(FrameBusHeader *h, uint64_t seq) {
+  return (BusSlot *)((uint8_t *)h + slots_offset() +
+                     (seq % h->slots) * h->slot_size);
+}
+
+static uint8_t *slot_data(BusSlot *slot) { return (uint8_t *)(slot + 1); }
+
+static void futex_wake(atomic_uint *word) {
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void futex_wait(atomic_uint *word, unsigned value, int ms) {
+  struct timespec timeout = {ms / 1000, (ms % 1000) * 1000000L};
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+// Creates the bus with slots for frames as the decoder describes them, or
+// as bus->size asks for, in which case frames are pre-scaled to yuv420p
+// here once rather than by every consumer. A bus left behind by a producer
+// that died is replaced; consumers still attached to it see it end.
+int frame_bus_create(FrameBus *bus, const AVCodecContext *dec,
+                     AVRational time_base, AVRational frame_rate) {
+  int width = dec->width, height = dec->height;
+  enum AVPixelFormat format = dec->pix_fmt;
+  if (bus->size) {
+    if (av_parse_video_size(&width, &height, bus->size) < 0) {
+      fprintf(stderr, "Invalid bus frame size: %s\n", bus->size);
+      return AVERROR(EINVAL);
+    }
+    format = AV_PIX_FMT_YUV420P;
+  }
+  int frame_size = av_image_get_buffer_size(format, width, height, 1);
+  if (frame_size < 0) {
+    fprintf(stderr, "Cannot put %dx%d frames on a bus: %s\n", width, height,
+            av_err2str(frame_size));
+    return frame_size;
+  }
+
+  size_t slot_size = FFALIGN(sizeof(BusSlot) + frame_size, CACHE_LINE_SIZE);
+  size_t map_size = slots_offset() + BUS_SLOTS * slot_size;
+  char path[256];
+  shm_path(bus->name, path, sizeof(path));
+
+  shm_unlink(path);
+  int fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0 || ftruncate(fd, map_size) < 0) {
+    int err = errno;
+    fprintf(stderr, "Cannot create frame bus %s: %s\n", path, strerror(err));
+    if (fd >= 0) {
+      close(fd);
+      shm_unlink(path);
+    }
+    return AVERROR(err);
+  }
+  void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    int err = errno;
+    fprintf(stderr, "Cannot map frame bus %s: %s\n", path, strerror(err));
+    shm_unlink(path);
+    return AVERROR(err);
+  }
+
+  // The new object is zeroed: every slot is empty and unread
+  FrameBusHeader *h = map;
+  h->version = BUS_VERSION;
+  h->width = width;
+  h->height = height;
+  h->format = format;
+  h->color_range = dec->color_range;
+  h->colorspace = dec->colorspace;
+  h->time_base = time_base;
+  h->frame_rate = frame_rate;
+  h->slots = BUS_SLOTS;
+  h->frame_size = frame_size;
+  h->slot_size = slot_size;
+  h->producer = getpid();
+  atomic_store(&h->magic, BUS_MAGIC);
+
+  bus->header = h;
+  bus->map_size = map_size;
+  bus->producer = 1;
+  atomic_init(&bus->frames, 0);
+  atomic_init(&bus->busy, 0);
+  atomic_init(&bus->missed, 0);
+
+  printf("Frame bus %s: %dx%d %s, %d slots of %.1f MB\n", path, width, height,
+         av_get_pix_fmt_name(format), BUS_SLOTS, slot_size / 1048576.0);
+  return 0;
+}
+
+// Copies frame into the next slot nobody is reading and wakes the
+// consumers. Never waits: a slot a consumer holds is passed over unless its
+// lease is older than BUS_LEASE, in which case the consumer is taken to
+// have died holding it. The frame is dropped if every slot is held.
+int frame_bus_publish(FrameBus *bus, const AVFrame *frame) {
+  FrameBusHeader *h = bus->header;
+  int64_t now = av_gettime_relative();
+  uint64_t seq = atomic_load(&h->written);
+  BusSlot *slot = NULL;
+
+  for (int tries = 0; tries < h->slots; tries++, seq++) {
+    BusSlot *candidate = slot_at(h, seq);
+    uint64_t tag = atomic_load(&candidate->tag);
+
+    // Readers announce themselves before checking the tag, so with both
+    // sides sequentially consistent one of them always sees the other
+    atomic_store(&candidate->tag, SLOT_WRITING);
+    uint64_t lease = atomic_load(&candidate->lease);
+    if ((lease & LEASE_READERS) > 0 &&
+        now - atomic_load(&candidate->leased) < BUS_LEASE * AV_TIME_BASE) {
+      atomic_store(&candidate->tag, tag);
+      atomic_fetch_add(&bus->busy, 1);
+      continue;
+    }
+    // Reclaims a stale lease under a new generation, so that holds taken
+    // under the old one are not released against later readers
+    if (lease & LEASE_READERS)
+      atomic_store(&candidate->lease, (LEASE_GENERATION(lease) + 1) << 32);
+    slot = candidate;
+    break;
+  }
+  if (!slot)
+    return 0;
+
+  uint8_t *data[4];
+  int linesize[4];
+  av_image_fill_arrays(data, linesize, slot_data(slot), h->format, h->width,
+                       h->height, 1);
+  if (frame->width == h->width && frame->height == h->height &&
+      frame->format == h->format) {
+    av_image_copy(data, linesize, (const uint8_t **)frame->data,
+                  frame->linesize, h->format, h->width, h->height);
+  } else {
+    bus->sws = sws_getCachedContext(bus->sws, frame->width, frame->height,
+                                    frame->format, h->width, h->height,
+                                    h->format, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!bus->sws) {
+      atomic_store(&slot->tag, 0);
+      return AVERROR(ENOMEM);
+    }
+    sws_scale(bus->sws, (const uint8_t *const *)frame->data, frame->linesize,
+              0, frame->height, data, linesize);
+  }
+  slot->pts = frame->pts;
+  slot->captured = (intptr_t)frame->opaque;
+
+  atomic_store(&slot->tag, seq + 1);
+  atomic_store(&h->written, seq + 1);
+  atomic_fetch_add(&h->wake, 1);
+  futex_wake(&h->wake);
+  atomic_fetch_add(&bus->frames, 1);
+  return 0;
+}
+
+// Maps the bus a producer created under name and starts at its newest
+// frame. Returns the timing of the producer's input.
+int frame_bus_attach(FrameBus *bus, const char *name, AVRational *time_base,
+                     AVRational *frame_rate) {
+  char path[256];
+  shm_path(name, path, sizeof(path));
+
+  int fd = shm_open(path, O_RDWR, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    int err = errno;
+    fprintf(stderr, "Cannot open frame bus %s: %s\n", path, strerror(err));
+    if (fd >= 0)
+      close(fd);
+    return AVERROR(err);
+  }
+  if ((size_t)st.st_size < slots_offset()) {
+    fprintf(stderr, "%s is not a frame bus\n", path);
+    close(fd);
+    return AVERROR_INVALIDDATA;
+  }
+  void *map =
+      mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    int err = errno;
+    fprintf(stderr, "Cannot map frame bus %s: %s\n", path, strerror(err));
+    return AVERROR(err);
+  }
+
+  FrameBusHeader *h = map;
+  if (atomic_load(&h->magic) != BUS_MAGIC || h->version != BUS_VERSION ||
+      (size_t)st.st_size < slots_offset() + h->slots * h->slot_size) {
+    fprintf(stderr, "%s is not a frame bus, or not a finished one\n", path);
+    munmap(map, st.st_size);
+    return AVERROR_INVALIDDATA;
+  }
+
+  uint64_t written = atomic_load(&h->written);
+  bus->name = name;
+  bus->header = h;
+  bus->map_size = st.st_size;
+  bus->producer = 0;
+  bus->next = written ? written - 1 : 0;
+  atomic_init(&bus->frames, 0);
+  atomic_init(&bus->busy, 0);
+  atomic_init(&bus->missed, 0);
+
+  *time_base = h->time_base;
+  *frame_rate = h->frame_rate;
+  printf("Frame bus %s: %dx%d %s from process %d\n", path, h->width,
+         h->height, av_get_pix_fmt_name(h->format), (int)h->producer);
+  return 0;
+}
+
+// Describes the bus's frames as a rawvideo stream.
+void frame_bus_describe(const FrameBus *bus, AVCodecParameters *par) {
+  const FrameBusHeader *h = bus->header;
+  par->codec_type = AVMEDIA_TYPE_VIDEO;
+  par->codec_id = AV_CODEC_ID_RAWVIDEO;
+  par->width = h->width;
+  par->height = h->height;
+  par->format = h->format;
+  par->color_range = h->color_range;
+  par->color_space = h->colorspace;
+}
+
+// Lets go of a hold on slot taken under generation. A hold the producer
+// has since reclaimed from a reader it gave up on is no longer counted, so
+// it is not released again.
+static void release_lease(BusSlot *slot, uint64_t generation) {
+  uint64_t lease = atomic_load(&slot->lease);
+  while (LEASE_GENERATION(lease) == generation &&
+         (lease & LEASE_READERS) > 0 &&
+         !atomic_compare_exchange_weak(&slot->lease, &lease, lease - 1))
+    ;
+}
+
+// Buffer free callback: data is the slot's, opaque its lease generation.
+static void release_slot(void *opaque, uint8_t *data) {
+  release_lease((BusSlot *)data - 1, (uintptr_t)opaque);
+}
+
+// Takes slot if it still holds frame seq, storing the lease generation the
+// hold belongs to. Returns 1 if taken, 0 if the producer passed over the
+// slot, and -1 if it has overwritten the frame.
+static int acquire_slot(BusSlot *slot, uint64_t seq, uint64_t *generation) {
+  *generation = LEASE_GENERATION(atomic_fetch_add(&slot->lease, 1));
+  atomic_store(&slot->leased, av_gettime_relative());
+  uint64_t tag = atomic_load(&slot->tag);
+  if (tag == seq + 1)
+    return 1;
+
+  release_lease(slot, *generation);
+  return tag == SLOT_WRITING || tag > seq + 1 ? -1 : 0;
+}
+
+// Points packet at the next frame in place, as a rawvideo packet the decode
+// stage wraps without a copy. The slot is held until the last reference to
+// the packet's buffer goes. Returns AVERROR(EAGAIN) if nothing arrived
+// within BUS_WAIT_MS, and AVERROR_EOF once the producer has gone.
+int frame_bus_read(FrameBus *bus, AVPacket *packet) {
+  FrameBusHeader *h = bus->header;
+  unsigned wake = atomic_load(&h->wake);
+  uint64_t written = atomic_load(&h->written);
+
+  // A whole ring behind: everything older than the newest frame is gone
+  if (written >= bus->next + h->slots) {
+    atomic_fetch_add(&bus->missed, written - 1 - bus->next);
+    bus->next = written - 1;
+  }
+
+  while (bus->next < written) {
+    uint64_t seq = bus->next++;
+    BusSlot *slot = slot_at(h, seq);
+    uint64_t generation;
+    int taken = acquire_slot(slot, seq, &generation);
+    if (taken < 0)
+      atomic_fetch_add(&bus->missed, 1);
+    if (taken <= 0)
+      continue;
+
+    packet->buf = av_buffer_create(slot_data(slot), h->frame_size,
+                                   release_slot,
+                                   (void *)(uintptr_t)generation,
+                                   AV_BUFFER_FLAG_READONLY);
+    if (!packet->buf) {
+      release_lease(slot, generation);
+      return AVERROR(ENOMEM);
+    }
+    packet->data = packet->buf->data;
+    packet->size = h->frame_size;
+    packet->pts = packet->dts = slot->pts;
+    packet->opaque = (void *)(intptr_t)slot->captured;
+    packet->stream_index = 0;
+    packet->flags |= AV_PKT_FLAG_KEY;
+    atomic_fetch_add(&bus->frames, 1);
+    return 0;
+  }
+
+  // Frames published before the producer closed the bus are still read
+  if ((atomic_load(&h->closed) ||
+       (kill(h->producer, 0) < 0 && errno == ESRCH)) &&
+      atomic_load(&h->written) == bus->next)
+    return AVERROR_EOF;
+
+  futex_wait(&h->wake, wake, BUS_WAIT_MS);
+  return AVERROR(EAGAIN);
+}
+
+// The producer marks the bus closed, so that consumers read what is left
+// and stop, and removes its name. The memory is freed once the last
+// consumer has unmapped it, which a consumer does only after every packet
+// pointing into it has been released.
+void frame_bus_close(FrameBus *bus) {
+  FrameBusHeader *h = bus->header;
+  if (!h)
+    return;
+
+  if (bus->producer) {
+    char path[256];
+    shm_path(bus->name, path, sizeof(path));
+    atomic_store(&h->closed, 1);
+    atomic_fetch_add(&h->wake, 1);
+    futex_wake(&h->wake);
+    shm_unlink(path);
+  }
+  munmap(h, bus->map_size);
+  bus->header = NULL;
+  sws_freeContext(bus->sws);
+  bus->sws = NULL;
+}
@@ -0,0 +1,243 @@
+// frame_queue.c
+#include "../include/frame_queue.h"
+#include "../include/buffer.h"
+#include "../include/workpool.h"
+#include <errno.h>
+#include <time.h>
+
+static void sem_wait_uninterrupted(sem_t *sem) {
+  while (sem_wait(sem) < 0 && errno == EINTR)
+    ;
+}
+
+static int init_queue(FrameQueue *q, int capacity, RingItemType type,
+                      DropPolicy policy) {
+  int ret = init_ring_buffer(&q->ring, capacity, type);
+  if (ret < 0)
+    return ret;
+  ret = init_ring_buffer(&q->spare, capacity + QUEUE_SPARE_SHELLS, type);
+  if (ret < 0) {
+    free_ring_buffer(&q->ring);
+    return ret;
+  }
+  atomic_init(&q->shells.requests, 0);
+  atomic_init(&q->shells.misses, 0);
+  atomic_init(&q->shells.resident, 0);
+
+  sem_init(&q->items, 0, 0);
+  sem_init(&q->slots, 0, capacity);
+  atomic_init(&q->closed, 0);
+  q->drop_policy = policy;
+  return 0;
+}
+
+int init_frame_queue(FrameQueue *q, int capacity, DropPolicy policy) {
+  return init_queue(q, capacity, RING_ITEM_FRAME, policy);
+}
+
+// Dropping packets only keeps the stream decodable if every packet is a
+// keyframe, so most packet queues make the producer wait for space.
+int init_packet_queue(PacketQueue *q, int capacity, DropPolicy policy) {
+  return init_queue(q, capacity, RING_ITEM_PACKET, policy);
+}
+
+void free_frame_queue(FrameQueue *q) {
+  if (!q->ring.slots)
+    return;
+
+  free_ring_buffer(&q->ring);
+  free_ring_buffer(&q->spare);
+  sem_destroy(&q->items);
+  sem_destroy(&q->slots);
+}
+
+static size_t shell_size(const FrameQueue *q) {
+  return q->ring.type == RING_ITEM_FRAME ? sizeof(AVFrame) : sizeof(AVPacket);
+}
+
+// Producer side. Reuses a blank frame or packet handed back by the consumer,
+// allocating only when none is left.
+static void *take_shell(FrameQueue *q) {
+  atomic_fetch_add(&q->shells.requests, 1);
+  void *item = ring_buffer_pop(&q->spare);
+  if (item)
+    return item;
+
+  atomic_fetch_add(&q->shells.misses, 1);
+  item = q->ring.type == RING_ITEM_FRAME ? (void *)av_frame_alloc()
+                                         : (void *)av_packet_alloc();
+  if (item)
+    atomic_fetch_add(&q->shells.resident, shell_size(q));
+  return item;
+}
+
+static void free_shell(FrameQueue *q, void *item) {
+  atomic_fetch_sub(&q->shells.resident, shell_size(q));
+  if (q->ring.type == RING_ITEM_FRAME) {
+    AVFrame *frame = item;
+    av_frame_free(&frame);
+  } else {
+    AVPacket *packet = item;
+    av_packet_free(&packet);
+  }
+}
+
+// Consumer side. Drops the references item holds and hands it back to the
+// producer.
+static void release_shell(FrameQueue *q, void *item) {
+  if (q->ring.type == RING_ITEM_FRAME)
+    av_frame_unref(item);
+  else
+    av_packet_unref(item);
+
+  if (ring_buffer_push(&q->spare, item) < 0)
+    free_shell(q, item);
+}
+
+// A pool thread must not sleep on a full queue: the task that drains it may
+// be queued behind this one. It runs other tasks until a slot frees up.
+static void wait_for_slot(FrameQueue *q) {
+  if (!work_pool_on_worker()) {
+    sem_wait_uninterrupted(&q->slots);
+    return;
+  }
+
+  while (sem_trywait(&q->slots) < 0) {
+    if (work_pool_help())
+      continue;
+
+    // Nothing to run: the consumer is busy on another thread
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    if (sem_timedwait(&q->slots, &ts) == 0)
+      return;
+  }
+}
+
+// Waits for a slot if the policy asks for it. Returns AVERROR_EOF once the
+// queue is closed.
+static int queue_reserve(FrameQueue *q) {
+  if (q->drop_policy == DROP_POLICY_BLOCK)
+    wait_for_slot(q);
+
+  if (atomic_load(&q->closed))
+    return AVERROR_EOF;
+  return 0;
+}
+
+// Blocks until an item is available. Returns NULL once the queue has been
+// closed and drained.
+static void *queue_pop(FrameQueue *q) {
+  sem_wait_uninterrupted(&q->items);
+
+  // An empty ring after a successful wait means frame_queue_close() posted
+  void *item = ring_buffer_pop(&q->ring);
+  if (item && q->drop_policy == DROP_POLICY_BLOCK)
+    sem_post(&q->slots);
+  return item;
+}
+
+// Never blocks. Returns NULL if the queue is empty or has been closed; the
+// consumer tells the two apart with frame_queue_finished().
+static void *queue_try_pop(FrameQueue *q) {
+  if (sem_trywait(&q->items) < 0)
+    return NULL;
+
+  void *item = ring_buffer_pop(&q->ring);
+  if (item && q->drop_policy == DROP_POLICY_BLOCK)
+    sem_post(&q->slots);
+  return item;
+}
+
+// Queues a new reference to frame. Returns AVERROR(EAGAIN) if the frame was
+// dropped because the queue is full and the policy does not allow waiting.
+// Only one thread may push to a given queue.
+int frame_queue_push(FrameQueue *q, const AVFrame *frame) {
+  int ret = queue_reserve(q);
+  if (ret < 0)
+    return ret;
+  if (ring_buffer_full(&q->ring)) {
+    ring_buffer_note_drop(&q->ring);
+    return AVERROR(EAGAIN);
+  }
+
+  AVFrame *ref = take_shell(q);
+  if (!ref)
+    return AVERROR(ENOMEM);
+  ret = av_frame_ref(ref, frame);
+  if (ret >= 0)
+    ret = ring_buffer_push(&q->ring, ref);
+  if (ret < 0) {
+    // Only the consumer may return shells to the spare ring
+    free_shell(q, ref);
+    if (ret == AVERROR(EAGAIN))
+      ring_buffer_note_drop(&q->ring);
+    return ret;
+  }
+
+  sem_post(&q->items);
+  return 0;
+}
+
+// Only one thread at a time may pop from a given queue, and it hands the
+// frame back with frame_queue_release() once done with it.
+AVFrame *frame_queue_try_pop(FrameQueue *q) { return queue_try_pop(q); }
+
+void frame_queue_release(FrameQueue *q, AVFrame *frame) {
+  release_shell(q, frame);
+}
+
+// Moves the contents of packet into the queue, leaving packet blank. Waits
+// while the queue is full, or with DROP_POLICY_NEWEST drops packet and
+// returns AVERROR(EAGAIN). Only one thread may push to a given queue.
+int packet_queue_push(PacketQueue *q, AVPacket *packet) {
+  int ret = queue_reserve(q);
+  if (ret < 0)
+    return ret;
+  if (ring_buffer_full(&q->ring)) {
+    av_packet_unref(packet);
+    ring_buffer_note_drop(&q->ring);
+    return AVERROR(EAGAIN);
+  }
+
+  AVPacket *ref = take_shell(q);
+  if (!ref)
+    return AVERROR(ENOMEM);
+  av_packet_move_ref(ref, packet);
+
+  // Cannot fail when blocking: a slot was reserved above
+  if ((ret = ring_buffer_push(&q->ring, ref)) < 0) {
+    free_shell(q, ref);
+    ring_buffer_note_drop(&q->ring);
+    return ret;
+  }
+  sem_post(&q->items);
+  return 0;
+}
+
+// Blocks until a packet is available. Returns NULL once the queue has been
+// closed and drained. Only one thread may pop from a given queue, and it
+// hands the packet back with packet_queue_release() once done with it.
+AVPacket *packet_queue_pop(PacketQueue *q) { return queue_pop(q); }
+
+AVPacket *packet_queue_try_pop(PacketQueue *q) { return queue_try_pop(q); }
+
+void packet_queue_release(PacketQueue *q, AVPacket *packet) {
+  release_shell(q, packet);
+}
+
+void frame_queue_close(FrameQueue *q) {
+  atomic_store(&q->closed, 1);
+  sem_post(&q->items);
+  sem_post(&q->slots);
+}
+
+// True once the queue is closed and everything pushed has been popped.
+int frame_queue_finished(FrameQueue *q) {
+  return atomic_load(&q->closed) && !ring_buffer_count(&q->ring);
+}
@@ -0,0 +1,353 @@
+// http.c
+// Minimal HTTP/1.1 server for the origin and the metrics endpoint: GET only,
+// one thread per connection, keep-alive, no request bodies.
+#include "../include/http.h"
+#include <errno.h>
+#include <libavutil/time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+typedef struct HttpConnection {
+  HttpServer *srv;
+  int fd;
+} HttpConnection;
+
+static const char *status_text(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 503:
+    return "Service Unavailable";
+  default:
+    return "Internal Server Error";
+  }
+}
+
+int http_send_data(int fd, const void *data, size_t size) {
+  const char *p = data;
+  while (size > 0) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return AVERROR(errno);
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+int http_send_head(int fd, const HttpRequest *req, int status,
+                   const char *content_type, const char *extra_headers,
+                   size_t content_length) {
+  char head[1024];
+  int len = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Access-Control-Allow-Origin: *\r\n"
+                     "Connection: %s\r\n"
+                     "%s\r\n",
+                     status, status_text(status), content_type,
+                     content_length, req->keep_alive ? "keep-alive" : "close",
+                     extra_headers ? extra_headers : "");
+  if (len >= (int)sizeof(head))
+    return AVERROR(EINVAL);
+  return http_send_data(fd, head, len);
+}
+
+int http_send_response(int fd, const HttpRequest *req, int status,
+                       const char *content_type, const char *extra_headers,
+                       const void *body, size_t size) {
+  int ret = http_send_head(fd, req, status, content_type, extra_headers, size);
+  if (ret < 0)
+    return ret;
+  return http_send_data(fd, body, size);
+}
+
+int http_send_error(int fd, const HttpRequest *req, int status) {
+  char body[64];
+  int len = snprintf(body, sizeof(body), "%d %s\n", status,
+                     status_text(status));
+  return http_send_response(fd, req, status, "text/plain", NULL, body, len);
+}
+
+// Finds name=value in the query string. Returns a pointer to the value, or
+// NULL if the parameter is absent.
+static const char *query_value(const HttpRequest *req, const char *name) {
+  size_t name_len = strlen(name);
+  const char *p = req->query;
+  while (*p) {
+    if (!strncmp(p, name, name_len) && p[name_len] == '=')
+      return p + name_len + 1;
+    p = strchr(p, '&');
+    if (!p)
+      break;
+    p++;
+  }
+  return NULL;
+}
+
+// Returns 1 and sets *value if name is present with a numeric value.
+int http_query_int(const HttpRequest *req, const char *name, int64_t *value) {
+  const char *v = query_value(req, name);
+  if (!v)
+    return 0;
+
+  char *end;
+  long long n = strtoll(v, &end, 10);
+  if (end == v || (*end && *end != '&'))
+    return 0;
+  *value = n;
+  return 1;
+}
+
+int http_query_has(const HttpRequest *req, const char *name,
+                   const char *value) {
+  const char *v = query_value(req, name);
+  size_t len = strlen(value);
+  return v && !strncmp(v, value, len) && (v[len] == '\0' || v[len] == '&');
+}
+
+// Parses the request line and the headers we care about. Returns 0 on
+// success or an HTTP status to answer with.
+static int parse_request(char *head, HttpRequest *req) {
+  char target[sizeof(req->path)];
+  char version[16];
+  if (sscanf(head, "%7s %511s %15s", req->method, target, version) != 3)
+    return 400;
+
+  // HTTP/1.1 keeps the connection open unless asked not to
+  req->keep_alive = !strcmp(version, "HTTP/1.1");
+  for (char *line = strstr(head, "\r\n"); line; line = strstr(line, "\r\n")) {
+    line += 2;
+    if (!strncasecmp(line, "Connection:", 11)) {
+      const char *v = line + 11;
+      while (*v == ' ')
+        v++;
+      if (!strncasecmp(v, "close", 5))
+        req->keep_alive = 0;
+      else if (!strncasecmp(v, "keep-alive", 10))
+        req->keep_alive = 1;
+    }
+  }
+
+  memcpy(req->path, target, sizeof(req->path));
+  char *query = strchr(req->path, '?');
+  if (query)
+    *query++ = '\0';
+  req->query = query ? query : "";
+
+  if (strcmp(req->method, "GET"))
+    return 405;
+  return 0;
+}
+
+static void *connection_thread_func(void *arg) {
+  HttpConnection *conn = arg;
+  HttpServer *srv = conn->srv;
+  int fd = conn->fd;
+  free(conn);
+
+  // Short receive timeout so idle connections notice shutdown
+  struct timeval timeout = {.tv_sec = 1};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  char buf[4096];
+  size_t used = 0;
+  int idle = 0;
+
+  while (!atomic_load(&srv->stopping)) {
+    buf[used] = '\0';
+    char *end = strstr(buf, "\r\n\r\n");
+    if (!end) {
+      if (used == sizeof(buf) - 1)
+        break; // Headers too large
+      ssize_t n = recv(fd, buf + used, sizeof(buf) - 1 - used, 0);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        if (++idle >= HTTP_IDLE_TIMEOUT)
+          break;
+        continue;
+      }
+      if (n <= 0)
+        break;
+      used += n;
+      idle = 0;
+      continue;
+    }
+
+    *end = '\0';
+    HttpRequest req = {0};
+    int status = parse_request(buf, &req);
+    int ret = status ? http_send_error(fd, &req, status)
+                     : srv->handler(srv->opaque, &req, fd);
+
+    // Keep anything pipelined after this request
+    size_t consumed = end + 4 - buf;
+    memmove(buf, buf + consumed, used - consumed);
+    used -= consumed;
+
+    if (ret < 0 || !req.keep_alive)
+      break;
+  }
+
+  close(fd);
+  atomic_fetch_sub(&srv->connections, 1);
+  return NULL;
+}
+
+// Accepts "unix:/path" for a Unix socket, otherwise "host:port", ":port" or
+// "port" for TCP. A missing host binds to loopback only.
+static int open_listen_socket(const char *addr) {
+  int fd;
+
+  if (!strncmp(addr, "unix:", 5)) {
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    if (strlen(addr + 5) >= sizeof(sun.sun_path))
+      return AVERROR(ENAMETOOLONG);
+    strcpy(sun.sun_path, addr + 5);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return AVERROR(errno);
+    unlink(sun.sun_path);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+      goto fail;
+  } else {
+    char host[256];
+    const char *port = strrchr(addr, ':');
+    if (port) {
+      snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+      port++;
+    } else {
+      host[0] = '\0';
+      port = addr;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                             .ai_socktype = SOCK_STREAM,
+                             .ai_flags = AI_PASSIVE};
+    struct addrinfo *res;
+    int err = getaddrinfo(host[0] ? host : "127.0.0.1", port, &hints, &res);
+    if (err) {
+      fprintf(stderr, "Cannot resolve %s: %s\n", addr, gai_strerror(err));
+      return AVERROR(EINVAL);
+    }
+
+    fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+                res->ai_protocol);
+    if (fd < 0) {
+      freeaddrinfo(res);
+      return AVERROR(errno);
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    err = bind(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (err < 0)
+      goto fail;
+  }
+
+  if (listen(fd, HTTP_MAX_CONNECTIONS) < 0)
+    goto fail;
+  return fd;
+
+fail:;
+  int ret = AVERROR(errno);
+  close(fd);
+  return ret;
+}
+
+static void *accept_thread_func(void *arg) {
+  HttpServer *srv = arg;
+
+  while (!atomic_load(&srv->stopping)) {
+    // Wake up regularly to notice shutdown
+    struct pollfd pfd = {.fd = srv->listen_fd, .events = POLLIN};
+    if (poll(&pfd, 1, METRICS_POLL_INTERVAL_MS) <= 0)
+      continue;
+
+    int fd = accept(srv->listen_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+
+    if (atomic_load(&srv->connections) >= HTTP_MAX_CONNECTIONS) {
+      HttpRequest req = {0};
+      http_send_error(fd, &req, 503);
+      close(fd);
+      continue;
+    }
+
+    HttpConnection *conn = malloc(sizeof(*conn));
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    atomic_fetch_add(&srv->connections, 1);
+    if (conn) {
+      conn->srv = srv;
+      conn->fd = fd;
+    }
+    if (!conn || pthread_create(&thread, &attr, connection_thread_func,
+                                conn) != 0) {
+      atomic_fetch_sub(&srv->connections, 1);
+      free(conn);
+      close(fd);
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  return NULL;
+}
+
+int http_server_start(HttpServer *srv, const char *addr, HttpHandler handler,
+                      void *opaque) {
+  srv->addr = addr;
+  srv->handler = handler;
+  srv->opaque = opaque;
+  atomic_init(&srv->stopping, 0);
+  atomic_init(&srv->connections, 0);
+
+  srv->listen_fd = open_listen_socket(addr);
+  if (srv->listen_fd < 0) {
+    int ret = srv->listen_fd;
+    fprintf(stderr, "Cannot listen on %s: %s\n", addr, av_err2str(ret));
+    return ret;
+  }
+
+  if (pthread_create(&srv->thread, NULL, accept_thread_func, srv) != 0) {
+    fprintf(stderr, "Could not start HTTP server thread\n");
+    close(srv->listen_fd);
+    return -1;
+  }
+  srv->thread_running = 1;
+  return 0;
+}
+
+// Handlers that block must return once whatever they wait on is shut down;
+// this waits for every connection to finish.
+void http_server_stop(HttpServer *srv) {
+  if (!srv->thread_running)
+    return;
+
+  atomic_store(&srv->stopping, 1);
+  pthread_join(srv->thread, NULL);
+  srv->thread_running = 0;
+
+  close(srv->listen_fd);
+  if (!strncmp(srv->addr, "unix:", 5))
+    unlink(srv->addr + 5);
+
+  while (atomic_load(&srv->connections) > 0)
+    av_usleep(10000);
+}
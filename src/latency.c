@@ -0,0 +1,111 @@
+// latency.c
+#include "../include/latency.h"
+#include <time.h>
+
+void latency_init(LatencyHistogram *h) {
+  for (int i = 0; i < LATENCY_BUCKETS; i++)
+    atomic_init(&h->buckets[i], 0);
+  atomic_init(&h->count, 0);
+  atomic_init(&h->sum_ns, 0);
+  atomic_init(&h->max_ns, 0);
+}
+
+// Values below LATENCY_SUB_BUCKETS get one bucket each; above that each
+// power of two is split into LATENCY_SUB_BUCKETS equal parts.
+static int bucket_index(uint64_t v) {
+  if (v < LATENCY_SUB_BUCKETS)
+    return (int)v;
+
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - 4; // log2(LATENCY_SUB_BUCKETS)
+  int index = (shift + 1) * LATENCY_SUB_BUCKETS +
+              (int)((v >> shift) - LATENCY_SUB_BUCKETS);
+  return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+// Midpoint of the values that map to a bucket.
+static int64_t bucket_value(int index) {
+  if (index < LATENCY_SUB_BUCKETS)
+    return index;
+
+  int shift = index / LATENCY_SUB_BUCKETS - 1;
+  int64_t low = (int64_t)(LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS)
+                << shift;
+  return low + ((1LL << shift) >> 1);
+}
+
+void latency_record(LatencyHistogram *h, int64_t ns) {
+  if (ns < 0)
+    ns = 0;
+
+  atomic_fetch_add_explicit(&h->buckets[bucket_index(ns)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+
+  int64_t max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(
+                         &h->max_ns, &max, ns, memory_order_relaxed,
+                         memory_order_relaxed))
+    ;
+}
+
+int64_t latency_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Records the time elapsed since start_ns and returns the current time, so
+// consecutive stages can be chained.
+int64_t latency_since(LatencyHistogram *h, int64_t start_ns) {
+  int64_t now = latency_now_ns();
+  latency_record(h, now - start_ns);
+  return now;
+}
+
+int64_t latency_percentile(LatencyHistogram *h, double percentile) {
+  uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+  if (!count)
+    return 0;
+
+  uint64_t target = (uint64_t)(count * percentile / 100.0 + 0.5);
+  if (target < 1)
+    target = 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    if (seen >= target) {
+      int64_t max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+      int64_t value = bucket_value(i);
+      return value < max ? value : max;
+    }
+  }
+  return atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+}
+
+double latency_mean(LatencyHistogram *h) {
+  uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+  if (!count)
+    return 0;
+  return (double)atomic_load_explicit(&h->sum_ns, memory_order_relaxed) /
+         count;
+}
+
+// Number of recorded values up to value, to within the bucket resolution.
+// Only buckets entirely at or below value count, so the result never
+// includes a larger value but may leave out some of the bucket value falls
+// in. Used to export cumulative buckets at fixed bounds.
+uint64_t latency_count_le(LatencyHistogram *h, int64_t value) {
+  if (value < 0)
+    return 0;
+
+  int last = bucket_index(value);
+  if (value < INT64_MAX && bucket_index((uint64_t)value + 1) == last)
+    last--;
+  uint64_t count = 0;
+  for (int i = 0; i <= last; i++)
+    count += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+  return count;
+}
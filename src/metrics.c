@@ -0,0 +1,552 @@
+// metrics.c
+#include "../include/metrics.h"
+#include "../include/buffer.h"
+#include "../include/channel.h"
+#include "../include/http.h"
+#include "../include/latency.h"
+#include "../include/overload.h"
+#include "../include/pool.h"
+#include "../include/presets.h"
+#include <errno.h>
+#include <libavutil/time.h>
+#include <unistd.h>
+
+typedef struct HistogramBounds {
+  const double *bounds;
+  int count;
+  double scale; // Recorded units per exported unit
+} HistogramBounds;
+
+static const double SECONDS[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+                                 0.005,  0.01,    0.025,  0.05,  0.1,
+                                 0.25,   0.5,     1,      2.5};
+static const double AGES[] = {0.1, 0.2, 0.3, 0.5, 0.75, 1, 1.5, 2, 3, 5, 10};
+static const double FRAMES[] = {0, 1, 2, 4, 8, 16, 32};
+static const double PACKETS[] = {0, 1, 4, 16, 64, 128, 256};
+static const double BYTES[] = {256,   1024,   4096,   16384,
+                               65536, 262144, 1048576};
+
+static const HistogramBounds SECONDS_BOUNDS = {
+    SECONDS, FF_ARRAY_ELEMS(SECONDS), 1e9};
+static const HistogramBounds AGES_BOUNDS = {AGES, FF_ARRAY_ELEMS(AGES), 1e9};
+static const HistogramBounds FRAMES_BOUNDS = {FRAMES, FF_ARRAY_ELEMS(FRAMES),
+                                              1};
+static const HistogramBounds PACKETS_BOUNDS = {
+    PACKETS, FF_ARRAY_ELEMS(PACKETS), 1};
+static const HistogramBounds BYTES_BOUNDS = {BYTES, FF_ARRAY_ELEMS(BYTES), 1};
+
+static void print_header(AVBPrint *bp, const char *name, const char *type,
+                         const char *help) {
+  av_bprintf(bp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// labels is a comma separated list such as rendition="720p", or "".
+static void print_histogram(AVBPrint *bp, const char *name,
+                            const char *labels, LatencyHistogram *h,
+                            const HistogramBounds *b) {
+  const char *sep = labels[0] ? "," : "";
+  for (int i = 0; i < b->count; i++) {
+    av_bprintf(bp, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels,
+               sep, b->bounds[i],
+               latency_count_le(h, (int64_t)(b->bounds[i] * b->scale)));
+  }
+
+  // Total of the buckets rather than h->count, so that a concurrent record
+  // cannot make +Inf smaller than the last finite bucket
+  uint64_t total = latency_count_le(h, INT64_MAX);
+  av_bprintf(bp, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep,
+             total);
+  // Series without labels take no braces at all
+  const char *lbrace = labels[0] ? "{" : "", *rbrace = labels[0] ? "}" : "";
+  av_bprintf(bp, "%s_sum%s%s%s %.9g\n", name, lbrace, labels, rbrace,
+             atomic_load(&h->sum_ns) / b->scale);
+  av_bprintf(bp, "%s_count%s%s%s %" PRIu64 "\n", name, lbrace, labels, rbrace,
+             total);
+}
+
+static void rendition_label(char *buf, size_t size, const char *name,
+                            const EncoderContext *enc) {
+  if (name)
+    snprintf(buf, size, "rendition=\"%s\",stage=\"%s\"", enc->preset->name,
+             name);
+  else
+    snprintf(buf, size, "rendition=\"%s\"", enc->preset->name);
+}
+
+static void pool_label(char *buf, size_t size, const PoolInfo *pool) {
+  if (pool->rendition)
+    snprintf(buf, size, "pool=\"%s\",rendition=\"%s\"", pool->name,
+             pool->rendition);
+  else
+    snprintf(buf, size, "pool=\"%s\"", pool->name);
+}
+
+static void print_pools(AVBPrint *bp, TranscoderContext *ctx) {
+  PoolInfo pools[POOL_COUNT];
+  int count = pool_list(ctx, pools);
+  char labels[128];
+
+  print_header(bp, "transcoder_pool_requests_total", "counter",
+               "Buffers requested from a pool.");
+  for (int i = 0; i < count; i++) {
+    pool_label(labels, sizeof(labels), &pools[i]);
+    av_bprintf(bp, "transcoder_pool_requests_total{%s} %" PRIu64 "\n",
+               labels, (uint64_t)atomic_load(&pools[i].stats->requests));
+  }
+
+  print_header(bp, "transcoder_pool_misses_total", "counter",
+               "Pool requests that had to allocate.");
+  for (int i = 0; i < count; i++) {
+    pool_label(labels, sizeof(labels), &pools[i]);
+    av_bprintf(bp, "transcoder_pool_misses_total{%s} %" PRIu64 "\n", labels,
+               (uint64_t)atomic_load(&pools[i].stats->misses));
+  }
+
+  print_header(bp, "transcoder_pool_resident_bytes", "gauge",
+               "Memory currently allocated by a pool.");
+  for (int i = 0; i < count; i++) {
+    pool_label(labels, sizeof(labels), &pools[i]);
+    av_bprintf(bp, "transcoder_pool_resident_bytes{%s} %" PRId64 "\n",
+               labels, (int64_t)atomic_load(&pools[i].stats->resident));
+  }
+}
+
+// Renders every metric in the Prometheus text exposition format.
+void metrics_render(TranscoderContext *ctx, AVBPrint *bp) {
+  char labels[128];
+
+  print_header(bp, "transcoder_uptime_seconds", "gauge",
+               "Time since transcoding started.");
+  av_bprintf(bp, "transcoder_uptime_seconds %.3f\n",
+             (av_gettime() - ctx->start_time) / 1000000.0);
+
+  print_header(bp, "transcoder_startup_seconds", "gauge",
+               "Time from start until each startup milestone was reached.");
+  for (int i = 0; i < STARTUP_MILESTONES; i++) {
+    int64_t reached = atomic_load(&ctx->startup.reached[i]);
+    if (reached)
+      av_bprintf(bp, "transcoder_startup_seconds{milestone=\"%s\"} %.3f\n",
+                 startup_milestone_name(i), reached / 1000000.0);
+  }
+
+  CaptureStats *capture = &ctx->capture;
+  print_header(bp, "transcoder_capture_frames_total", "counter",
+               "Frames read from the input by the capture thread.");
+  av_bprintf(bp, "transcoder_capture_frames_total %" PRIu64 "\n",
+             (uint64_t)atomic_load(&capture->frames));
+
+  print_header(bp, "transcoder_capture_dropped_total", "counter",
+               "Input frames lost before decoding, by where they were lost.");
+  av_bprintf(bp,
+             "transcoder_capture_dropped_total{reason=\"driver\"} %" PRIu64
+             "\n",
+             (uint64_t)atomic_load(&capture->driver_dropped));
+  av_bprintf(bp,
+             "transcoder_capture_dropped_total{reason=\"decode_queue\"} "
+             "%" PRIu64 "\n",
+             (uint64_t)atomic_load(&ctx->decode_queue.ring.dropped));
+
+  print_header(bp, "transcoder_capture_gaps_total", "counter",
+               "Times the driver dropped one or more frames in a row.");
+  av_bprintf(bp, "transcoder_capture_gaps_total %" PRIu64 "\n",
+             (uint64_t)atomic_load(&capture->gaps));
+
+  FrameBus *bus = &ctx->bus;
+  if (bus->header) {
+    const char *role = bus->producer ? "producer" : "consumer";
+    print_header(bp, "transcoder_bus_frames_total", "counter",
+                 "Frames published to, or read from, the frame bus.");
+    av_bprintf(bp,
+               "transcoder_bus_frames_total{bus=\"%s\",role=\"%s\"} "
+               "%" PRIu64 "\n",
+               bus->name, role, (uint64_t)atomic_load(&bus->frames));
+
+    print_header(bp, "transcoder_bus_skipped_total", "counter",
+                 "Slots the producer passed over because they were being "
+                 "read, or frames a consumer missed because it fell behind.");
+    av_bprintf(bp,
+               "transcoder_bus_skipped_total{bus=\"%s\",reason=\"%s\"} "
+               "%" PRIu64 "\n",
+               bus->name, bus->producer ? "busy" : "missed",
+               (uint64_t)atomic_load(bus->producer ? &bus->busy
+                                                   : &bus->missed));
+  }
+
+  print_header(bp, "transcoder_frames_decoded_total", "counter",
+               "Frames decoded from the input.");
+  av_bprintf(bp, "transcoder_frames_decoded_total %" PRId64 "\n",
+             (int64_t)atomic_load(&ctx->decoded_frames));
+
+  print_header(bp, "transcoder_frames_static_total", "counter",
+               "Decoded frames that showed nothing new since the last.");
+  av_bprintf(bp, "transcoder_frames_static_total %" PRIu64 "\n",
+             (uint64_t)atomic_load(&ctx->scene.static_frames));
+
+  print_header(bp, "transcoder_decode_frames_in_flight", "gauge",
+               "Packets sent to the decoder whose frame is not out yet.");
+  av_bprintf(bp, "transcoder_decode_frames_in_flight %d\n",
+             atomic_load(&ctx->decode_in_flight));
+
+  print_header(bp, "transcoder_frames_encoded_total", "counter",
+               "Packets muxed per rendition.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp, "transcoder_frames_encoded_total{rendition=\"%s\"} %" PRIu64
+               "\n",
+               enc->preset->name, (uint64_t)atomic_load(&enc->encoded_frames));
+  }
+
+  print_header(bp, "transcoder_frames_dropped_total", "counter",
+               "Frames a rendition did not encode.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp,
+               "transcoder_frames_dropped_total{rendition=\"%s\","
+               "reason=\"queue_full\"} %" PRIu64 "\n",
+               enc->preset->name,
+               (uint64_t)atomic_load(&enc->input_queue.ring.dropped));
+    av_bprintf(bp,
+               "transcoder_frames_dropped_total{rendition=\"%s\","
+               "reason=\"error\"} %" PRIu64 "\n",
+               enc->preset->name, (uint64_t)atomic_load(&enc->dropped_frames));
+    av_bprintf(bp,
+               "transcoder_frames_dropped_total{rendition=\"%s\","
+               "reason=\"decimated\"} %" PRIu64 "\n",
+               enc->preset->name,
+               (uint64_t)atomic_load(&enc->decimated_frames));
+    for (int s = 0; s < OVERLOAD_SKIPS; s++)
+      av_bprintf(bp,
+                 "transcoder_frames_dropped_total{rendition=\"%s\","
+                 "reason=\"overload_%s\"} %" PRIu64 "\n",
+                 enc->preset->name, overload_skip_name(s),
+                 (uint64_t)atomic_load(&enc->overload.skipped[s]));
+  }
+
+  print_header(bp, "transcoder_frames_duplicated_total", "counter",
+               "Frames encoded again to keep a rendition's frame rate.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp,
+               "transcoder_frames_duplicated_total{rendition=\"%s\"} %" PRIu64
+               "\n",
+               enc->preset->name,
+               (uint64_t)atomic_load(&enc->duplicated_frames));
+  }
+
+  print_header(bp, "transcoder_frames_reused_total", "counter",
+               "Static frames encoded from the picture last scaled.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp,
+               "transcoder_frames_reused_total{rendition=\"%s\"} %" PRIu64
+               "\n",
+               enc->preset->name, (uint64_t)atomic_load(&enc->static_frames));
+  }
+
+  print_header(bp, "transcoder_static_saved_seconds_total", "counter",
+               "Scaling and encoding time not spent on static frames.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp,
+               "transcoder_static_saved_seconds_total{rendition=\"%s\"} "
+               "%.6f\n",
+               enc->preset->name,
+               atomic_load(&enc->static_saved_ns) / 1e9);
+  }
+
+  if (ctx->audio.enc_ctx) {
+    AudioContext *audio = &ctx->audio;
+    print_header(bp, "transcoder_audio_frames_encoded_total", "counter",
+                 "AAC frames muxed into the audio rendition.");
+    av_bprintf(bp, "transcoder_audio_frames_encoded_total %" PRIu64 "\n",
+               (uint64_t)atomic_load(&audio->encoded_frames));
+    print_header(bp, "transcoder_audio_packets_dropped_total", "counter",
+                 "Audio packets not decoded or muxed, or dropped at the "
+                 "queue.");
+    av_bprintf(bp, "transcoder_audio_packets_dropped_total %" PRIu64 "\n",
+               (uint64_t)(atomic_load(&audio->dropped_packets) +
+                          atomic_load(&audio->queue.ring.dropped)));
+    print_header(bp, "transcoder_audio_bytes_out_total", "counter",
+                 "Bytes muxed into the audio rendition.");
+    av_bprintf(bp, "transcoder_audio_bytes_out_total %" PRIu64 "\n",
+               (uint64_t)atomic_load(&audio->bytes_out));
+    print_header(bp, "transcoder_audio_sync_offset_seconds", "histogram",
+                 "Distance of decoded audio from where its timestamp puts "
+                 "it on the video timeline, before correction.");
+    print_histogram(bp, "transcoder_audio_sync_offset_seconds", "",
+                    &audio->sync_offset, &SECONDS_BOUNDS);
+  }
+
+  print_header(bp, "transcoder_keyframes_forced_total", "counter",
+               "Keyframes forced on the shared keyframe timeline.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp,
+               "transcoder_keyframes_forced_total{rendition=\"%s\"} %" PRIu64
+               "\n",
+               enc->preset->name,
+               (uint64_t)atomic_load(&enc->forced_keyframes));
+  }
+
+  print_header(bp, "transcoder_keyframes_misaligned_total", "counter",
+               "Timeline keyframes placed on a different source frame than "
+               "in another rendition.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp,
+               "transcoder_keyframes_misaligned_total{rendition=\"%s\"} "
+               "%" PRIu64 "\n",
+               enc->preset->name,
+               (uint64_t)atomic_load(&enc->misaligned_keyframes));
+  }
+
+  print_header(bp, "transcoder_overload_level", "gauge",
+               "Degradation level: 0 none, 1 half rate, 2 drop late frames, "
+               "3 shed.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp, "transcoder_overload_level{rendition=\"%s\"} %d\n",
+               enc->preset->name, atomic_load(&enc->overload.level));
+  }
+
+  print_header(bp, "transcoder_overload_load_ratio", "gauge",
+               "Average busy time per frame over the frame budget.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp, "transcoder_overload_load_ratio{rendition=\"%s\"} %.2f\n",
+               enc->preset->name,
+               atomic_load(&enc->overload.load_percent) / 100.0);
+  }
+
+  print_header(bp, "transcoder_overload_changes_total", "counter",
+               "Overload level changes.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp,
+               "transcoder_overload_changes_total{rendition=\"%s\","
+               "direction=\"up\"} %" PRIu64 "\n",
+               enc->preset->name, (uint64_t)atomic_load(&enc->overload.raised));
+    av_bprintf(bp,
+               "transcoder_overload_changes_total{rendition=\"%s\","
+               "direction=\"down\"} %" PRIu64 "\n",
+               enc->preset->name,
+               (uint64_t)atomic_load(&enc->overload.lowered));
+  }
+
+  print_header(bp, "transcoder_bytes_out_total", "counter",
+               "Encoded bytes handed to the muxer.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp, "transcoder_bytes_out_total{rendition=\"%s\"} %" PRIu64
+               "\n",
+               enc->preset->name, (uint64_t)atomic_load(&enc->bytes_out));
+  }
+
+  print_header(bp, "transcoder_segments_total", "counter",
+               "HLS segments completed.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp, "transcoder_segments_total{rendition=\"%s\"} %" PRIu64
+               "\n",
+               enc->preset->name, (uint64_t)atomic_load(&enc->segments));
+  }
+
+  print_header(bp, "transcoder_queue_frames", "gauge",
+               "Frames waiting in a rendition's input queue.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp, "transcoder_queue_frames{rendition=\"%s\"} %zu\n",
+               enc->preset->name, ring_buffer_count(&enc->input_queue.ring));
+  }
+
+  print_header(bp, "transcoder_write_queue_packets", "gauge",
+               "Encoded packets waiting for the writer thread.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp, "transcoder_write_queue_packets{rendition=\"%s\"} %zu\n",
+               enc->preset->name, ring_buffer_count(&enc->write_queue.ring));
+  }
+
+  print_header(bp, "transcoder_write_queue_peak_packets", "gauge",
+               "Most packets ever waiting for the writer thread.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    av_bprintf(bp,
+               "transcoder_write_queue_peak_packets{rendition=\"%s\"} %zu\n",
+               enc->preset->name,
+               (size_t)atomic_load(&enc->write_queue.ring.high_water));
+  }
+
+  print_pools(bp, ctx);
+
+  print_header(bp, "transcoder_stage_duration_seconds", "histogram",
+               "Time spent in each pipeline stage.");
+  print_histogram(bp, "transcoder_stage_duration_seconds", "stage=\"read\"",
+                  &ctx->read_latency, &SECONDS_BOUNDS);
+  print_histogram(bp, "transcoder_stage_duration_seconds", "stage=\"decode\"",
+                  &ctx->decode_latency, &SECONDS_BOUNDS);
+  print_histogram(bp, "transcoder_stage_duration_seconds",
+                  "stage=\"decode_delay\"", &ctx->decode_delay,
+                  &SECONDS_BOUNDS);
+  print_histogram(bp, "transcoder_stage_duration_seconds", "stage=\"scene\"",
+                  &ctx->scene.detect_latency, &SECONDS_BOUNDS);
+  if (ctx->audio.enc_ctx)
+    print_histogram(bp, "transcoder_stage_duration_seconds",
+                    "stage=\"audio_encode\"", &ctx->audio.encode_latency,
+                    &SECONDS_BOUNDS);
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    rendition_label(labels, sizeof(labels), "scale", enc);
+    print_histogram(bp, "transcoder_stage_duration_seconds", labels,
+                    &enc->scale_latency, &SECONDS_BOUNDS);
+    rendition_label(labels, sizeof(labels), "send_frame", enc);
+    print_histogram(bp, "transcoder_stage_duration_seconds", labels,
+                    &enc->send_latency, &SECONDS_BOUNDS);
+    rendition_label(labels, sizeof(labels), "receive_packet", enc);
+    print_histogram(bp, "transcoder_stage_duration_seconds", labels,
+                    &enc->receive_latency, &SECONDS_BOUNDS);
+    rendition_label(labels, sizeof(labels), "write", enc);
+    print_histogram(bp, "transcoder_stage_duration_seconds", labels,
+                    &enc->write_latency, &SECONDS_BOUNDS);
+  }
+
+  print_header(bp, "transcoder_encode_duration_seconds", "histogram",
+               "Encoder time per input frame.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    rendition_label(labels, sizeof(labels), NULL, &ctx->encoders[i]);
+    print_histogram(bp, "transcoder_encode_duration_seconds", labels,
+                    &ctx->encoders[i].encode_latency, &SECONDS_BOUNDS);
+  }
+
+  print_header(bp, "transcoder_segment_publish_seconds", "histogram",
+               "Time to write the packet that completes a segment.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    rendition_label(labels, sizeof(labels), NULL, &ctx->encoders[i]);
+    print_histogram(bp, "transcoder_segment_publish_seconds", labels,
+                    &ctx->encoders[i].publish_latency, &SECONDS_BOUNDS);
+  }
+
+  print_header(bp, "transcoder_capture_to_publish_seconds", "histogram",
+               "Age of each frame, from capture to its part or segment "
+               "being published.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    rendition_label(labels, sizeof(labels), NULL, &ctx->encoders[i]);
+    print_histogram(bp, "transcoder_capture_to_publish_seconds", labels,
+                    &ctx->encoders[i].publish_age, &AGES_BOUNDS);
+  }
+
+  print_header(bp, "transcoder_queue_depth_frames", "histogram",
+               "Input queue depth seen by the encoder at each frame.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    rendition_label(labels, sizeof(labels), NULL, &ctx->encoders[i]);
+    print_histogram(bp, "transcoder_queue_depth_frames", labels,
+                    &ctx->encoders[i].queue_depth, &FRAMES_BOUNDS);
+  }
+
+  print_header(bp, "transcoder_write_queue_depth_packets", "histogram",
+               "Write queue depth seen by the writer at each packet.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    rendition_label(labels, sizeof(labels), NULL, &ctx->encoders[i]);
+    print_histogram(bp, "transcoder_write_queue_depth_packets", labels,
+                    &ctx->encoders[i].write_queue_depth, &PACKETS_BOUNDS);
+  }
+
+  print_header(bp, "transcoder_packet_size_bytes", "histogram",
+               "Size of each encoded packet.");
+  for (int i = 0; i < ctx->renditions; i++) {
+    rendition_label(labels, sizeof(labels), NULL, &ctx->encoders[i]);
+    print_histogram(bp, "transcoder_packet_size_bytes", labels,
+                    &ctx->encoders[i].packet_size, &BYTES_BOUNDS);
+  }
+}
+
+// Writes to a temporary file and renames it over the target, so a scraper
+// (e.g. the node_exporter textfile collector) never sees a partial file.
+static int write_metrics_file(TranscoderContext *ctx) {
+  char tmp_path[1024];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ctx->metrics.file);
+
+  FILE *f = fopen(tmp_path, "w");
+  if (!f)
+    return AVERROR(errno);
+
+  AVBPrint bp;
+  av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+  metrics_render(ctx, &bp);
+  fwrite(bp.str, 1, bp.len, f);
+  av_bprint_finalize(&bp, NULL);
+
+  if (fclose(f) != 0 || rename(tmp_path, ctx->metrics.file) < 0) {
+    unlink(tmp_path);
+    return AVERROR(errno);
+  }
+  return 0;
+}
+
+static int metrics_handler(void *opaque, const HttpRequest *req, int fd) {
+  TranscoderContext *ctx = opaque;
+  if (strcmp(req->path, "/metrics") && strcmp(req->path, "/"))
+    return http_send_error(fd, req, 404);
+
+  AVBPrint bp;
+  av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+  metrics_render(ctx, &bp);
+  int ret = http_send_response(fd, req, 200, "text/plain; version=0.0.4",
+                               NULL, bp.str, bp.len);
+  av_bprint_finalize(&bp, NULL);
+  return ret;
+}
+
+static void *metrics_thread_func(void *arg) {
+  TranscoderContext *ctx = (TranscoderContext *)arg;
+  MetricsExporter *m = &ctx->metrics;
+
+  while (ctx->running) {
+    if (write_metrics_file(ctx) < 0)
+      fprintf(stderr, "Cannot write metrics to %s\n", m->file);
+
+    // Sleep in short steps to notice shutdown
+    for (int64_t t = 0; ctx->running && t < MONITORING_INTERVAL * 1000;
+         t += METRICS_POLL_INTERVAL_MS)
+      av_usleep(METRICS_POLL_INTERVAL_MS * 1000);
+  }
+
+  return NULL;
+}
+
+int metrics_start(TranscoderContext *ctx) {
+  MetricsExporter *m = &ctx->metrics;
+  int ret;
+
+  if (m->listen) {
+    if ((ret = http_server_start(&m->server, m->listen, metrics_handler,
+                                 ctx)) < 0)
+      return ret;
+    printf("Serving metrics on %s\n", m->listen);
+  }
+
+  if (m->file) {
+    if (pthread_create(&m->thread, NULL, metrics_thread_func, ctx) != 0) {
+      fprintf(stderr, "Could not start metrics thread\n");
+      return -1;
+    }
+    m->thread_running = 1;
+    printf("Writing metrics to %s\n", m->file);
+  }
+
+  return 0;
+}
+
+// Call after ctx->running has been cleared. The file gets a final write so
+// that it holds the totals of the whole run.
+void metrics_stop(TranscoderContext *ctx) {
+  MetricsExporter *m = &ctx->metrics;
+
+  http_server_stop(&m->server);
+
+  if (m->thread_running) {
+    pthread_join(m->thread, NULL);
+    m->thread_running = 0;
+    write_metrics_file(ctx);
+  }
+}
@@ -1,30 +1,123 @@
 // monitor.c
 #include "../include/monitor.h"
-#include "../include/presets.h"
+#include "../include/buffer.h"
+#include "../include/cores.h"
+#include "../include/latency.h"
+#include "../include/overload.h"
+#include "../include/pool.h"
 #include <libavutil/time.h>
 #include <unistd.h>
 void print_stats(TranscoderContext *ctx) {
   double elapsed_time = (av_gettime() - ctx->start_time) / 1000000.0;
-  printf("\rRunning time: %.2f seconds\n", elapsed_time);
-
-  for (int i = 0; i < MAX_QUALITY_LEVELS; i++) {
-    QualityPreset *preset = &QUALITY_PRESETS[i];
-    double fps = preset->total_frames / elapsed_time;
-    double drop_rate =
-        preset->total_frames > 0
-            ? (double)preset->dropped_frames / preset->total_frames * 100
-            : 0;
-
-    printf("%s: %d frames, %d dropped (%.2f%%) - %.2f fps\n", preset->name,
-           preset->total_frames, preset->dropped_frames, drop_rate, fps);
+  printf("\r[%s] Running time: %.2f seconds\n", ctx->output_dir,
+         elapsed_time);
+  CaptureStats *capture = &ctx->capture;
+  uint64_t captured = atomic_load(&capture->frames);
+  uint64_t driver_dropped = atomic_load(&capture->driver_dropped);
+  printf("Capture: %" PRIu64 " frames, %" PRIu64 " dropped by the driver "
+         "(%.2f%%) in %" PRIu64 " gaps, %" PRIu64 " at the decode queue\n",
+         captured, driver_dropped,
+         captured ? 100.0 * driver_dropped / (captured + driver_dropped) : 0,
+         (uint64_t)atomic_load(&capture->gaps),
+         (uint64_t)atomic_load(&ctx->decode_queue.ring.dropped));
+  FrameBus *bus = &ctx->bus;
+  if (bus->header && bus->producer)
+    printf("Bus %s: %" PRIu64 " frames published, %" PRIu64
+           " slots passed over while read\n",
+           bus->name, (uint64_t)atomic_load(&bus->frames),
+           (uint64_t)atomic_load(&bus->busy));
+  else if (bus->header)
+    printf("Bus %s: %" PRIu64 " frames read, %" PRIu64 " missed\n",
+           bus->name, (uint64_t)atomic_load(&bus->frames),
+           (uint64_t)atomic_load(&bus->missed));
+  printf("Decode: %d in flight, delay p50 %.1f ms, p99 %.1f ms\n",
+         atomic_load(&ctx->decode_in_flight),
+         latency_percentile(&ctx->decode_delay, 50) / 1e6,
+         latency_percentile(&ctx->decode_delay, 99) / 1e6);
+  AudioContext *audio = &ctx->audio;
+  if (audio->enc_ctx)
+    printf("Audio: %" PRIu64 " frames, %.0f kbps, %" PRIu64 " dropped, "
+           "sync offset p50 %.1f ms, p99 %.1f ms\n",
+           (uint64_t)atomic_load(&audio->encoded_frames),
+           atomic_load(&audio->bytes_out) * 8 / elapsed_time / 1000,
+           (uint64_t)(atomic_load(&audio->dropped_packets) +
+                      atomic_load(&audio->queue.ring.dropped)),
+           latency_percentile(&audio->sync_offset, 50) / 1e6,
+           latency_percentile(&audio->sync_offset, 99) / 1e6);
+  SceneDetector *scene = &ctx->scene;
+  uint64_t marked = atomic_load(&scene->frames);
+  if (marked)
+    printf("Scene: %.1f%% of frames static, detect p50 %.2f ms, p99 %.2f ms\n",
+           100.0 * atomic_load(&scene->static_frames) / marked,
+           latency_percentile(&scene->detect_latency, 50) / 1e6,
+           latency_percentile(&scene->detect_latency, 99) / 1e6);
+
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    RingBuffer *ring = &enc->input_queue.ring;
+    uint64_t frames = atomic_load(&enc->encoded_frames);
+    uint64_t dropped =
+        atomic_load(&enc->dropped_frames) + atomic_load(&ring->dropped);
+    double fps = frames / elapsed_time;
+    double drop_rate = frames > 0 ? (double)dropped / frames * 100 : 0;
+
+    printf("%s: %" PRIu64 " frames, %" PRIu64 " dropped (%.2f%%) - %.2f/%d "
+           "fps, queue %zu/%zu (peak %zu)\n",
+           enc->preset->name, frames, dropped, drop_rate, fps,
+           enc->preset->fps, ring_buffer_count(ring), ring->depth,
+           atomic_load(&ring->high_water));
+
+    if (atomic_load(&enc->publish_age.count))
+      printf("  capture to publish: p50 %.0f ms, p99 %.0f ms\n",
+             latency_percentile(&enc->publish_age, 50) / 1e6,
+             latency_percentile(&enc->publish_age, 99) / 1e6);
+
+    uint64_t reused = atomic_load(&enc->static_frames);
+    if (reused)
+      printf("  static: %" PRIu64 " frames reused, %.2f s CPU saved\n", reused,
+             atomic_load(&enc->static_saved_ns) / 1e9);
+
+    uint64_t misaligned = atomic_load(&enc->misaligned_keyframes);
+    if (misaligned)
+      printf("  %" PRIu64 " of %" PRIu64 " keyframes misaligned\n",
+             misaligned, (uint64_t)atomic_load(&enc->forced_keyframes));
+
+    OverloadControl *oc = &enc->overload;
+    int level = atomic_load(&oc->level);
+    if (oc->enabled && (level || atomic_load(&oc->raised)))
+      printf("  overload: %s, load %d%%, raised %" PRIu64 " lowered %" PRIu64
+             " times\n",
+             overload_level_name(level), atomic_load(&oc->load_percent),
+             (uint64_t)atomic_load(&oc->raised),
+             (uint64_t)atomic_load(&oc->lowered));
+  }
+
+  PoolInfo pools[POOL_COUNT];
+  int count = pool_list(ctx, pools);
+  uint64_t requests = 0, misses = 0;
+  int64_t resident = 0;
+  for (int i = 0; i < count; i++) {
+    requests += atomic_load(&pools[i].stats->requests);
+    misses += atomic_load(&pools[i].stats->misses);
+    resident += atomic_load(&pools[i].stats->resident);
   }
+  printf("Pools: %.2f%% hit rate, %.1f MiB resident\n",
+         requests ? 100.0 * (requests - misses) / requests : 100.0,
+         resident / (1024.0 * 1024.0));
+  if (ctx->pool)
+    printf("Work pool: %d threads, %" PRIu64 " task runs, %" PRIu64
+           " steals\n",
+           ctx->pool->thread_count, atomic_load(&ctx->pool->runs),
+           atomic_load(&ctx->pool->steals));
   printf("\n");
 }
 
 void *monitor_thread_func(void *arg) {
   TranscoderContext *ctx = (TranscoderContext *)arg;
+  cores_pin_thread(NULL, "monitor");
   while (ctx->running) {
     print_stats(ctx);
+    cores_print_usage();
     sleep(MONITORING_INTERVAL);
   }
   return NULL;
@@ -0,0 +1,520 @@
+// offline.c
+// Offline mode transcodes a whole file as fast as the machine allows. The
+// file is cut at segment boundaries into chunks that workers encode on their
+// own: each opens the file, seeks to its chunk and runs a single-threaded
+// encoder per rendition, so every core works on a different stretch of the
+// file. The main thread writes the chunks' packets to one VOD playlist per
+// rendition in order.
+//
+// Every chunk covers a fixed range of output frames, filling input gaps with
+// the previous frame and dropping frames beyond the preset rate, and starts
+// on a forced IDR. Consecutive chunks therefore continue each other's
+// timestamps, B-frame delay included, as if one encoder had run throughout.
+#include "../include/offline.h"
+#include "../include/cores.h"
+#include "../include/encoder.h"
+#include "../include/presets.h"
+#include "../include/source.h"
+#include "../include/utils.h"
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include <math.h>
+#include <sys/stat.h>
+
+typedef struct OfflineChunk {
+  int index;
+  AVPacket **packets[MAX_QUALITY_LEVELS];
+  int counts[MAX_QUALITY_LEVELS];
+  int sizes[MAX_QUALITY_LEVELS];
+  int done;
+  int ret;
+} OfflineChunk;
+
+typedef struct OfflineJob {
+  TranscoderContext *ctx;
+  OfflineChunk *chunks;
+  int count;
+  int next;    // Next chunk to hand out
+  int written; // Chunks muxed so far
+  int window;  // Chunks handed out ahead of the muxer at most
+  int failed;
+  volatile int *keep_running;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} OfflineJob;
+
+// One rendition of the chunk a worker is on. Output frame n is due at n
+// preset frame durations after the first input frame.
+typedef struct ChunkRendition {
+  const QualityPreset *preset;
+  AVCodecContext *enc_ctx;
+  struct SwsContext *sws_ctx;
+  AVFrame *scaled; // Last frame encoded, again for every gap frame
+  AVFrame *held;   // Last input frame before the chunk
+  AVPacket *packet;
+  int64_t start;   // First output frame of the chunk
+  int64_t end;     // One past the last, INT64_MAX for the last chunk
+  int64_t next;    // Next output frame to encode
+} ChunkRendition;
+
+static void free_chunk_packets(OfflineChunk *chunk, int renditions) {
+  for (int r = 0; r < renditions; r++) {
+    for (int i = 0; i < chunk->counts[r]; i++)
+      av_packet_free(&chunk->packets[r][i]);
+    av_freep(&chunk->packets[r]);
+    chunk->counts[r] = chunk->sizes[r] = 0;
+  }
+}
+
+static int keep_packet(OfflineChunk *chunk, int r, AVPacket *packet) {
+  if (chunk->counts[r] == chunk->sizes[r]) {
+    int size = FFMAX(2 * chunk->sizes[r], 64);
+    AVPacket **packets =
+        av_realloc_array(chunk->packets[r], size, sizeof(*packets));
+    if (!packets)
+      return AVERROR(ENOMEM);
+    chunk->packets[r] = packets;
+    chunk->sizes[r] = size;
+  }
+
+  AVPacket *kept = av_packet_alloc();
+  if (!kept)
+    return AVERROR(ENOMEM);
+  av_packet_move_ref(kept, packet);
+  chunk->packets[r][chunk->counts[r]++] = kept;
+  return 0;
+}
+
+static int drain_encoder(ChunkRendition *rend, OfflineChunk *chunk, int r) {
+  int ret;
+  while ((ret = avcodec_receive_packet(rend->enc_ctx, rend->packet)) >= 0)
+    if ((ret = keep_packet(chunk, r, rend->packet)) < 0)
+      return ret;
+  return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int scale_into(ChunkRendition *rend, const AVFrame *frame) {
+  int ret = av_frame_make_writable(rend->scaled);
+  if (ret < 0)
+    return ret;
+
+  rend->sws_ctx = sws_getCachedContext(
+      rend->sws_ctx, frame->width, frame->height, frame->format,
+      rend->preset->width, rend->preset->height, AV_PIX_FMT_YUV420P,
+      SWS_BICUBIC, NULL, NULL, NULL);
+  if (!rend->sws_ctx)
+    return AVERROR(EINVAL);
+
+  sws_scale(rend->sws_ctx, (const uint8_t *const *)frame->data,
+            frame->linesize, 0, frame->height, rend->scaled->data,
+            rend->scaled->linesize);
+  return 0;
+}
+
+// Encodes the scaled frame as output frames up to, not including, until.
+// Segments start on an IDR so that the playlist can cut there.
+static int encode_until(ChunkRendition *rend, OfflineChunk *chunk, int r,
+                        int64_t until) {
+  int segment_frames = rend->preset->fps * SEGMENT_DURATION;
+  for (; rend->next < until; rend->next++) {
+    rend->scaled->pts = rend->next;
+    rend->scaled->pict_type = rend->next % segment_frames == 0
+                                  ? AV_PICTURE_TYPE_I
+                                  : AV_PICTURE_TYPE_NONE;
+    int ret = avcodec_send_frame(rend->enc_ctx, rend->scaled);
+    if (ret < 0 || (ret = drain_encoder(rend, chunk, r)) < 0)
+      return ret;
+  }
+  return 0;
+}
+
+// Encodes frame into the output frame closest to its timestamp, after
+// filling any gap before it. Returns 1 once the chunk's frames are done.
+static int encode_frame(ChunkRendition *rend, OfflineChunk *chunk, int r,
+                        const AVFrame *frame, int64_t slot) {
+  int ret;
+
+  // Before the chunk, or a second input frame for the same output frame
+  if (slot < rend->next) {
+    if (rend->next == rend->start) {
+      av_frame_unref(rend->held);
+      if ((ret = av_frame_ref(rend->held, frame)) < 0)
+        return ret;
+    }
+    return 0;
+  }
+
+  // A gap at the start is filled from the frame before the chunk, if the
+  // seek landed early enough to see one
+  if (rend->next == rend->start && rend->next < slot &&
+      (ret = scale_into(rend, rend->held->buf[0] ? rend->held : frame)) < 0)
+    return ret;
+  if ((ret = encode_until(rend, chunk, r, FFMIN(slot, rend->end))) < 0)
+    return ret;
+  if (slot >= rend->end)
+    return 1;
+
+  if ((ret = scale_into(rend, frame)) < 0)
+    return ret;
+  return encode_until(rend, chunk, r, slot + 1);
+}
+
+static void close_rendition(ChunkRendition *rend) {
+  avcodec_free_context(&rend->enc_ctx);
+  sws_freeContext(rend->sws_ctx);
+  av_frame_free(&rend->scaled);
+  av_frame_free(&rend->held);
+  av_packet_free(&rend->packet);
+}
+
+// The last chunk runs to the end of the file, whatever its header said.
+static int open_rendition(ChunkRendition *rend, const QualityPreset *preset,
+                          int index, int last) {
+  rend->preset = preset;
+  rend->start = rend->next =
+      (int64_t)index * OFFLINE_CHUNK_DURATION * preset->fps;
+  rend->end = last ? INT64_MAX
+                   : rend->start + OFFLINE_CHUNK_DURATION * preset->fps;
+
+  rend->scaled = av_frame_alloc();
+  rend->held = av_frame_alloc();
+  rend->packet = av_packet_alloc();
+  if (!rend->scaled || !rend->held || !rend->packet)
+    return AVERROR(ENOMEM);
+
+  rend->scaled->width = preset->width;
+  rend->scaled->height = preset->height;
+  rend->scaled->format = AV_PIX_FMT_YUV420P;
+  int ret = av_frame_get_buffer(rend->scaled, 0);
+  if (ret < 0)
+    return ret;
+
+  return encoder_open_offline(&rend->enc_ctx, preset);
+}
+
+static int open_decoder(AVFormatContext *input_ctx, int stream_index,
+                        AVCodecContext **dec_ctx) {
+  AVStream *stream = input_ctx->streams[stream_index];
+  const AVCodec *decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+  if (!decoder) {
+    fprintf(stderr, "Cannot find decoder\n");
+    return AVERROR_DECODER_NOT_FOUND;
+  }
+
+  *dec_ctx = avcodec_alloc_context3(decoder);
+  if (!*dec_ctx)
+    return AVERROR(ENOMEM);
+
+  int ret = avcodec_parameters_to_context(*dec_ctx, stream->codecpar);
+  if (ret < 0)
+    return ret;
+  (*dec_ctx)->pkt_timebase = stream->time_base;
+  (*dec_ctx)->thread_count = 1;
+  return avcodec_open2(*dec_ctx, decoder, NULL);
+}
+
+// Hands frame to every rendition still short of the chunk's end. Returns 1
+// once none is.
+static int encode_renditions(ChunkRendition *rends, int count,
+                             OfflineChunk *chunk, const AVFrame *frame,
+                             AVRational time_base, int64_t first_pts) {
+  int64_t pts = frame->best_effort_timestamp;
+  if (pts == AV_NOPTS_VALUE)
+    return 0;
+
+  int finished = 1;
+  for (int r = 0; r < count; r++) {
+    ChunkRendition *rend = &rends[r];
+    if (rend->next >= rend->end)
+      continue;
+
+    int64_t slot = av_rescale_q_rnd(
+        pts - first_pts, time_base, (AVRational){1, rend->preset->fps},
+        AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+    int ret = encode_frame(rend, chunk, r, frame, slot);
+    if (ret < 0)
+      return ret;
+    finished &= ret;
+  }
+  return finished;
+}
+
+// Decodes from a seek to just before the chunk until every rendition has
+// its frames, or the file ends.
+static int transcode_chunk(OfflineJob *job, OfflineChunk *chunk) {
+  TranscoderContext *ctx = job->ctx;
+  AVFormatContext *input_ctx = NULL;
+  AVCodecContext *dec_ctx = NULL;
+  AVPacket *packet = av_packet_alloc();
+  AVFrame *frame = av_frame_alloc();
+  ChunkRendition rends[MAX_QUALITY_LEVELS] = {0};
+  int finished = 0;
+  int ret;
+
+  if (!packet || !frame) {
+    ret = AVERROR(ENOMEM);
+    goto end;
+  }
+  // A full probe: duration and start time may only come from stream info
+  if ((ret = source_open_demuxer(&ctx->source, 0, &input_ctx)) < 0)
+    goto end;
+  int stream_index =
+      av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if ((ret = stream_index) < 0 ||
+      (ret = open_decoder(input_ctx, stream_index, &dec_ctx)) < 0)
+    goto end;
+  for (int r = 0; r < ctx->renditions; r++)
+    if ((ret = open_rendition(&rends[r], &ctx->presets[r], chunk->index,
+                              chunk->index == job->count - 1)) < 0)
+      goto end;
+
+  AVStream *stream = input_ctx->streams[stream_index];
+  int64_t first_pts = stream->start_time != AV_NOPTS_VALUE
+                          ? stream->start_time
+                          : 0;
+  if (chunk->index > 0) {
+    int64_t start = av_rescale_q(
+        (int64_t)chunk->index * OFFLINE_CHUNK_DURATION * AV_TIME_BASE,
+        AV_TIME_BASE_Q, stream->time_base);
+    ret = av_seek_frame(input_ctx, stream_index, first_pts + start,
+                        AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+      fprintf(stderr, "Cannot seek to chunk %d: %s\n", chunk->index,
+              av_err2str(ret));
+      goto end;
+    }
+  }
+
+  while (!finished && *job->keep_running) {
+    ret = av_read_frame(input_ctx, packet);
+    if (ret == AVERROR_EOF)
+      ret = avcodec_send_packet(dec_ctx, NULL);
+    else if (ret >= 0 && packet->stream_index == stream_index)
+      ret = avcodec_send_packet(dec_ctx, packet);
+    av_packet_unref(packet);
+    if (ret < 0)
+      goto end;
+
+    while (!finished &&
+           (ret = avcodec_receive_frame(dec_ctx, frame)) >= 0) {
+      finished = encode_renditions(rends, ctx->renditions, chunk, frame,
+                                   stream->time_base, first_pts);
+      av_frame_unref(frame);
+      if ((ret = finished) < 0)
+        goto end;
+    }
+    if (ret == AVERROR_EOF)
+      break;
+    if (ret < 0 && ret != AVERROR(EAGAIN))
+      goto end;
+  }
+
+  // The file ending inside the chunk leaves the rest of it empty
+  ret = 0;
+  for (int r = 0; r < ctx->renditions && ret >= 0; r++) {
+    if ((ret = avcodec_send_frame(rends[r].enc_ctx, NULL)) >= 0)
+      ret = drain_encoder(&rends[r], chunk, r);
+  }
+
+end:
+  for (int r = 0; r < ctx->renditions; r++)
+    close_rendition(&rends[r]);
+  avcodec_free_context(&dec_ctx);
+  avformat_close_input(&input_ctx);
+  av_frame_free(&frame);
+  av_packet_free(&packet);
+  if (ret < 0)
+    fprintf(stderr, "Chunk %d failed: %s\n", chunk->index, av_err2str(ret));
+  return ret;
+}
+
+static void *offline_worker_func(void *arg) {
+  OfflineJob *job = arg;
+
+  pthread_mutex_lock(&job->lock);
+  for (;;) {
+    // Stay within the window so finished chunks do not pile up in memory
+    while (!job->failed && job->next < job->count &&
+           job->next >= job->written + job->window)
+      pthread_cond_wait(&job->cond, &job->lock);
+    if (job->failed || job->next == job->count)
+      break;
+    OfflineChunk *chunk = &job->chunks[job->next++];
+    pthread_mutex_unlock(&job->lock);
+
+    int ret = transcode_chunk(job, chunk);
+
+    pthread_mutex_lock(&job->lock);
+    chunk->ret = ret;
+    chunk->done = 1;
+    pthread_cond_broadcast(&job->cond);
+  }
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+// Writes chunk's packets, which count from the start of the file already.
+static int write_chunk(TranscoderContext *ctx, OfflineChunk *chunk) {
+  for (int r = 0; r < ctx->renditions; r++) {
+    EncoderContext *enc = &ctx->encoders[r];
+    for (int i = 0; i < chunk->counts[r]; i++) {
+      AVPacket *packet = chunk->packets[r][i];
+      packet->stream_index = 0;
+      av_packet_rescale_ts(packet, enc->enc_ctx->time_base,
+                           enc->stream->time_base);
+      int ret = av_interleaved_write_frame(enc->fmt_ctx, packet);
+      if (ret < 0) {
+        fprintf(stderr, "Could not write %s packet: %s\n", enc->preset->name,
+                av_err2str(ret));
+        return ret;
+      }
+      atomic_fetch_add(&enc->bytes_out, packet->size);
+    }
+    atomic_fetch_add(&enc->encoded_frames, chunk->counts[r]);
+  }
+  return 0;
+}
+
+// Opens a VOD muxer per rendition. Their streams take their parameters,
+// extradata included, from an encoder configured like the chunks' own.
+static int open_outputs(TranscoderContext *ctx) {
+  mkdir(ctx->output_dir, 0755);
+  for (int r = 0; r < ctx->renditions; r++) {
+    EncoderContext *enc = &ctx->encoders[r];
+    int ret = encoder_open_offline(&enc->enc_ctx, &ctx->presets[r]);
+    if (ret < 0 ||
+        (ret = init_vod_output(enc, &ctx->presets[r], ctx->output_dir)) < 0)
+      return ret;
+  }
+
+  // Processes that split the ladder between them each write the whole
+  // ladder's master playlist
+  if (ctx->renditions < MAX_QUALITY_LEVELS)
+    write_master_playlist(ctx->output_dir, QUALITY_PRESETS,
+                          MAX_QUALITY_LEVELS, 0);
+  else
+    write_master_playlist(ctx->output_dir, ctx->presets, ctx->renditions, 0);
+  return 0;
+}
+
+static void close_outputs(TranscoderContext *ctx) {
+  for (int r = 0; r < ctx->renditions; r++) {
+    EncoderContext *enc = &ctx->encoders[r];
+    if (enc->fmt_ctx) {
+      if (enc->fmt_ctx->pb) {
+        av_write_trailer(enc->fmt_ctx);
+        avio_closep(&enc->fmt_ctx->pb);
+      }
+      avformat_free_context(enc->fmt_ctx);
+      enc->fmt_ctx = NULL;
+    }
+    avcodec_free_context(&enc->enc_ctx);
+  }
+}
+
+// Reads the file's duration, as probing finds it, to size the chunk list.
+// Without one the whole file is a single chunk.
+static int count_chunks(TranscoderContext *ctx, double *duration) {
+  AVFormatContext *input_ctx = NULL;
+  int ret = source_open_demuxer(&ctx->source, 0, &input_ctx);
+  if (ret < 0)
+    return ret;
+
+  *duration = input_ctx->duration > 0
+                  ? input_ctx->duration / (double)AV_TIME_BASE
+                  : 0;
+  avformat_close_input(&input_ctx);
+  return *duration > 0 ? (int)ceil(*duration / OFFLINE_CHUNK_DURATION) : 1;
+}
+
+int offline_transcode(TranscoderContext *ctx, volatile int *keep_running) {
+  pthread_t workers[MAX_CORES];
+  OfflineJob job = {.ctx = ctx, .keep_running = keep_running};
+  double duration;
+  int64_t start = 0, frames = 0;
+  int jobs, started = 0;
+  int ret;
+
+  if (!ctx->renditions) {
+    fprintf(stderr, "Offline mode needs at least one rendition\n");
+    return AVERROR(EINVAL);
+  }
+  if ((ret = job.count = count_chunks(ctx, &duration)) < 0)
+    return ret;
+  job.chunks = av_calloc(job.count, sizeof(*job.chunks));
+  if (!job.chunks)
+    return AVERROR(ENOMEM);
+  for (int i = 0; i < job.count; i++)
+    job.chunks[i].index = i;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  if ((ret = open_outputs(ctx)) < 0)
+    goto end;
+
+  jobs = FFMIN3(cores_available(), job.count, MAX_CORES);
+  job.window = jobs * OFFLINE_CHUNKS_PER_WORKER;
+  printf("Transcoding %.1f s in %d chunks of %d s on %d workers\n", duration,
+         job.count, OFFLINE_CHUNK_DURATION, jobs);
+
+  start = av_gettime_relative();
+  for (; started < jobs; started++) {
+    if (pthread_create(&workers[started], NULL, offline_worker_func, &job)) {
+      fprintf(stderr, "Could not start offline worker\n");
+      ret = AVERROR(EAGAIN);
+      goto end;
+    }
+  }
+
+  // Chunks are written in order as they finish; later ones wait their turn
+  for (int i = 0; i < job.count && ret >= 0; i++) {
+    OfflineChunk *chunk = &job.chunks[i];
+    pthread_mutex_lock(&job.lock);
+    while (!chunk->done)
+      pthread_cond_wait(&job.cond, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+
+    if ((ret = chunk->ret) >= 0 && !*keep_running)
+      ret = AVERROR_EXIT;
+    if (ret >= 0)
+      ret = write_chunk(ctx, chunk);
+    frames += chunk->counts[0];
+    free_chunk_packets(chunk, ctx->renditions);
+
+    pthread_mutex_lock(&job.lock);
+    job.written++;
+    job.failed = ret < 0;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+
+    double elapsed = (av_gettime_relative() - start) / 1e6;
+    double seconds = frames / (double)ctx->presets[0].fps;
+    printf("\rChunk %d/%d: %.1f s of video, %.1fx real time", i + 1,
+           job.count, seconds, seconds / FFMAX(elapsed, 1e-3));
+    fflush(stdout);
+  }
+  printf("\n");
+
+end:
+  pthread_mutex_lock(&job.lock);
+  job.failed = 1;
+  pthread_cond_broadcast(&job.cond);
+  pthread_mutex_unlock(&job.lock);
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  if (ret >= 0) {
+    double elapsed = (av_gettime_relative() - start) / 1e6;
+    double seconds = frames / (double)ctx->presets[0].fps;
+    printf("Transcoded %.1f s of video in %.1f s, %.1fx real time\n",
+           seconds, elapsed, seconds / FFMAX(elapsed, 1e-3));
+  }
+
+  close_outputs(ctx);
+  for (int i = 0; i < job.count; i++)
+    free_chunk_packets(&job.chunks[i], ctx->renditions);
+  av_free(job.chunks);
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.lock);
+  return ret;
+}
@@ -0,0 +1,306 @@
+// options.c
+#include "../include/options.h"
+#include "../include/channel.h"
+#include "../include/cores.h"
+#include "../include/decoder.h"
+#include "../include/encoder.h"
+#include "../include/pool.h"
+#include "../include/presets.h"
+#include "../include/source.h"
+#include <getopt.h>
+
+void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] <output_dir>\n"
+          "       %s [options] -c <channels_file>\n"
+          "\n"
+          "Input:\n"
+          "  -s, --source TYPE        v4l2 (default), file, lavfi, pipe, raw, "
+          "bus\n"
+          "  -i, --input URL          Device, file, filter graph or - for "
+          "stdin\n"
+          "  -f, --format NAME        Force the demuxer (e.g. mjpeg for a "
+          "pipe)\n"
+          "      --video-size WxH     Capture or raw frame size\n"
+          "      --framerate FPS      Capture, test pattern or raw frame "
+          "rate\n"
+          "      --pixel-format FMT   V4L2 input format (default: auto, raw "
+          "if\n"
+          "                           the bus allows) or raw pixel format\n"
+          "  -r, --realtime           Pace non-live inputs at their native "
+          "rate\n"
+          "      --audio SOURCE       input (the input's audio track, "
+          "encoded by\n"
+          "                           default if there is one), none, or a "
+          "capture\n"
+          "                           device as alsa:hw:1 or pulse:default\n"
+          "\n"
+          "Output:\n"
+          "      --origin ADDR        Serve LL-HLS from memory on host:port "
+          "or\n"
+          "                           unix:/path instead of writing "
+          "segments\n"
+          "      --latency-stamps     Embed capture times (SEI) and prft "
+          "boxes\n"
+          "      --offline            Transcode a whole file (-s file) in "
+          "parallel\n"
+          "                           chunks to a VOD playlist\n"
+          "      --renditions LIST    Presets to encode, e.g. 720p,480p, or "
+          "none\n"
+          "                           (default: the whole ladder)\n"
+          "\n"
+          "Frame bus:\n"
+          "      --bus NAME           Publish decoded frames in shared "
+          "memory for\n"
+          "                           other processes (-s bus -i NAME)\n"
+          "      --bus-size WxH       Pre-scale published frames to WxH "
+          "yuv420p\n"
+          "\n"
+          "Performance:\n"
+          "      --huge-pages         Back frame pools with 2 MB pages\n"
+          "      --cores N            Core budget shared by capture and "
+          "encoders\n"
+          "                           (default: every allowed CPU)\n"
+          "      --pin                Pin input, pool and encoder threads "
+          "to their\n"
+          "                           cores\n"
+          "      --no-fast-start      Probe the input fully and open "
+          "encoders one\n"
+          "                           after another\n"
+          "      --decode-threading MODE\n"
+          "                           auto (default), none, slice or "
+          "frame\n"
+          "      --decode-threads N   Decoder threads (default: one per "
+          "core)\n"
+          "      --decode-max-delay N Frames frame threading may hold back "
+          "(2)\n"
+          "\n"
+          "Metrics:\n"
+          "      --metrics-listen ADDR\n"
+          "                           Serve Prometheus metrics on host:port "
+          "or\n"
+          "                           unix:/path\n"
+          "      --metrics-file PATH  Rewrite Prometheus metrics to PATH "
+          "every\n"
+          "                           second\n"
+          "\n"
+          "Channels:\n"
+          "  -c, --channels FILE      Run one channel per line of FILE; "
+          "each line\n"
+          "                           holds the options and output_dir "
+          "above,\n"
+          "                           except the Performance options and\n"
+          "                           --latency-stamps, which stay on the "
+          "command\n"
+          "                           line\n"
+          "\n"
+          "  -h, --help               Show this help\n",
+          prog, prog);
+}
+
+// Also parses channel file lines, which pass channels_file as NULL since a
+// channel cannot name further channels.
+int parse_options(int argc, char *argv[], TranscoderContext *ctx,
+                  const char **channels_file) {
+  enum {
+    OPT_VIDEO_SIZE = 256,
+    OPT_FRAMERATE,
+    OPT_PIXEL_FORMAT,
+    OPT_METRICS_LISTEN,
+    OPT_METRICS_FILE,
+    OPT_ORIGIN,
+    OPT_HUGE_PAGES,
+    OPT_CORES,
+    OPT_PIN,
+    OPT_NO_FAST_START,
+    OPT_LATENCY_STAMPS,
+    OPT_DECODE_THREADING,
+    OPT_DECODE_THREADS,
+    OPT_DECODE_MAX_DELAY,
+    OPT_RENDITIONS,
+    OPT_BUS,
+    OPT_BUS_SIZE,
+    OPT_OFFLINE,
+    OPT_AUDIO,
+  };
+  static const struct option long_options[] = {
+      {"source", required_argument, NULL, 's'},
+      {"input", required_argument, NULL, 'i'},
+      {"format", required_argument, NULL, 'f'},
+      {"video-size", required_argument, NULL, OPT_VIDEO_SIZE},
+      {"framerate", required_argument, NULL, OPT_FRAMERATE},
+      {"pixel-format", required_argument, NULL, OPT_PIXEL_FORMAT},
+      {"realtime", no_argument, NULL, 'r'},
+      {"metrics-listen", required_argument, NULL, OPT_METRICS_LISTEN},
+      {"metrics-file", required_argument, NULL, OPT_METRICS_FILE},
+      {"origin", required_argument, NULL, OPT_ORIGIN},
+      {"huge-pages", no_argument, NULL, OPT_HUGE_PAGES},
+      {"cores", required_argument, NULL, OPT_CORES},
+      {"pin", no_argument, NULL, OPT_PIN},
+      {"no-fast-start", no_argument, NULL, OPT_NO_FAST_START},
+      {"latency-stamps", no_argument, NULL, OPT_LATENCY_STAMPS},
+      {"decode-threading", required_argument, NULL, OPT_DECODE_THREADING},
+      {"decode-threads", required_argument, NULL, OPT_DECODE_THREADS},
+      {"decode-max-delay", required_argument, NULL, OPT_DECODE_MAX_DELAY},
+      {"renditions", required_argument, NULL, OPT_RENDITIONS},
+      {"bus", required_argument, NULL, OPT_BUS},
+      {"bus-size", required_argument, NULL, OPT_BUS_SIZE},
+      {"offline", no_argument, NULL, OPT_OFFLINE},
+      {"audio", required_argument, NULL, OPT_AUDIO},
+      {"channels", required_argument, NULL, 'c'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  SourceConfig *source = &ctx->source;
+  const char *renditions = NULL;
+  char channel_option[32] = "";
+  int opt, index;
+
+  optind = 0; // Start over for every channel
+  while ((index = -1, opt = getopt_long(argc, argv, "s:i:f:c:rh",
+                                        long_options, &index)) != -1) {
+    // Pool, core and x264 settings are the process's; a channels file
+    // holds only what differs between channels
+    int global = opt == OPT_HUGE_PAGES || opt == OPT_CORES ||
+                 opt == OPT_PIN || opt == OPT_NO_FAST_START ||
+                 opt == OPT_LATENCY_STAMPS;
+    if (global && !channels_file) {
+      fprintf(stderr, "--%s applies to every channel and goes on the "
+                      "command line\n",
+              long_options[index].name);
+      return AVERROR(EINVAL);
+    }
+    if (!global && opt != 'c' && opt != 'h' && opt != '?' &&
+        !channel_option[0]) {
+      if (index >= 0)
+        snprintf(channel_option, sizeof(channel_option), "--%s",
+                 long_options[index].name);
+      else
+        snprintf(channel_option, sizeof(channel_option), "-%c", opt);
+    }
+
+    switch (opt) {
+    case 's':
+      if (parse_source_type(optarg, &source->type) < 0) {
+        fprintf(stderr, "Unknown source type: %s\n", optarg);
+        return AVERROR(EINVAL);
+      }
+      break;
+    case 'i':
+      source->url = optarg;
+      break;
+    case 'f':
+      source->format = optarg;
+      break;
+    case OPT_VIDEO_SIZE:
+      source->video_size = optarg;
+      break;
+    case OPT_FRAMERATE:
+      source->framerate = optarg;
+      break;
+    case OPT_PIXEL_FORMAT:
+      source->pixel_format = optarg;
+      break;
+    case 'r':
+      source->realtime = 1;
+      break;
+    case OPT_METRICS_LISTEN:
+      ctx->metrics.listen = optarg;
+      break;
+    case OPT_METRICS_FILE:
+      ctx->metrics.file = optarg;
+      break;
+    case OPT_ORIGIN:
+      ctx->origin.listen = optarg;
+      break;
+    case OPT_HUGE_PAGES:
+      pool_set_huge_pages(1);
+      break;
+    case OPT_CORES:
+      if (atoi(optarg) <= 0) {
+        fprintf(stderr, "Invalid core count: %s\n", optarg);
+        return AVERROR(EINVAL);
+      }
+      cores_set_budget(atoi(optarg));
+      break;
+    case OPT_PIN:
+      cores_set_pinning(1);
+      break;
+    case OPT_NO_FAST_START:
+      channel_set_fast_start(0);
+      break;
+    case OPT_LATENCY_STAMPS:
+      encoder_set_latency_stamps(1);
+      break;
+    case OPT_DECODE_THREADING:
+      if (parse_decode_threading(optarg, &ctx->decode.threading) < 0) {
+        fprintf(stderr, "Unknown decode threading: %s\n", optarg);
+        return AVERROR(EINVAL);
+      }
+      break;
+    case OPT_DECODE_THREADS:
+      if ((ctx->decode.threads = atoi(optarg)) <= 0) {
+        fprintf(stderr, "Invalid decoder thread count: %s\n", optarg);
+        return AVERROR(EINVAL);
+      }
+      break;
+    case OPT_DECODE_MAX_DELAY:
+      if ((ctx->decode.max_delay = atoi(optarg)) <= 0) {
+        fprintf(stderr, "Invalid decode delay: %s\n", optarg);
+        return AVERROR(EINVAL);
+      }
+      break;
+    case OPT_RENDITIONS:
+      renditions = optarg;
+      break;
+    case OPT_BUS:
+      ctx->bus.name = optarg;
+      break;
+    case OPT_BUS_SIZE:
+      ctx->bus.size = optarg;
+      break;
+    case OPT_OFFLINE:
+      ctx->offline = 1;
+      break;
+    case OPT_AUDIO:
+      ctx->audio.source = optarg;
+      break;
+    case 'c':
+      if (!channels_file)
+        return AVERROR(EINVAL);
+      *channels_file = optarg;
+      break;
+    default:
+      return AVERROR(EINVAL);
+    }
+  }
+
+  if (channels_file && *channels_file && channel_option[0]) {
+    fprintf(stderr, "With -c, %s goes on a line of the channels file\n",
+            channel_option);
+    return AVERROR(EINVAL);
+  }
+
+  if (select_renditions(ctx, renditions) < 0)
+    return AVERROR(EINVAL);
+  if (ctx->bus.name && source->type == SOURCE_BUS) {
+    fprintf(stderr, "A bus input cannot be published again\n");
+    return AVERROR(EINVAL);
+  }
+
+  if (ctx->offline && (source->type != SOURCE_FILE || ctx->origin.listen ||
+                       ctx->bus.name || (channels_file && *channels_file) ||
+                       !channels_file)) {
+    fprintf(stderr, "Offline mode takes a single file input and writes "
+                    "segments\n");
+    return AVERROR(EINVAL);
+  }
+
+  if (channels_file && *channels_file)
+    return optind == argc ? 0 : AVERROR(EINVAL);
+  if (optind != argc - 1)
+    return AVERROR(EINVAL);
+
+  ctx->output_dir = argv[optind];
+  return 0;
+}
@@ -0,0 +1,530 @@
+// origin.c
+// In-memory LL-HLS origin. Each rendition is cut into fMP4 parts on its
+// writer thread; recent segments stay in a RAM ring and are served over HTTP
+// with blocking playlist reload, preload hints and delta updates.
+#include "../include/origin.h"
+#include "../include/http.h"
+#include "../include/utils.h"
+#include <errno.h>
+#include <libavutil/time.h>
+#include <time.h>
+
+#define PLAYLIST_TYPE "application/vnd.apple.mpegurl"
+#define NO_CACHE "Cache-Control: no-cache\r\n"
+#define CACHE_MEDIA "Cache-Control: max-age=60\r\n"
+
+static struct timespec deadline_after(double seconds) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t ns = ts.tv_nsec + (int64_t)(seconds * 1e9);
+  ts.tv_sec += ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  return ts;
+}
+
+static OriginSegment *segment_at(OriginStream *s, int64_t msn) {
+  return &s->segments[msn % ORIGIN_SEGMENTS];
+}
+
+// Oldest segment still held in RAM.
+static int64_t first_msn(const OriginStream *s) {
+  return FFMAX(0, s->next_msn - ORIGIN_SEGMENTS + 1);
+}
+
+// Hands over everything the muxer wrote since the last call and gives it a
+// fresh buffer.
+static int take_output(OriginStream *s, AVBufferRef **out) {
+  uint8_t *data;
+  int size = avio_close_dyn_buf(s->mux->pb, &data);
+  s->mux->pb = NULL;
+
+  int ret = avio_open_dyn_buf(&s->mux->pb);
+  if (ret >= 0) {
+    *out = av_buffer_create(data, size, av_buffer_default_free, NULL, 0);
+    if (*out)
+      return 0;
+    ret = AVERROR(ENOMEM);
+  }
+  av_free(data);
+  return ret;
+}
+
+static void clear_segment(OriginSegment *seg) {
+  for (int i = 0; i < seg->part_count; i++)
+    av_buffer_unref(&seg->parts[i].data);
+  seg->part_count = 0;
+  seg->duration = 0;
+  seg->complete = 0;
+}
+
+// With prft, every fragment carries a producer reference time box mapping
+// its first sample to the wall clock.
+int origin_open_stream(OriginStream *s, const char *name,
+                       const AVCodecContext *enc_ctx, int prft) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&s->updated, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&s->lock, NULL);
+  s->name = name;
+  s->next_msn = -1;
+  for (int i = 0; i < ORIGIN_SEGMENTS; i++)
+    s->segments[i].msn = -1;
+
+  int ret = avformat_alloc_output_context2(&s->mux, NULL, "mp4", NULL);
+  if (ret < 0) {
+    fprintf(stderr, "Could not create %s fragmenter\n", name);
+    return ret;
+  }
+
+  AVStream *stream = avformat_new_stream(s->mux, NULL);
+  if (!stream)
+    return AVERROR(ENOMEM);
+  ret = avcodec_parameters_from_context(stream->codecpar, enc_ctx);
+  if (ret < 0)
+    return ret;
+  stream->time_base = enc_ctx->time_base;
+
+  if ((ret = avio_open_dyn_buf(&s->mux->pb)) < 0)
+    return ret;
+
+  // Fragments are flushed by hand at part boundaries; with empty_moov the
+  // header alone is a complete init segment
+  AVDictionary *opts = NULL;
+  av_dict_set(&opts, "movflags", "frag_custom+empty_moov+default_base_moof",
+              0);
+  if (prft)
+    av_dict_set(&opts, "write_prft", "wallclock", 0);
+  ret = avformat_write_header(s->mux, &opts);
+  av_dict_free(&opts);
+  if (ret < 0) {
+    fprintf(stderr, "Could not write %s init segment: %s\n", name,
+            av_err2str(ret));
+    return ret;
+  }
+  if ((ret = take_output(s, &s->init)) < 0)
+    return ret;
+
+  double tb = av_q2d(stream->time_base);
+  s->part_target = (int64_t)(PART_DURATION / tb + 0.5);
+  s->segment_target = (int64_t)(SEGMENT_DURATION / tb + 0.5);
+
+  // Segments only start on keyframes, so none is shorter than a GOP unless
+  // keyframes are forced on every segment boundary. Every audio frame is
+  // a keyframe.
+  AVRational fps = enc_ctx->framerate;
+  int gop_seconds =
+      fps.num ? (enc_ctx->gop_size * fps.den + fps.num - 1) / fps.num : 0;
+  s->target_duration =
+      KEYFRAME_ALIGN ? SEGMENT_DURATION : FFMAX(SEGMENT_DURATION, gop_seconds);
+  return 0;
+}
+
+// Publishes the open part, if any, and wakes up waiting clients.
+// end_segment completes the current segment; start_segment opens the next,
+// whose first frame was captured at captured (wall clock, microseconds).
+static int publish_part(OriginStream *s, int64_t end_pts, int end_segment,
+                        int start_segment, int64_t captured) {
+  AVBufferRef *data = NULL;
+  if (s->part_packets) {
+    av_write_frame(s->mux, NULL); // Flush the fragment
+    int ret = take_output(s, &data);
+    if (ret < 0)
+      return ret;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  if (data) {
+    OriginSegment *seg = segment_at(s, s->next_msn);
+    OriginPart *part = &seg->parts[seg->part_count++];
+    part->data = data;
+    part->duration =
+        (end_pts - s->part_start) * av_q2d(s->mux->streams[0]->time_base);
+    part->independent = s->part_keyframe;
+    seg->duration += part->duration;
+    s->parts_published++;
+  }
+  if (end_segment && s->next_msn >= 0)
+    segment_at(s, s->next_msn)->complete = 1;
+  if (start_segment) {
+    OriginSegment *seg = segment_at(s, ++s->next_msn);
+    clear_segment(seg); // Evicts the oldest segment
+    seg->msn = s->next_msn;
+    // The date of the media is when it was captured, not when it was muxed
+    seg->program_date_time = captured ? captured : av_gettime();
+  }
+  pthread_cond_broadcast(&s->updated);
+  pthread_mutex_unlock(&s->lock);
+
+  s->part_packets = 0;
+  return 0;
+}
+
+// Called on the writer thread only. A part is cut every PART_DURATION and a
+// segment at the first keyframe after SEGMENT_DURATION. Aligned keyframes
+// may land a frame early or late, so boundaries allow half a part of slack,
+// and with keyframes on part boundaries, parts are cut on them.
+int origin_write_packet(OriginStream *s, AVPacket *packet) {
+  int keyframe = packet->flags & AV_PKT_FLAG_KEY;
+  int64_t pts = packet->pts;
+  int64_t captured = (intptr_t)packet->opaque;
+  int64_t slack = KEYFRAME_ALIGN ? s->part_target / 2 : 0;
+  int part_due = KEYFRAME_PARTS ? keyframe && pts - s->part_start >= slack
+                                : pts - s->part_start >= s->part_target;
+  int ret = 0;
+
+  if (s->next_msn < 0 ||
+      (keyframe && pts - s->segment_start >= s->segment_target - slack)) {
+    ret = publish_part(s, pts, 1, 1, captured);
+    s->segment_start = pts;
+  } else if (s->part_packets && part_due &&
+             segment_at(s, s->next_msn)->part_count <
+                 ORIGIN_MAX_SEGMENT_PARTS - 1) {
+    ret = publish_part(s, pts, 0, 0, 0);
+  }
+  if (ret < 0)
+    return ret;
+
+  if (!s->part_packets) {
+    s->part_start = pts;
+    s->part_keyframe = keyframe;
+  }
+  s->last_end = pts + packet->duration;
+
+  ret = av_write_frame(s->mux, packet);
+  if (ret < 0)
+    return ret;
+  s->part_packets++;
+  return 0;
+}
+
+static void print_program_date_time(AVBPrint *bp, int64_t us) {
+  time_t sec = us / 1000000;
+  struct tm tm;
+  gmtime_r(&sec, &tm);
+  av_bprintf(bp,
+             "#EXT-X-PROGRAM-DATE-TIME:%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\n",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+             tm.tm_min, tm.tm_sec, (int)(us % 1000000 / 1000));
+}
+
+// Call with the lock held. A delta update (_HLS_skip=YES) replaces complete
+// segments older than the skip boundary with EXT-X-SKIP.
+static void print_media_playlist(OriginStream *s, AVBPrint *bp, int delta) {
+  int td = s->target_duration;
+  double skip_until = 6.0 * td;
+  int64_t first = first_msn(s);
+
+  double total = 0;
+  for (int64_t msn = first; msn <= s->next_msn; msn++)
+    total += segment_at(s, msn)->duration;
+
+  av_bprintf(bp, "#EXTM3U\n");
+  av_bprintf(bp, "#EXT-X-VERSION:9\n");
+  av_bprintf(bp, "#EXT-X-TARGETDURATION:%d\n", td);
+  av_bprintf(bp,
+             "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,"
+             "CAN-SKIP-UNTIL=%.1f,PART-HOLD-BACK=%.3f\n",
+             skip_until, 3 * PART_DURATION);
+  av_bprintf(bp, "#EXT-X-PART-INF:PART-TARGET=%.3f\n", PART_DURATION);
+  av_bprintf(bp, "#EXT-X-MEDIA-SEQUENCE:%" PRId64 "\n", first);
+  av_bprintf(bp, "#EXT-X-MAP:URI=\"init.mp4\"\n");
+
+  double elapsed = 0;
+  int64_t skipped = 0;
+  for (int64_t msn = first; msn <= s->next_msn; msn++) {
+    OriginSegment *seg = segment_at(s, msn);
+    elapsed += seg->duration;
+    double from_end = total - elapsed; // Distance of the segment end
+
+    if (delta && seg->complete && from_end >= skip_until) {
+      skipped++;
+      continue;
+    }
+    if (skipped) {
+      av_bprintf(bp, "#EXT-X-SKIP:SKIPPED-SEGMENTS=%" PRId64 "\n", skipped);
+      skipped = 0;
+    }
+
+    print_program_date_time(bp, seg->program_date_time);
+
+    // Parts are only listed near the live edge
+    if (from_end < 3.0 * td) {
+      for (int i = 0; i < seg->part_count; i++) {
+        av_bprintf(bp,
+                   "#EXT-X-PART:DURATION=%.5f,URI=\"part_%" PRId64
+                   ".%d.m4s\"%s\n",
+                   seg->parts[i].duration, msn, i,
+                   seg->parts[i].independent ? ",INDEPENDENT=YES" : "");
+      }
+    }
+    if (seg->complete)
+      av_bprintf(bp, "#EXTINF:%.5f,\nsegment_%" PRId64 ".m4s\n",
+                 seg->duration, msn);
+  }
+
+  if (s->closed) {
+    av_bprintf(bp, "#EXT-X-ENDLIST\n");
+  } else if (s->next_msn >= 0) {
+    av_bprintf(bp,
+               "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part_%" PRId64
+               ".%d.m4s\"\n",
+               s->next_msn, segment_at(s, s->next_msn)->part_count);
+  }
+}
+
+// Whether the playlist holds segment msn, or part `part` of it if part >= 0.
+static int playlist_ready(OriginStream *s, int64_t msn, int64_t part) {
+  if (s->next_msn < 0 || msn > s->next_msn)
+    return 0;
+  if (msn < s->next_msn)
+    return 1;
+
+  OriginSegment *seg = segment_at(s, msn);
+  return part < 0 ? seg->complete : part < seg->part_count;
+}
+
+// 1 if part `index` of segment msn (the whole segment if index < 0) can be
+// served, 0 if it may still appear, -1 if it never will.
+static int media_state(OriginStream *s, int64_t msn, int index) {
+  if (s->next_msn >= 0 && msn < first_msn(s))
+    return -1;
+  if (msn > s->next_msn)
+    return msn == s->next_msn + 1 ? 0 : -1;
+
+  OriginSegment *seg = segment_at(s, msn);
+  if (index < 0 ? seg->complete : index < seg->part_count)
+    return 1;
+  return seg->complete ? -1 : 0;
+}
+
+static int serve_playlist(OriginStream *s, const HttpRequest *req, int fd) {
+  int64_t msn = 0, part = -1;
+  int blocking = http_query_int(req, "_HLS_msn", &msn);
+  if (http_query_int(req, "_HLS_part", &part) && !blocking)
+    return http_send_error(fd, req, 400);
+  if (!blocking)
+    part = 0; // Plain requests only wait for the stream to start
+  int delta = http_query_has(req, "_HLS_skip", "YES");
+
+  pthread_mutex_lock(&s->lock);
+  if (msn > s->next_msn + 2) {
+    pthread_mutex_unlock(&s->lock);
+    return http_send_error(fd, req, 400);
+  }
+
+  // Blocking reload: hold the request until the asked-for part exists
+  struct timespec deadline = deadline_after(3.0 * s->target_duration);
+  while (!playlist_ready(s, msn, part) && !s->closed) {
+    if (pthread_cond_timedwait(&s->updated, &s->lock, &deadline) ==
+        ETIMEDOUT)
+      break;
+  }
+  if (!playlist_ready(s, msn, part) && !s->closed) {
+    pthread_mutex_unlock(&s->lock);
+    return http_send_error(fd, req, 503);
+  }
+
+  AVBPrint bp;
+  av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+  print_media_playlist(s, &bp, delta);
+  pthread_mutex_unlock(&s->lock);
+
+  int ret = http_send_response(fd, req, 200, PLAYLIST_TYPE, NO_CACHE, bp.str,
+                               bp.len);
+  av_bprint_finalize(&bp, NULL);
+  return ret;
+}
+
+// Serves a part, or a whole segment if index < 0. A request for a part that
+// is still being produced (the preload hint) is answered as soon as the part
+// is complete.
+static int serve_media(OriginStream *s, const HttpRequest *req, int fd,
+                       int64_t msn, int index) {
+  AVBufferRef *refs[ORIGIN_MAX_SEGMENT_PARTS];
+  int count = 0;
+  size_t size = 0;
+
+  pthread_mutex_lock(&s->lock);
+  struct timespec deadline = deadline_after(3.0 * s->target_duration);
+  int state;
+  while (!(state = media_state(s, msn, index)) && !s->closed) {
+    if (pthread_cond_timedwait(&s->updated, &s->lock, &deadline) ==
+        ETIMEDOUT)
+      break;
+  }
+  state = media_state(s, msn, index);
+  if (state <= 0) {
+    int status = state < 0 || s->closed ? 404 : 503;
+    pthread_mutex_unlock(&s->lock);
+    return http_send_error(fd, req, status);
+  }
+
+  // Take references so the data outlives eviction while it is being sent
+  OriginSegment *seg = segment_at(s, msn);
+  int from = index < 0 ? 0 : index;
+  int to = index < 0 ? seg->part_count : index + 1;
+  for (int i = from; i < to; i++) {
+    refs[count] = av_buffer_ref(seg->parts[i].data);
+    if (refs[count])
+      size += refs[count++]->size;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  int ret = http_send_head(fd, req, 200, "video/mp4", CACHE_MEDIA, size);
+  for (int i = 0; i < count; i++) {
+    if (ret >= 0)
+      ret = http_send_data(fd, refs[i]->data, refs[i]->size);
+    av_buffer_unref(&refs[i]);
+  }
+  return ret;
+}
+
+static int serve_init(OriginStream *s, const HttpRequest *req, int fd) {
+  return http_send_response(fd, req, 200, "video/mp4", CACHE_MEDIA,
+                            s->init->data, s->init->size);
+}
+
+// The viewer page is the only file served from disk.
+static int serve_index(Origin *o, const HttpRequest *req, int fd) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/index.html", o->output_dir);
+
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return http_send_error(fd, req, 404);
+
+  AVBPrint bp;
+  av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    av_bprint_append_data(&bp, buf, n);
+  fclose(f);
+
+  int ret = http_send_response(fd, req, 200, "text/html", NO_CACHE, bp.str,
+                               bp.len);
+  av_bprint_finalize(&bp, NULL);
+  return ret;
+}
+
+static int origin_handler(void *opaque, const HttpRequest *req, int fd) {
+  Origin *o = opaque;
+
+  if (!strcmp(req->path, "/") || !strcmp(req->path, "/index.html"))
+    return serve_index(o, req, fd);
+
+  if (!strcmp(req->path, "/master.m3u8")) {
+    AVBPrint bp;
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    print_master_playlist(&bp, o->presets, o->renditions,
+                          o->audio.mux != NULL);
+    int ret = http_send_response(fd, req, 200, PLAYLIST_TYPE, NO_CACHE,
+                                 bp.str, bp.len);
+    av_bprint_finalize(&bp, NULL);
+    return ret;
+  }
+
+  // /<rendition>/<file>, the audio being the rendition after the last
+  const char *name = req->path + 1;
+  const char *file = strchr(name, '/');
+  OriginStream *s = NULL;
+  for (int i = 0; file && i <= o->renditions; i++) {
+    OriginStream *candidate = i < o->renditions ? &o->streams[i] : &o->audio;
+    if (candidate->mux && !strncmp(candidate->name, name, file - name) &&
+        !candidate->name[file - name])
+      s = candidate;
+  }
+  if (!s)
+    return http_send_error(fd, req, 404);
+  file++;
+
+  int64_t msn;
+  int index, n = 0;
+  if (!strcmp(file, "stream.m3u8"))
+    return serve_playlist(s, req, fd);
+  if (!strcmp(file, "init.mp4"))
+    return serve_init(s, req, fd);
+  if (sscanf(file, "segment_%" SCNd64 ".m4s%n", &msn, &n) == 1 && n &&
+      !file[n])
+    return serve_media(s, req, fd, msn, -1);
+  n = 0;
+  if (sscanf(file, "part_%" SCNd64 ".%d.m4s%n", &msn, &index, &n) == 2 &&
+      n && !file[n] && index >= 0)
+    return serve_media(s, req, fd, msn, index);
+
+  return http_send_error(fd, req, 404);
+}
+
+int origin_start(TranscoderContext *ctx) {
+  Origin *o = &ctx->origin;
+  if (!o->listen)
+    return 0;
+
+  o->output_dir = ctx->output_dir;
+  o->presets = ctx->presets;
+  o->renditions = ctx->renditions;
+  int ret = http_server_start(&o->server, o->listen, origin_handler, o);
+  if (ret < 0)
+    return ret;
+
+  printf("Serving LL-HLS from memory on %s\n", o->listen);
+  return 0;
+}
+
+// Publishes the last part of s and releases the clients waiting on it.
+static void close_stream(OriginStream *s) {
+  if (!s->name)
+    return;
+  if (s->mux && s->next_msn >= 0)
+    publish_part(s, s->last_end, 1, 0, 0);
+
+  pthread_mutex_lock(&s->lock);
+  s->closed = 1;
+  pthread_cond_broadcast(&s->updated);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Frees s once no client can reach it any more.
+static void free_stream(OriginStream *s) {
+  if (!s->name)
+    return;
+  if (s->mux) {
+    if (s->mux->pb) {
+      uint8_t *data;
+      avio_close_dyn_buf(s->mux->pb, &data);
+      av_free(data);
+    }
+    avformat_free_context(s->mux);
+    s->mux = NULL;
+  }
+  for (int j = 0; j < ORIGIN_SEGMENTS; j++)
+    clear_segment(&s->segments[j]);
+  av_buffer_unref(&s->init);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->updated);
+  s->name = NULL;
+}
+
+// Call once the writer and audio threads have stopped: publishes the last
+// part of each rendition, releases blocked clients and frees everything.
+void origin_stop(TranscoderContext *ctx) {
+  Origin *o = &ctx->origin;
+
+  for (int i = 0; i < ctx->renditions; i++)
+    close_stream(&o->streams[i]);
+  close_stream(&o->audio);
+
+  http_server_stop(&o->server);
+
+  // The muxers belong to the origin, not to the encoders
+  for (int i = 0; i < ctx->renditions; i++) {
+    if (o->streams[i].name)
+      ctx->encoders[i].fmt_ctx = NULL;
+    free_stream(&o->streams[i]);
+  }
+  if (o->audio.name)
+    ctx->audio.fmt_ctx = NULL;
+  free_stream(&o->audio);
+}
@@ -0,0 +1,129 @@
+// overload.c
+// Per-rendition overload control. A rendition compares the time it spends
+// on each frame with the frame's deadline and, while it keeps missing it,
+// steps through cheaper levels so that a CPU spike lowers quality for a
+// moment instead of filling the queue and adding latency. Levels are left
+// one at a time once the load at the level above would fit again.
+#include "../include/overload.h"
+
+static const char *const LEVEL_NAMES[OVERLOAD_LEVELS] = {
+    "none", "half_rate", "drop_late", "shed"};
+
+static const char *const SKIP_NAMES[OVERLOAD_SKIPS] = {"rate", "late", "shed"};
+
+const char *overload_level_name(int level) { return LEVEL_NAMES[level]; }
+
+const char *overload_skip_name(int skip) { return SKIP_NAMES[skip]; }
+
+// Frame budget of each encoded frame relative to the deadline: at half rate
+// every encoded frame has the time of the one skipped next to it.
+static int budget_factor(int level) {
+  return level >= OVERLOAD_HALF_RATE ? 2 : 1;
+}
+
+void overload_init(OverloadControl *oc, const QualityPreset *preset,
+                   int can_shed) {
+  // Renditions that block instead of dropping must encode every frame
+  oc->enabled =
+      OVERLOAD_CONTROL && preset->drop_policy == DROP_POLICY_NEWEST;
+  oc->max_level = can_shed ? OVERLOAD_SHED : OVERLOAD_DROP_LATE;
+  oc->deadline_ns = 1e9 / preset->fps;
+  oc->load = 0;
+  oc->over = 0;
+  oc->under = 0;
+  oc->frames = 0;
+  oc->resume = 0;
+  atomic_init(&oc->level, OVERLOAD_NONE);
+  atomic_init(&oc->load_percent, 0);
+  atomic_init(&oc->raised, 0);
+  atomic_init(&oc->lowered, 0);
+  for (int i = 0; i < OVERLOAD_SKIPS; i++)
+    atomic_init(&oc->skipped[i], 0);
+}
+
+static void set_level(OverloadControl *oc, int level) {
+  int old = atomic_load(&oc->level);
+  atomic_fetch_add(level > old ? &oc->raised : &oc->lowered, 1);
+  atomic_store(&oc->level, level);
+
+  // Keep the average comparable across the change of frame budget
+  oc->load = oc->load * budget_factor(old) / budget_factor(level);
+  oc->over = 0;
+  oc->under = 0;
+  if (old == OVERLOAD_SHED)
+    oc->resume = 1;
+}
+
+static int skip(OverloadControl *oc, OverloadSkip reason) {
+  atomic_fetch_add(&oc->skipped[reason], 1);
+  return 0;
+}
+
+// Decides whether the next input frame gets encoded. queued is the number
+// of frames waiting behind it. Frames on the shared keyframe timeline are
+// only skipped when the rendition is shed, so that every rendition that
+// runs keeps its keyframes aligned.
+int overload_admit(OverloadControl *oc, size_t queued, int keyframe) {
+  if (!oc->enabled)
+    return 1;
+
+  int level = atomic_load(&oc->level);
+  uint64_t index = oc->frames++;
+
+  // A shed rendition has no encode time to measure, so it is tried again
+  // at the level below after twice the usual recovery time
+  if (level == OVERLOAD_SHED) {
+    if (++oc->under >= 2 * OVERLOAD_LOWER_FRAMES)
+      set_level(oc, OVERLOAD_DROP_LATE);
+    return skip(oc, OVERLOAD_SKIP_SHED);
+  }
+  if (keyframe)
+    return 1;
+  if (level >= OVERLOAD_HALF_RATE && index % 2)
+    return skip(oc, OVERLOAD_SKIP_RATE);
+  if (level >= OVERLOAD_DROP_LATE && queued > 0)
+    return skip(oc, OVERLOAD_SKIP_LATE);
+  return 1;
+}
+
+// Feeds the time spent scaling and encoding one admitted frame, and the
+// input queue's fill, into the controller.
+void overload_update(OverloadControl *oc, int64_t busy_ns, size_t queued,
+                     size_t depth) {
+  if (!oc->enabled)
+    return;
+
+  int level = atomic_load(&oc->level);
+  double load = busy_ns / (oc->deadline_ns * budget_factor(level));
+  oc->load += (load - oc->load) / 8;
+  atomic_store(&oc->load_percent, (int)(oc->load * 100));
+
+  // A queue filling up means frames wait longer than the deadline even
+  // if each one alone fits
+  if (oc->load > OVERLOAD_HIGH || queued * 2 >= depth) {
+    oc->under = 0;
+    if (++oc->over >= OVERLOAD_RAISE_FRAMES && level < oc->max_level)
+      set_level(oc, level + 1);
+    return;
+  }
+
+  // Recover only if the load would still be low at the level above
+  oc->over = 0;
+  double above =
+      level > 0 ? oc->load * budget_factor(level) / budget_factor(level - 1)
+                : 0;
+  if (level > 0 && above < OVERLOAD_LOW) {
+    if (++oc->under >= OVERLOAD_LOWER_FRAMES)
+      set_level(oc, level - 1);
+  } else {
+    oc->under = 0;
+  }
+}
+
+// Returns 1 once after a shed rendition resumes, so that its first frame
+// is encoded as a keyframe players can start from.
+int overload_take_resume(OverloadControl *oc) {
+  int resume = oc->resume;
+  oc->resume = 0;
+  return resume;
+}
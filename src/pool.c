@@ -0,0 +1,213 @@
+// pool.c
+// Buffer pools for decoded frames, scaled frames and encoded packets, so that
+// steady-state operation reuses memory instead of allocating and faulting in
+// fresh pages for every frame.
+#include "../include/pool.h"
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <sys/mman.h>
+
+// Stored in front of every pooled buffer so it can be freed without knowing
+// the size its pool had when it was allocated.
+typedef struct PoolBlock {
+  size_t size; // Bytes allocated, header included
+  int mapped;  // mmap()ed rather than av_malloc()ed
+} PoolBlock;
+
+#define BLOCK_HEADER FFALIGN(sizeof(PoolBlock), POOL_ALIGN)
+
+static int huge_pages = POOL_HUGE_PAGES;
+
+void pool_set_huge_pages(int enable) { huge_pages = enable; }
+
+// Maps *size bytes rounded up to whole huge pages, preferring reserved
+// hugetlbfs pages and falling back to transparent huge pages.
+static void *map_huge_pages(size_t *size) {
+  size_t len = FFALIGN(*size, HUGE_PAGE_SIZE);
+  void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                   -1, 0);
+  if (mem == MAP_FAILED) {
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+      return NULL;
+    madvise(mem, len, MADV_HUGEPAGE);
+    memset(mem, 0, len); // Fault it in now rather than on the first frame
+  }
+
+  *size = len;
+  return mem;
+}
+
+static void free_block(void *opaque, uint8_t *data) {
+  BufferPool *p = opaque;
+  PoolBlock *block = (PoolBlock *)(data - BLOCK_HEADER);
+
+  atomic_fetch_sub(&p->stats.resident, block->size);
+  if (block->mapped)
+    munmap(block, block->size);
+  else
+    av_free(block);
+}
+
+// Called by the AVBufferPool only when it has no buffer to hand out. Huge
+// pages are only worth it for buffers that fill at least half of one.
+static AVBufferRef *alloc_block(void *opaque, size_t size) {
+  BufferPool *p = opaque;
+  size_t total = size + BLOCK_HEADER;
+  int mapped = huge_pages && total >= HUGE_PAGE_SIZE / 2;
+
+  PoolBlock *block = mapped ? map_huge_pages(&total) : av_malloc(total);
+  if (!block)
+    return NULL;
+  block->size = total;
+  block->mapped = mapped;
+
+  atomic_fetch_add(&p->stats.misses, 1);
+  atomic_fetch_add(&p->stats.resident, total);
+
+  uint8_t *data = (uint8_t *)block + BLOCK_HEADER;
+  AVBufferRef *ref = av_buffer_create(data, size, free_block, p, 0);
+  if (!ref)
+    free_block(p, data);
+  return ref;
+}
+
+void buffer_pool_init(BufferPool *p, const char *name) {
+  p->name = name;
+  p->pool = NULL;
+  p->size = 0;
+  pthread_mutex_init(&p->lock, NULL);
+  atomic_init(&p->stats.requests, 0);
+  atomic_init(&p->stats.misses, 0);
+  atomic_init(&p->stats.resident, 0);
+}
+
+// Buffers still in use are freed when their last reference goes away.
+void buffer_pool_uninit(BufferPool *p) {
+  if (!p->name)
+    return;
+
+  av_buffer_pool_uninit(&p->pool);
+  pthread_mutex_destroy(&p->lock);
+  p->name = NULL;
+}
+
+// Returns a buffer of at least size bytes. A request larger than the pool's
+// buffers replaces the pool with one 1.5x as large, so sizes that creep up
+// (like keyframes) only cause a few reallocations.
+AVBufferRef *buffer_pool_get(BufferPool *p, size_t size) {
+  atomic_fetch_add(&p->stats.requests, 1);
+
+  pthread_mutex_lock(&p->lock);
+  if (!p->pool || size > p->size) {
+    av_buffer_pool_uninit(&p->pool);
+    p->size = FFALIGN(FFMAX(size, p->size + p->size / 2), POOL_ALIGN);
+    p->pool = av_buffer_pool_init2(p->size, p, alloc_block, NULL);
+  }
+  AVBufferRef *ref = p->pool ? av_buffer_pool_get(p->pool) : NULL;
+  pthread_mutex_unlock(&p->lock);
+
+  return ref;
+}
+
+// Gives frame (format, width and height already set) a single pooled buffer
+// holding all of its planes, laid out for width x height pixels.
+int buffer_pool_get_frame(BufferPool *p, AVFrame *frame, int width,
+                          int height) {
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+  if (!desc || desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL))
+    return AVERROR(EINVAL);
+
+  int linesize[4];
+  int ret = av_image_fill_linesizes(linesize, frame->format, width);
+  if (ret < 0)
+    return ret;
+
+  size_t offset[4];
+  size_t total = 0;
+  int planes = av_pix_fmt_count_planes(frame->format);
+  for (int i = 0; i < planes; i++) {
+    int h = i == 1 || i == 2 ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h)
+                             : height;
+    frame->linesize[i] = FFALIGN(linesize[i], POOL_ALIGN);
+    offset[i] = total;
+    total += FFALIGN((size_t)frame->linesize[i] * h, POOL_ALIGN);
+  }
+
+  // Same tail padding as av_frame_get_buffer() for SIMD overreads
+  frame->buf[0] = buffer_pool_get(p, total + 16 + POOL_ALIGN - 1);
+  if (!frame->buf[0])
+    return AVERROR(ENOMEM);
+
+  for (int i = 0; i < planes; i++)
+    frame->data[i] = frame->buf[0]->data + offset[i];
+  frame->extended_data = frame->data;
+  return 0;
+}
+
+static int get_frame_buffer(AVCodecContext *s, AVFrame *frame, int flags) {
+  if (s->codec_type == AVMEDIA_TYPE_VIDEO) {
+    int width = frame->width;
+    int height = frame->height;
+    int align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(s, &width, &height, align);
+    if (buffer_pool_get_frame(s->opaque, frame, width, height) >= 0)
+      return 0;
+  }
+
+  // Palettized and hardware formats keep the default allocator
+  return avcodec_default_get_buffer2(s, frame, flags);
+}
+
+static int get_packet_buffer(AVCodecContext *s, AVPacket *packet,
+                             int flags) {
+  (void)flags;
+  packet->buf =
+      buffer_pool_get(s->opaque, packet->size + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (!packet->buf)
+    return AVERROR(ENOMEM);
+
+  packet->data = packet->buf->data;
+  memset(packet->data + packet->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+  return 0;
+}
+
+// Decoders that support direct rendering get their frames from p. The
+// callback may run on decoder threads, which buffer_pool_get() allows.
+void pool_attach_decoder(BufferPool *p, AVCodecContext *dec_ctx) {
+  dec_ctx->opaque = p;
+  dec_ctx->get_buffer2 = get_frame_buffer;
+}
+
+// Encoders that support direct rendering write their packets into p.
+void pool_attach_encoder(BufferPool *p, AVCodecContext *enc_ctx) {
+  enc_ctx->opaque = p;
+  enc_ctx->get_encode_buffer = get_packet_buffer;
+}
+
+// Share of requests served without allocating, in percent.
+double pool_hit_rate(PoolStats *stats) {
+  uint64_t requests = atomic_load(&stats->requests);
+  uint64_t misses = atomic_load(&stats->misses);
+  return requests ? 100.0 * (requests - misses) / requests : 100.0;
+}
+
+// Fills pools with every pool in the pipeline and returns how many there are
+// (at most POOL_COUNT).
+int pool_list(TranscoderContext *ctx, PoolInfo *pools) {
+  int n = 0;
+  pools[n++] = (PoolInfo){"decoded", NULL, &ctx->frame_pool.stats};
+
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    const char *name = enc->preset ? enc->preset->name : "";
+    pools[n++] = (PoolInfo){"scaled", name, &enc->frame_pool.stats};
+    pools[n++] = (PoolInfo){"packet", name, &enc->packet_pool.stats};
+    pools[n++] = (PoolInfo){"frame_shells", name, &enc->input_queue.shells};
+    pools[n++] = (PoolInfo){"packet_shells", name, &enc->write_queue.shells};
+  }
+
+  return n;
+}
@@ -1,5 +1,7 @@
 // presets.c
 #include "../include/presets.h"
+#include <libswscale/swscale.h>
+#include <string.h>
 
 QualityPreset QUALITY_PRESETS[MAX_QUALITY_LEVELS] = {{.width = 1920,
                                                       .height = 1080,
@@ -7,21 +9,68 @@ QualityPreset QUALITY_PRESETS[MAX_QUALITY_LEVELS] = {{.width = 1920,
                                                       .bitrate = 6000000,
                                                       .name = "1080p",
                                                       .keyframe_interval = 60,
-                                                      .dropped_frames = 0,
-                                                      .total_frames = 0},
+                                                      .scale_flags =
+                                                          SWS_FAST_BILINEAR,
+                                                      .queue_depth =
+                                                          FRAME_QUEUE_DEPTH,
+                                                      .drop_policy =
+                                                          DROP_POLICY_NEWEST},
                                                      {.width = 1280,
                                                       .height = 720,
                                                       .fps = 30,
                                                       .bitrate = 3500000,
                                                       .name = "720p",
                                                       .keyframe_interval = 60,
-                                                      .dropped_frames = 0,
-                                                      .total_frames = 0},
+                                                      .scale_flags =
+                                                          SWS_BILINEAR,
+                                                      .queue_depth =
+                                                          FRAME_QUEUE_DEPTH,
+                                                      .drop_policy =
+                                                          DROP_POLICY_NEWEST},
                                                      {.width = 854,
                                                       .height = 480,
                                                       .fps = 30,
                                                       .bitrate = 1500000,
                                                       .name = "480p",
                                                       .keyframe_interval = 30,
-                                                      .dropped_frames = 0,
-                                                      .total_frames = 0}};
+                                                      .scale_flags =
+                                                          SWS_BILINEAR,
+                                                      .queue_depth =
+                                                          FRAME_QUEUE_DEPTH,
+                                                      .drop_policy =
+                                                          DROP_POLICY_NEWEST}};
+
+static int find_preset(const char *name, size_t len) {
+  for (int i = 0; i < MAX_QUALITY_LEVELS; i++)
+    if (strlen(QUALITY_PRESETS[i].name) == len &&
+        !strncmp(QUALITY_PRESETS[i].name, name, len))
+      return i;
+  return -1;
+}
+
+// Copies the presets named in list (comma-separated, or "none") into
+// ctx->presets in ladder order; NULL selects the whole ladder. Processes
+// that share one input over a frame bus each run part of the ladder.
+int select_renditions(TranscoderContext *ctx, const char *list) {
+  int selected[MAX_QUALITY_LEVELS] = {0};
+  if (list && strcmp(list, "none")) {
+    for (const char *p = list; *p;) {
+      size_t len = strcspn(p, ",");
+      int i = find_preset(p, len);
+      if (i < 0) {
+        fprintf(stderr, "Unknown rendition: %.*s\n", (int)len, p);
+        return AVERROR(EINVAL);
+      }
+      selected[i] = 1;
+      p += len;
+      if (*p)
+        p++;
+    }
+  }
+
+  ctx->renditions = 0;
+  for (int i = 0; i < MAX_QUALITY_LEVELS; i++)
+    if (!list || selected[i])
+      ctx->presets[ctx->renditions++] = QUALITY_PRESETS[i];
+  return 0;
+}
@@ -1,12 +1,497 @@
 #include "../include/processor.h"
+#include "../include/buffer.h"
+#include "../include/channel.h"
+#include "../include/cores.h"
+#include "../include/decoder.h"
+#include "../include/frame_bus.h"
+#include "../include/frame_queue.h"
+#include "../include/latency.h"
+#include "../include/origin.h"
+#include "../include/overload.h"
+#include "../include/scaler.h"
+#include "../include/scene.h"
+#include "../include/source.h"
 #include "../include/utils.h"
-#include <libswscale/swscale.h>
+#include "../include/workpool.h"
+#include <errno.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/time.h>
+
+static void sem_wait_uninterrupted(sem_t *sem) {
+  while (sem_wait(sem) < 0 && errno == EINTR)
+    ;
+}
+
+// Fixes where the output timeline starts, for the audio to be placed on:
+// the first frame decoded or, when nothing is decoded, the first packet
+// copied. Both are the same source keyframe.
+static void start_timeline(TranscoderContext *ctx, int64_t pts,
+                           int64_t captured) {
+  ctx->timeline_pts = pts;
+  ctx->timeline_captured = captured ? captured : av_gettime();
+  atomic_store(&ctx->timeline_ready, 1);
+}
+
+// A packet starts a new HLS segment when it is a keyframe at least
+// SEGMENT_DURATION after the current segment began; the muxer closes and
+// publishes the previous segment while writing it.
+static int starts_segment(EncoderContext *enc, const AVPacket *packet) {
+  if (!(packet->flags & AV_PKT_FLAG_KEY) || packet->pts == AV_NOPTS_VALUE)
+    return 0;
+
+  // Aligned keyframes may land a frame early
+  double slack = KEYFRAME_ALIGN ? PART_DURATION / 2 : 0;
+  double pts_time = packet->pts * av_q2d(enc->stream->time_base);
+  if (enc->segment_index &&
+      pts_time - enc->segment_start_time < SEGMENT_DURATION - slack)
+    return 0;
+
+  enc->segment_start_time = pts_time;
+  return enc->segment_index++ > 0;
+}
+
+// Marks the startup milestones a packet at pts reaches once muxed. A packet
+// PART_DURATION after the first closes the first part. A player can start
+// once the origin holds PART-HOLD-BACK (three parts) of media, or once the
+// HLS muxer has completed a segment and written its playlist.
+static void note_startup(EncoderContext *enc, int64_t pts, int publishes) {
+  if (pts == AV_NOPTS_VALUE)
+    return;
+  if (enc->first_write_pts == AV_NOPTS_VALUE)
+    enc->first_write_pts = pts;
+
+  double since = (pts - enc->first_write_pts) * av_q2d(enc->stream->time_base);
+  if (since >= PART_DURATION)
+    channel_mark_startup(enc->channel, STARTUP_FIRST_PART);
+  if (enc->origin ? since >= 3 * PART_DURATION : publishes)
+    channel_mark_startup(enc->channel, STARTUP_FIRST_PLAYLIST);
+}
+
+// Records capture-to-publish latency for the frames traced so far once the
+// write of the next packet has published them: the origin makes a part
+// visible when it cuts it, the HLS muxer a segment when it closes it. Then
+// traces the packet just written.
+static void trace_publish(EncoderContext *enc, int64_t captured,
+                          int published) {
+  if (published) {
+    int64_t now = av_gettime();
+    for (int i = 0; i < enc->traced_count; i++)
+      latency_record(&enc->publish_age, (now - enc->traced[i]) * 1000);
+    enc->traced_count = 0;
+  }
+  if (captured && enc->traced_count < TRACE_FRAMES)
+    enc->traced[enc->traced_count++] = captured;
+}
+
+// Muxes one packet. Runs on the writer thread, which is the only one that
+// touches fmt_ctx, so file creation, playlist rewrites and segment deletion
+// by the HLS muxer never hold up the encoder.
+static int write_packet(EncoderContext *enc, AVPacket *packet) {
+  // Debug timing
+  if (DEBUG_MODE) {
+    log_packet(enc->fmt_ctx, packet);
+  }
+
+  int size = packet->size;
+  int64_t pts = packet->pts; // The muxer takes the packet
+  int64_t captured = (intptr_t)packet->opaque;
+  int publishes = starts_segment(enc, packet);
+  uint64_t parts = enc->origin ? enc->origin->parts_published : 0;
+
+  int64_t start = latency_now_ns();
+  int ret = enc->origin ? origin_write_packet(enc->origin, packet)
+                        : av_interleaved_write_frame(enc->fmt_ctx, packet);
+  if (ret < 0)
+    return ret;
+  trace_publish(enc, captured,
+                enc->origin ? enc->origin->parts_published != parts
+                            : publishes);
+  int64_t elapsed = latency_since(&enc->write_latency, start) - start;
+
+  if (publishes) {
+    latency_record(&enc->publish_latency, elapsed);
+    atomic_fetch_add(&enc->segments, 1);
+  }
+  note_startup(enc, pts, publishes);
+  latency_record(&enc->packet_size, size);
+  atomic_fetch_add(&enc->bytes_out, size);
+  atomic_fetch_add(&enc->encoded_frames, 1);
+  return 0;
+}
+
+// Sends frame (or NULL to flush) to the encoder and hands every packet it
+// produces to the writer thread.
+static int encode_and_queue(EncoderContext *enc, AVFrame *frame) {
+  int64_t start = latency_now_ns();
+  int ret = avcodec_send_frame(enc->enc_ctx, frame);
+  if (ret < 0)
+    return ret;
+  int64_t now = latency_since(&enc->send_latency, start);
+  int64_t encode_ns = now - start;
+
+  AVPacket *packet = enc->packet;
+  while (ret >= 0) {
+    start = latency_now_ns();
+    ret = avcodec_receive_packet(enc->enc_ctx, packet);
+    now = latency_now_ns();
+    encode_ns += now - start;
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+      ret = 0;
+      break;
+    }
+    if (ret < 0)
+      break;
+    latency_record(&enc->receive_latency, now - start);
+
+    // Set packet timing; the origin needs durations to time its parts
+    packet->stream_index = 0;
+    if (!packet->duration)
+      packet->duration = 1;
+    av_packet_rescale_ts(packet, enc->enc_ctx->time_base,
+                         enc->stream->time_base);
+
+    // Only waits if the writer has fallen WRITE_QUEUE_DEPTH packets behind
+    ret = packet_queue_push(&enc->write_queue, packet);
+  }
+
+  if (frame)
+    latency_record(&enc->encode_latency, encode_ns);
+  return ret;
+}
+
+// Identifies the capture time SEI payload that follows it
+static const uint8_t CAPTURE_TIME_UUID[16] = {
+    0x6c, 0x6c, 0x68, 0x6c, 0x73, 0x2d, 0x63, 0x61,
+    0x70, 0x74, 0x75, 0x72, 0x65, 0x2d, 0x74, 0x73}; // "llhls-capture-ts"
+
+// Attaches the frame's capture time for x264 to write as a user data
+// unregistered SEI message: the UUID, then microseconds since the epoch,
+// big-endian.
+static int stamp_capture_time(AVFrame *frame) {
+  int64_t captured = (intptr_t)frame->opaque;
+  if (!captured)
+    return 0;
+
+  AVFrameSideData *sd = av_frame_new_side_data(
+      frame, AV_FRAME_DATA_SEI_UNREGISTERED, sizeof(CAPTURE_TIME_UUID) + 8);
+  if (!sd)
+    return AVERROR(ENOMEM);
+  memcpy(sd->data, CAPTURE_TIME_UUID, sizeof(CAPTURE_TIME_UUID));
+  AV_WB64(sd->data + sizeof(CAPTURE_TIME_UUID), captured);
+  return 0;
+}
+
+// Fills output slots the input skipped over by encoding the previous frame
+// again, up to MAX_DUPLICATE_FRAMES of them, so the rendition stays CFR
+// when its source runs slower than the preset frame rate.
+static int fill_gap(EncoderContext *enc, int64_t slot) {
+  AVFrame *previous = enc->scaled_frame;
+  if (!FRAME_RATE_CFR || !previous->buf[0])
+    return 0;
+
+  for (int64_t pts = FFMAX(enc->next_pts, slot - MAX_DUPLICATE_FRAMES);
+       pts < slot; pts++) {
+    previous->pts = pts;
+    previous->pict_type = AV_PICTURE_TYPE_NONE;
+    int ret = encode_and_queue(enc, previous);
+    if (ret < 0)
+      return ret;
+    atomic_fetch_add(&enc->duplicated_frames, 1);
+  }
+  return 0;
+}
+
+// Returns 1 if frame is the first source frame at or after a boundary of
+// the channel's keyframe timeline (every KEYFRAME_ALIGN_INTERVAL from the
+// first frame) and stores the boundary's index. All renditions see the same
+// source frames, so they all pick the same one.
+static int on_boundary(EncoderContext *enc, const AVFrame *frame,
+                       int64_t *boundary) {
+  // Next to a copy of the source, keyframes go where the source has its
+  // own, so that every rendition's segments start on the same frames.
+  // Each boundary is then known by its source keyframe's pts rather than
+  // counted, since a rendition whose queue dropped one would count it
+  // differently from the others ever after.
+  if (enc->channel->copies) {
+    *boundary = frame->pts;
+    return !!(frame->flags & AV_FRAME_FLAG_KEY);
+  }
+  if (!KEYFRAME_ALIGN)
+    return 0;
+
+  double t = (frame->pts - enc->channel->first_pts) *
+             av_q2d(enc->src_time_base);
+  if (t < 0)
+    return 0;
+  int64_t k = (int64_t)(t / KEYFRAME_ALIGN_INTERVAL + 1e-9);
+  if (k < enc->next_boundary)
+    return 0;
+
+  *boundary = k;
+  return 1;
+}
+
+// Records which source frame boundary got its keyframe on, or counts a
+// misalignment if another rendition put it on a different one.
+static void check_alignment(EncoderContext *enc, int64_t boundary,
+                            int64_t pts) {
+  KeyframeTimeline *timeline = &enc->channel->timeline;
+  int i = (uint64_t)boundary % ALIGN_HISTORY; // A source pts may be negative
+
+  pthread_mutex_lock(&timeline->lock);
+  if (timeline->boundary[i] != boundary) {
+    timeline->boundary[i] = boundary;
+    timeline->pts[i] = pts;
+  } else if (timeline->pts[i] != pts) {
+    atomic_fetch_add(&enc->misaligned_keyframes, 1);
+  }
+  pthread_mutex_unlock(&timeline->lock);
+}
+
+// queued is the number of frames waiting behind frame.
+static int encode_frame(EncoderContext *enc, AVFrame *frame, size_t queued) {
+  int ret;
+  int64_t boundary;
+  int keyframe = on_boundary(enc, frame, &boundary);
+
+  // Frame-rate conversion: a frame lands in the output slot (tick of the
+  // encoder time base) nearest its timestamp, and only the first frame for
+  // each slot is encoded. A keyframe is never decimated; it takes the next
+  // free slot if its own is taken.
+  int64_t slot = av_rescale_q_rnd(frame->pts - enc->channel->first_pts,
+                                  enc->src_time_base, enc->enc_ctx->time_base,
+                                  AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+  if (keyframe && slot < enc->next_pts)
+    slot = enc->next_pts;
+  int encode = slot >= enc->next_pts;
+  if (!encode) {
+    atomic_fetch_add(&enc->decimated_frames, 1);
+  } else {
+    encode = overload_admit(&enc->overload, queued, keyframe);
+    if (encode && (ret = fill_gap(enc, slot)) < 0)
+      return ret;
+    enc->next_pts = slot + 1;
+  }
+
+  // A boundary a shed rendition skips is passed, not carried over
+  if (keyframe && !enc->channel->copies)
+    enc->next_boundary = boundary + 1;
+
+  // Renditions scaled from this one need the frame even when it is not
+  // encoded here, since they may run at a higher frame rate
+  if (!encode && !enc->downstream)
+    return 0;
+
+  // Every frame is scaled into a fresh pooled buffer: the encoder or the
+  // next rendition may still hold the previous one. A frame that is already
+  // what the encoder takes (e.g. pre-scaled on a frame bus) is referenced.
+  // A frame that shows the scene last scaled reuses that picture instead;
+  // x264 then finds nothing but skip blocks in it, which cost next to no
+  // time or bits.
+  AVFrame *scaled = enc->scaled_frame;
+  int reuse =
+      !enc->passthrough && scaled->buf[0] && scene_unchanged(enc, frame);
+  int64_t start, scale_ns = 0;
+  if (reuse) {
+    // Still holds the slot it was last encoded in, in the encoder's time
+    // base; renditions cascaded from this one read the source's
+    scaled->pts = frame->pts;
+    scaled->opaque = frame->opaque;
+    scaled->flags = frame->flags & AV_FRAME_FLAG_KEY;
+    scaled->pict_type = AV_PICTURE_TYPE_NONE;
+    av_frame_remove_side_data(scaled, AV_FRAME_DATA_SEI_UNREGISTERED);
+    atomic_fetch_add(&enc->static_frames, 1);
+    atomic_fetch_add(&enc->static_saved_ns, enc->scale_avg_ns);
+  } else {
+    av_frame_unref(scaled);
+    start = latency_now_ns();
+    if (enc->passthrough) {
+      ret = av_frame_ref(scaled, frame);
+      scaled->pict_type = AV_PICTURE_TYPE_NONE; // Not the source's GOP
+    } else if ((ret = get_scaled_buffer(enc, scaled)) >= 0) {
+      start = latency_now_ns();
+      ret = scale_frame(enc, frame, scaled);
+    }
+    if (ret < 0)
+      return ret;
+    scale_ns = latency_since(&enc->scale_latency, start) - start;
+    enc->scale_avg_ns += (scale_ns - enc->scale_avg_ns) / 16;
+
+    // The scene goes along to renditions cascaded from this one
+    if ((ret = av_buffer_replace(&scaled->opaque_ref, frame->opaque_ref)) <
+            0 ||
+        (ret = av_buffer_replace(&enc->scene, frame->opaque_ref)) < 0)
+      return ret;
+  }
+
+  if (enc->downstream) {
+    ret = frame_queue_push(&enc->downstream->input_queue, scaled);
+    if (ret < 0 && ret != AVERROR(EAGAIN))
+      return ret;
+    work_pool_schedule(enc->channel->pool, &enc->downstream->task);
+  }
+
+  if (!encode)
+    return 0;
+
+  // Only the frame handed to the encoder is in its time base
+  scaled->pts = slot;
+  if (overload_take_resume(&enc->overload) || keyframe)
+    scaled->pict_type = AV_PICTURE_TYPE_I;
+  if (keyframe) {
+    atomic_fetch_add(&enc->forced_keyframes, 1);
+    check_alignment(enc, boundary, frame->pts);
+  }
+
+  if (enc->latency_stamps && (ret = stamp_capture_time(scaled)) < 0)
+    return ret;
+
+  start = latency_now_ns();
+  ret = encode_and_queue(enc, scaled);
+  int64_t encode_ns = latency_now_ns() - start;
+  if (reuse)
+    atomic_fetch_add(&enc->static_saved_ns,
+                     FFMAX(enc->encode_avg_ns - encode_ns, 0));
+  else
+    enc->encode_avg_ns += (encode_ns - enc->encode_avg_ns) / 16;
+  overload_update(&enc->overload, scale_ns + encode_ns, queued,
+                  enc->input_queue.ring.depth);
+  return ret;
+}
+
+// Once an encoder has drained its queue and been flushed, its downstream
+// rendition gets no more input and its writer no more packets.
+static void finish_encoder(EncoderContext *enc) {
+  encode_and_queue(enc, NULL);
+  enc->flushed = 1;
+
+  if (enc->downstream) {
+    frame_queue_close(&enc->downstream->input_queue);
+    work_pool_schedule(enc->channel->pool, &enc->downstream->task);
+  }
+  frame_queue_close(&enc->write_queue);
+  sem_post(&enc->channel->tasks_done);
+}
+
+// Scales and encodes up to TASK_BATCH queued frames, then lets other tasks
+// run on this thread.
+static void encoder_task_func(Task *task) {
+  EncoderContext *enc = task->opaque;
+  if (enc->flushed)
+    return;
+
+  AVFrame *frame;
+  for (int n = 0; n < TASK_BATCH; n++) {
+    if (!(frame = frame_queue_try_pop(&enc->input_queue)))
+      break;
+    size_t queued = ring_buffer_count(&enc->input_queue.ring);
+    latency_record(&enc->queue_depth, queued);
+    if (encode_frame(enc, frame, queued) < 0)
+      atomic_fetch_add(&enc->dropped_frames, 1);
+    frame_queue_release(&enc->input_queue, frame);
+  }
+
+  if (frame_queue_finished(&enc->input_queue))
+    finish_encoder(enc);
+  else if (ring_buffer_count(&enc->input_queue.ring))
+    work_pool_schedule(enc->channel->pool, task);
+}
+
+static void *writer_thread_func(void *arg) {
+  EncoderContext *enc = (EncoderContext *)arg;
+  AVPacket *packet;
+
+  char name[16];
+  snprintf(name, sizeof(name), "write-%s", enc->preset->name);
+  cores_pin_thread(NULL, name);
+
+  while ((packet = packet_queue_pop(&enc->write_queue))) {
+    latency_record(&enc->write_queue_depth,
+                   ring_buffer_count(&enc->write_queue.ring));
+    if (write_packet(enc, packet) < 0)
+      atomic_fetch_add(&enc->dropped_frames, 1);
+    packet_queue_release(&enc->write_queue, packet);
+  }
+
+  return NULL;
+}
+
+static int init_decode_task(TranscoderContext *ctx);
+
+// Muxing blocks on I/O, so writers keep a thread each; decoding, scaling and
+// encoding run as tasks on the channel's pool.
+int start_encoder_workers(TranscoderContext *ctx) {
+  int ret = init_decode_task(ctx);
+  if (ret < 0)
+    return ret;
+
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    enc->src_time_base = ctx->time_base;
+    enc->channel = ctx;
+    overload_init(&enc->overload, enc->preset, i < ctx->renditions - 1);
+
+    if (pthread_create(&enc->writer_thread, NULL, writer_thread_func, enc) !=
+        0) {
+      fprintf(stderr, "Could not start %s writer thread\n",
+              enc->preset->name);
+      return -1;
+    }
+    enc->writer_running = 1;
+
+    // The input thread feeds a copy's writer itself
+    if (enc->copy)
+      continue;
+    task_init(&enc->task, encoder_task_func, enc);
+    enc->task_running = 1;
+  }
+
+  return 0;
+}
+
+// Closing the renditions fed from the source is enough: each encoder task
+// closes its downstream queue once flushed, so a cascade drains top-down.
+// Each writer is stopped after its encoder has flushed, so every packet
+// reaches the muxer.
+void stop_encoder_workers(TranscoderContext *ctx) {
+  if (!ctx->decode_task.run)
+    return; // Never started, or already stopped
+
+  int running = 0;
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    if (!enc->task_running)
+      continue;
+    running++;
+    if (!enc->has_upstream) {
+      frame_queue_close(&enc->input_queue);
+      work_pool_schedule(ctx->pool, &enc->task);
+    }
+  }
+  for (; running > 0; running--)
+    sem_wait_uninterrupted(&ctx->tasks_done);
+
+  sem_destroy(&ctx->tasks_done);
+  sem_destroy(&ctx->decode_done);
+  pthread_mutex_destroy(&ctx->timeline.lock);
+  free_frame_queue(&ctx->decode_queue);
+  ctx->decode_task.run = NULL;
+
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    enc->task_running = 0;
+    if (enc->writer_running) {
+      frame_queue_close(&enc->write_queue);
+      pthread_join(enc->writer_thread, NULL);
+      enc->writer_running = 0;
+    }
+  }
+}
+
 int process_frame(TranscoderContext *ctx, AVFrame *frame) {
   // Frame timing check
   if (ctx->last_pts != AV_NOPTS_VALUE) {
-    double elapsed =
-        (frame->pts - ctx->last_pts) *
-        av_q2d(ctx->input_ctx->streams[ctx->video_stream_index]->time_base);
+    double elapsed = (frame->pts - ctx->last_pts) * av_q2d(ctx->time_base);
 
     if (elapsed < ctx->frame_duration * 0.5) {
       if (DEBUG_MODE) {
@@ -18,91 +503,259 @@ int process_frame(TranscoderContext *ctx, AVFrame *frame) {
   }
 
   ctx->last_pts = frame->pts;
+  if (ctx->first_pts == AV_NOPTS_VALUE) {
+    ctx->first_pts = frame->pts;
+    start_timeline(ctx, frame->pts, (intptr_t)frame->opaque);
+    channel_mark_startup(ctx, STARTUP_FIRST_FRAME);
+  }
 
-  int ret;
-  for (int i = 0; i < MAX_QUALITY_LEVELS; i++) {
-    EncoderContext *enc = &ctx->encoders[i];
-    QualityPreset *preset = enc->preset;
+  // Other processes get their copy first, so that a busy pool here does not
+  // hold up their renditions
+  if (ctx->bus.producer) {
+    int ret = frame_bus_publish(&ctx->bus, frame);
+    if (ret < 0)
+      return ret;
+  }
 
-    pthread_mutex_lock(&enc->buffer_mgr.mutex);
+  // Renditions reuse what they scaled last for frames that show nothing new
+  if (SCENE_DETECT && ctx->copies < ctx->renditions) {
+    int ret = scene_mark(&ctx->scene, frame);
+    if (ret < 0)
+      return ret;
+  }
 
-    if (enc->buffer_mgr.is_full) {
-      pthread_mutex_unlock(&enc->buffer_mgr.mutex);
-      preset->dropped_frames++;
+  // Hand a reference to every rendition fed from the source; each encoder
+  // task then runs on whichever pool thread is free.
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    if (enc->has_upstream || enc->copy)
       continue;
-    }
 
-    // Scale frame
-    ret = sws_scale(enc->sws_ctx, (const uint8_t *const *)frame->data,
-                    frame->linesize, 0, frame->height, enc->scaled_frame->data,
-                    enc->scaled_frame->linesize);
+    int ret = frame_queue_push(&enc->input_queue, frame);
+    if (ret < 0 && ret != AVERROR(EAGAIN))
+      return ret;
+    if (ret >= 0)
+      work_pool_schedule(ctx->pool, &enc->task);
+  }
 
-    if (ret < 0) {
-      pthread_mutex_unlock(&enc->buffer_mgr.mutex);
-      preset->dropped_frames++;
-      continue;
-    }
+  return 0;
+}
+
+// Hands a raw frame to the encoders without a decode stage. The reference
+// to the capture buffer is dropped as soon as the encoders have theirs.
+static int pass_raw_packet(TranscoderContext *ctx, const AVPacket *packet) {
+  int64_t start = latency_now_ns();
+  int ret = decoder_wrap_raw(ctx, packet, ctx->frame);
+  if (ret == AVERROR(EAGAIN))
+    return 0; // Skip a truncated frame
+  if (ret < 0)
+    return ret;
+  latency_since(&ctx->decode_latency, start);
+  atomic_fetch_add(&ctx->decoded_frames, 1);
+
+  ret = process_frame(ctx, ctx->frame);
+  av_frame_unref(ctx->frame);
+  return ret;
+}
+
+// Sends a packet (or NULL to drain at end of input) to the decoder and hands
+// every decoded frame to the encoders.
+static int decode_packet(TranscoderContext *ctx, const AVPacket *packet) {
+  if (!ctx->dec_ctx)
+    return 0; // Every rendition is a copy
+  if (ctx->raw_input)
+    return packet ? pass_raw_packet(ctx, packet) : 0;
 
-    // Frame timing
-    if (enc->first_pts == AV_NOPTS_VALUE) {
-      enc->first_pts = frame->pts;
-      enc->next_pts = 0;
+  int64_t start = latency_now_ns();
+  int ret = avcodec_send_packet(ctx->dec_ctx, packet);
+  if (ret < 0)
+    return ret;
+  decoder_packet_sent(ctx, packet, start);
+
+  while (ret >= 0) {
+    ret = avcodec_receive_frame(ctx->dec_ctx, ctx->frame);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      return 0;
+    if (ret < 0)
+      return ret;
+    decoder_frame_out(ctx, ctx->frame,
+                      latency_since(&ctx->decode_latency, start));
+    atomic_fetch_add(&ctx->decoded_frames, 1);
+
+    ret = process_frame(ctx, ctx->frame);
+    start = latency_now_ns();
+  }
+
+  return ret;
+}
+
+// Decodes up to TASK_BATCH queued packets. Once the input loop has closed
+// the queue, drains the decoder so no frame is left behind.
+static void decode_task_func(Task *task) {
+  TranscoderContext *ctx = task->opaque;
+  if (ctx->decode_flushed)
+    return;
+
+  AVPacket *packet;
+  for (int n = 0; n < TASK_BATCH; n++) {
+    if (!(packet = packet_queue_try_pop(&ctx->decode_queue)))
+      break;
+    if (!atomic_load(&ctx->decode_error)) {
+      int ret = decode_packet(ctx, packet);
+      if (ret < 0)
+        atomic_store(&ctx->decode_error, ret);
     }
+    packet_queue_release(&ctx->decode_queue, packet);
+  }
+
+  if (frame_queue_finished(&ctx->decode_queue)) {
+    if (!atomic_load(&ctx->decode_error))
+      decode_packet(ctx, NULL);
+    ctx->decode_flushed = 1;
+    sem_post(&ctx->decode_done);
+  } else if (ring_buffer_count(&ctx->decode_queue.ring)) {
+    work_pool_schedule(ctx->pool, task);
+  }
+}
+
+// A live source cannot wait for the decoder without the driver dropping
+// frames unseen. When every packet is a keyframe (MJPEG, raw video), capture
+// drops at the queue instead, where the drop is counted and the stream
+// stays decodable.
+static DropPolicy decode_queue_policy(TranscoderContext *ctx) {
+  if (!ctx->dec_ctx)
+    return DROP_POLICY_BLOCK;
+  const AVCodecDescriptor *desc =
+      avcodec_descriptor_get(ctx->dec_ctx->codec_id);
+  if (source_is_live(&ctx->source) && desc &&
+      (desc->props & AV_CODEC_PROP_INTRA_ONLY))
+    return DROP_POLICY_NEWEST;
+  return DROP_POLICY_BLOCK;
+}
+
+static int init_decode_task(TranscoderContext *ctx) {
+  int ret = init_packet_queue(&ctx->decode_queue, DECODE_QUEUE_DEPTH,
+                              decode_queue_policy(ctx));
+  if (ret < 0)
+    return ret;
+  sem_init(&ctx->decode_done, 0, 0);
+  sem_init(&ctx->tasks_done, 0, 0);
+  ctx->first_pts = AV_NOPTS_VALUE;
+  atomic_init(&ctx->timeline_ready, 0);
+  pthread_mutex_init(&ctx->timeline.lock, NULL);
+  for (int i = 0; i < ALIGN_HISTORY; i++)
+    ctx->timeline.boundary[i] = AV_NOPTS_VALUE;
+  atomic_init(&ctx->decode_error, 0);
+  task_init(&ctx->decode_task, decode_task_func, ctx);
+  return 0;
+}
 
-    // Calculate PTS in encoder timebase
-    int64_t pts_diff = frame->pts - enc->first_pts;
-    AVRational tb_mult =
-        av_mul_q(ctx->input_ctx->streams[ctx->video_stream_index]->time_base,
-                 av_inv_q(enc->enc_ctx->time_base));
-    enc->scaled_frame->pts = av_rescale_q(
-        pts_diff, ctx->input_ctx->streams[ctx->video_stream_index]->time_base,
-        enc->enc_ctx->time_base);
-
-    // Encode frame
-    ret = avcodec_send_frame(enc->enc_ctx, enc->scaled_frame);
-    if (ret < 0) {
-      pthread_mutex_unlock(&enc->buffer_mgr.mutex);
-      preset->dropped_frames++;
+// Hands packet to every rendition that remuxes the source, from the first
+// keyframe on. Its timestamps then count from that keyframe, like those of
+// the encoded renditions from the first frame decoded, which is the same.
+// Runs on the input thread, the only producer of a copy's write queue.
+static int copy_packet(TranscoderContext *ctx, const AVPacket *packet) {
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    if (!enc->copy)
       continue;
+    if (enc->copy_origin == AV_NOPTS_VALUE) {
+      if (!(packet->flags & AV_PKT_FLAG_KEY) || packet->pts == AV_NOPTS_VALUE)
+        continue;
+      enc->copy_origin = packet->pts;
+      if (!ctx->dec_ctx && !atomic_load(&ctx->timeline_ready))
+        start_timeline(ctx, packet->pts, (intptr_t)packet->opaque);
     }
 
-    while (ret >= 0) {
-      AVPacket *packet = av_packet_alloc();
-      ret = avcodec_receive_packet(enc->enc_ctx, packet);
-      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-        av_packet_free(&packet);
-        break;
-      }
-      if (ret < 0) {
-        av_packet_free(&packet);
-        pthread_mutex_unlock(&enc->buffer_mgr.mutex);
-        preset->dropped_frames++;
-        continue;
-      }
+    AVPacket *copy = enc->packet;
+    int ret = av_packet_ref(copy, packet);
+    if (ret < 0)
+      return ret;
+    copy->stream_index = 0;
+    if (copy->pts != AV_NOPTS_VALUE)
+      copy->pts -= enc->copy_origin;
+    if (copy->dts != AV_NOPTS_VALUE)
+      copy->dts -= enc->copy_origin;
+    // The origin needs durations to time its parts
+    if (!copy->duration)
+      copy->duration =
+          av_rescale_q(1, av_inv_q(ctx->frame_rate), ctx->time_base);
+    av_packet_rescale_ts(copy, enc->enc_ctx->time_base,
+                         enc->stream->time_base);
 
-      // Set packet timing
-      packet->stream_index = 0;
-      av_packet_rescale_ts(packet, enc->enc_ctx->time_base,
-                           enc->stream->time_base);
+    ret = packet_queue_push(&enc->write_queue, copy);
+    av_packet_unref(copy);
+    if (ret < 0)
+      return ret;
+  }
+  return 0;
+}
 
-      // Debug timing
-      if (DEBUG_MODE) {
-        log_packet(enc->fmt_ctx, packet);
-      }
+// Reads the next packet from the demuxer, or the next frame from a bus.
+static int read_input(TranscoderContext *ctx, AVPacket *packet) {
+  if (ctx->source.type == SOURCE_BUS)
+    return frame_bus_read(&ctx->bus, packet);
+  return av_read_frame(ctx->input_ctx, packet);
+}
 
-      ret = av_interleaved_write_frame(enc->fmt_ctx, packet);
-      av_packet_free(&packet);
-      if (ret < 0) {
-        pthread_mutex_unlock(&enc->buffer_mgr.mutex);
-        preset->dropped_frames++;
-        continue;
-      }
+// Reads input and queues it for the decode task until it ends, *keep_running
+// drops to zero, or max_frames frames have been decoded (0 for no limit).
+// When every rendition is a copy nothing is decoded, and the frames copied
+// count instead. Returns once every packet read has been decoded and
+// dispatched.
+int run_input_loop(TranscoderContext *ctx, volatile int *keep_running,
+                   int64_t max_frames) {
+  int64_t copied = 0;
+  int ret = 0;
 
-      preset->total_frames++;
+  while (*keep_running &&
+         (!max_frames || (ctx->dec_ctx ? atomic_load(&ctx->decoded_frames)
+                                       : copied) < max_frames) &&
+         !(ret = atomic_load(&ctx->decode_error))) {
+    int64_t start = latency_now_ns();
+    ret = read_input(ctx, ctx->packet);
+    if (ret == AVERROR_EOF) {
+      ret = 0; // Recorded inputs end, and a bus producer may stop
+      break;
+    }
+    if (ret == AVERROR(EAGAIN)) {
+      ret = 0; // Nothing on the bus yet
+      continue;
+    }
+    if (ret < 0)
+      break;
+    latency_since(&ctx->read_latency, start);
+
+    pace_packet(ctx, ctx->packet);
+    capture_note_packet(ctx, ctx->packet);
+
+    if (ctx->packet->stream_index == ctx->video_stream_index) {
+      if (ctx->copies && (ret = copy_packet(ctx, ctx->packet)) < 0)
+        break;
+      copied++;
+      if (ctx->dec_ctx) {
+        ret = packet_queue_push(&ctx->decode_queue, ctx->packet);
+        if (ret < 0 && ret != AVERROR(EAGAIN))
+          break;
+        work_pool_schedule(ctx->pool, &ctx->decode_task);
+      }
+      ret = 0;
+    } else if (ctx->audio.thread_running &&
+               ctx->packet->stream_index == ctx->audio.stream_index) {
+      // The audio thread decodes and encodes it once for every rendition
+      ret = packet_queue_push(&ctx->audio.queue, ctx->packet);
+      if (ret < 0 && ret != AVERROR(EAGAIN))
+        break;
+      ret = 0;
     }
 
-    pthread_mutex_unlock(&enc->buffer_mgr.mutex);
+    av_packet_unref(ctx->packet);
   }
+  av_packet_unref(ctx->packet);
 
-  return 0;
+  frame_queue_close(&ctx->decode_queue);
+  work_pool_schedule(ctx->pool, &ctx->decode_task);
+  sem_wait_uninterrupted(&ctx->decode_done);
+
+  return ret < 0 ? ret : atomic_load(&ctx->decode_error);
 }
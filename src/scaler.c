@@ -0,0 +1,108 @@
+// scaler.c
+#include "../include/scaler.h"
+#include "../include/pool.h"
+#include "../include/simd_scale.h"
+#include <libswscale/swscale.h>
+
+int init_scaler(EncoderContext *enc, int src_width, int src_height,
+                enum AVPixelFormat src_fmt) {
+  enc->passthrough = src_width == enc->enc_ctx->width &&
+                     src_height == enc->enc_ctx->height &&
+                     src_fmt == enc->enc_ctx->pix_fmt;
+
+  // Prefer the fused kernels; anything they do not cover goes to swscale
+  if (SIMD_SCALING &&
+      simd_scaler_init(&enc->simd, src_width, src_height, src_fmt,
+                       enc->enc_ctx->width, enc->enc_ctx->height,
+                       enc->enc_ctx->pix_fmt, simd_detect_level()) >= 0) {
+    enc->use_simd = 1;
+  }
+
+  enc->sws_ctx = sws_getContext(src_width, src_height, src_fmt,
+                                enc->enc_ctx->width, enc->enc_ctx->height,
+                                enc->enc_ctx->pix_fmt, enc->preset->scale_flags,
+                                NULL, NULL, NULL);
+  if (!enc->sws_ctx) {
+    fprintf(stderr, "Could not initialize scaler\n");
+    return AVERROR(ENOMEM);
+  }
+
+  enc->scaled_frame = av_frame_alloc();
+  if (!enc->scaled_frame) {
+    fprintf(stderr, "Could not allocate frame\n");
+    return AVERROR(ENOMEM);
+  }
+
+  return 0;
+}
+
+// Builds the scaler for every rendition. In cascade mode the source is
+// converted to the encoder pixel format once by the first rendition, and each
+// following rendition scales from the one above it as long as that one is at
+// least as large; otherwise it falls back to scaling from the decoded frame.
+int init_scaling_graph(TranscoderContext *ctx) {
+  EncoderContext *upstream = NULL;
+
+  for (int i = 0; i < ctx->renditions; i++) {
+    EncoderContext *enc = &ctx->encoders[i];
+    int ret;
+
+    if (enc->copy) {
+      printf("%s copied from source\n", enc->preset->name);
+      continue;
+    }
+
+    if (ctx->scale_mode == SCALE_MODE_CASCADE && upstream &&
+        upstream->enc_ctx->width >= enc->enc_ctx->width &&
+        upstream->enc_ctx->height >= enc->enc_ctx->height) {
+      ret = init_scaler(enc, upstream->enc_ctx->width,
+                        upstream->enc_ctx->height, upstream->enc_ctx->pix_fmt);
+      upstream->downstream = enc;
+      enc->has_upstream = 1;
+    } else {
+      ret = init_scaler(enc, ctx->dec_ctx->width, ctx->dec_ctx->height,
+                        ctx->dec_ctx->pix_fmt);
+    }
+    if (ret < 0)
+      return ret;
+
+    printf("%s scaled from %s (%s)\n", enc->preset->name,
+           enc->has_upstream ? upstream->preset->name : "source",
+           enc->passthrough ? "as is"
+           : enc->use_simd  ? simd_level_name(enc->simd.level)
+                            : "swscale");
+    upstream = enc;
+  }
+
+  return 0;
+}
+
+// Gives frame a pooled buffer in the encoder's format and size.
+int get_scaled_buffer(EncoderContext *enc, AVFrame *frame) {
+  frame->format = enc->enc_ctx->pix_fmt;
+  frame->width = enc->enc_ctx->width;
+  frame->height = enc->enc_ctx->height;
+
+  // Rows rounded up like av_frame_get_buffer() does
+  return buffer_pool_get_frame(&enc->frame_pool, frame, frame->width,
+                               FFALIGN(frame->height, 32));
+}
+
+int scale_frame(EncoderContext *enc, const AVFrame *src, AVFrame *dst) {
+  if (enc->use_simd) {
+    simd_scale(&enc->simd, (const uint8_t *const *)src->data, src->linesize,
+               dst->data, dst->linesize);
+  } else {
+    int ret = sws_scale(enc->sws_ctx, (const uint8_t *const *)src->data,
+                        src->linesize, 0, src->height, dst->data,
+                        dst->linesize);
+    if (ret < 0)
+      return ret;
+  }
+
+  dst->pts = src->pts;
+  dst->opaque = src->opaque; // Capture time
+  // Source keyframes, for the renditions cascaded from this one
+  dst->flags = src->flags & AV_FRAME_FLAG_KEY;
+  return 0;
+}
@@ -0,0 +1,155 @@
+// scene.c
+#include "../include/scene.h"
+#include "../include/latency.h"
+#include "../include/simd_scale.h"
+#include <libavutil/imgutils.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+#define BLOCK 16 // Block side in bytes and rows: one SSE register wide
+
+void scene_init(SceneDetector *d) {
+  d->level = simd_detect_level();
+  latency_init(&d->detect_latency);
+  atomic_init(&d->frames, 0);
+  atomic_init(&d->static_frames, 0);
+}
+
+void scene_free(SceneDetector *d) {
+  av_freep(&d->reference);
+  av_freep(&d->sad);
+  d->reference_size = d->sad_size = 0;
+  av_buffer_unref(&d->scene);
+}
+
+// Adds the absolute differences of a and b from x on to their block's sum.
+static int row_sad_scalar(const uint8_t *a, const uint8_t *b, int bytes,
+                          uint32_t *sad, int x) {
+  for (; x < bytes; x++)
+    sad[x / BLOCK] += abs(a[x] - b[x]);
+  return x;
+}
+
+#if HAVE_X86_SIMD
+// One block per psadbw, which leaves a sum in each 64-bit half.
+__attribute__((target("sse4.1"))) static int
+row_sad_sse41(const uint8_t *a, const uint8_t *b, int bytes, uint32_t *sad,
+              int x) {
+  for (; x + BLOCK <= bytes; x += BLOCK) {
+    __m128i s = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + x)),
+                             _mm_loadu_si128((const __m128i *)(b + x)));
+    sad[x / BLOCK] += _mm_cvtsi128_si32(s) + _mm_extract_epi32(s, 2);
+  }
+  return x;
+}
+
+// Two blocks per iteration, one per 128-bit lane.
+__attribute__((target("avx2"))) static int
+row_sad_avx2(const uint8_t *a, const uint8_t *b, int bytes, uint32_t *sad,
+             int x) {
+  for (; x + 2 * BLOCK <= bytes; x += 2 * BLOCK) {
+    __m256i s = _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(a + x)),
+                                _mm256_loadu_si256((const __m256i *)(b + x)));
+    __m128i lo = _mm256_castsi256_si128(s);
+    __m128i hi = _mm256_extracti128_si256(s, 1);
+    sad[x / BLOCK] += _mm_cvtsi128_si32(lo) + _mm_extract_epi32(lo, 2);
+    sad[x / BLOCK + 1] += _mm_cvtsi128_si32(hi) + _mm_extract_epi32(hi, 2);
+  }
+  return x;
+}
+#endif
+
+// Compares plane 0 of frame with the reference one block row at a time and
+// stops at the first block whose mean difference exceeds SCENE_BLOCK_SAD.
+// A few such blocks are what a person moving in a still room looks like;
+// sensor noise spreads thinly over all of them.
+static int same_scene(SceneDetector *d, const AVFrame *frame, int bytes) {
+  int blocks = (bytes + BLOCK - 1) / BLOCK;
+  const uint8_t *ref = d->reference;
+
+  for (int y0 = 0; y0 < frame->height; y0 += BLOCK) {
+    memset(d->sad, 0, blocks * sizeof(*d->sad));
+    int rows = 0;
+    for (int y = y0; y < FFMIN(y0 + BLOCK, frame->height);
+         y += SCENE_ROW_STEP, rows++, ref += bytes) {
+      const uint8_t *row = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+      int x = 0;
+#if HAVE_X86_SIMD
+      if (d->level >= SIMD_LEVEL_AVX2)
+        x = row_sad_avx2(row, ref, bytes, d->sad, x);
+      if (d->level >= SIMD_LEVEL_SSE41)
+        x = row_sad_sse41(row, ref, bytes, d->sad, x);
+#endif
+      row_sad_scalar(row, ref, bytes, d->sad, x);
+    }
+
+    for (int i = 0; i < blocks; i++) {
+      int width = FFMIN(BLOCK, bytes - i * BLOCK);
+      if (d->sad[i] > (uint32_t)(SCENE_BLOCK_SAD * width * rows))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+// Keeps the rows of frame that later frames are compared with.
+static int start_scene(SceneDetector *d, const AVFrame *frame, int bytes) {
+  int rows = (frame->height + SCENE_ROW_STEP - 1) / SCENE_ROW_STEP;
+  av_fast_malloc(&d->reference, &d->reference_size, (size_t)rows * bytes);
+  av_fast_malloc(&d->sad, &d->sad_size,
+                 (bytes + BLOCK - 1) / BLOCK * sizeof(*d->sad));
+  if (!d->reference || !d->sad)
+    return AVERROR(ENOMEM);
+  av_image_copy_plane(d->reference, bytes, frame->data[0],
+                      frame->linesize[0] * SCENE_ROW_STEP, bytes, rows);
+  d->width = frame->width;
+  d->height = frame->height;
+  d->format = frame->format;
+
+  av_buffer_unref(&d->scene);
+  d->scene = av_buffer_allocz(1);
+  return d->scene ? 0 : AVERROR(ENOMEM);
+}
+
+// Marks frame with the scene it shows, which is a new one unless the frame
+// still shows the last. Plane 0 is luma for planar and semi-planar formats
+// and packed YUYV otherwise, either of which shows a change.
+int scene_mark(SceneDetector *d, AVFrame *frame) {
+  int64_t start = latency_now_ns();
+  int bytes = av_image_get_linesize(frame->format, frame->width, 0);
+  if (bytes < 0)
+    return bytes;
+
+  int same = d->scene && frame->format == d->format &&
+             frame->width == d->width && frame->height == d->height &&
+             same_scene(d, frame, bytes);
+  if (!same) {
+    int ret = start_scene(d, frame, bytes);
+    if (ret < 0)
+      return ret;
+  }
+
+  av_buffer_unref(&frame->opaque_ref);
+  frame->opaque_ref = av_buffer_ref(d->scene);
+  if (!frame->opaque_ref)
+    return AVERROR(ENOMEM);
+
+  atomic_fetch_add(&d->frames, 1);
+  if (same)
+    atomic_fetch_add(&d->static_frames, 1);
+  latency_since(&d->detect_latency, start);
+  return 0;
+}
+
+// Returns 1 if frame shows the scene that enc last scaled a frame of.
+int scene_unchanged(const EncoderContext *enc, const AVFrame *frame) {
+  return enc->scene && frame->opaque_ref &&
+         frame->opaque_ref->data == enc->scene->data;
+}
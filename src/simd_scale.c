@@ -0,0 +1,445 @@
+// simd_scale.c
+#include "../include/simd_scale.h"
+#include <libavutil/cpu.h>
+#include <libavutil/pixdesc.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+// Horizontal ratios (dst/src) of the default ladder, both for scaling from
+// the source and for cascading from the rung above.
+static const AVRational SUPPORTED_RATIOS[] = {
+    {1, 1}, {2, 3}, {1, 2}, {4, 9}, {1, 3}};
+
+SimdLevel simd_detect_level(void) {
+#if HAVE_X86_SIMD
+  int flags = av_get_cpu_flags();
+  if (flags & AV_CPU_FLAG_AVX2)
+    return SIMD_LEVEL_AVX2;
+  if (flags & AV_CPU_FLAG_SSE4)
+    return SIMD_LEVEL_SSE41;
+#endif
+  return SIMD_LEVEL_SCALAR;
+}
+
+const char *simd_level_name(SimdLevel level) {
+  switch (level) {
+  case SIMD_LEVEL_AVX2:
+    return "avx2";
+  case SIMD_LEVEL_SSE41:
+    return "sse4.1";
+  default:
+    return "scalar";
+  }
+}
+
+// Box filter weights for one output covering [start, end) in units where each
+// source sample is `unit` wide. Weights are in 1/64ths and always sum to 64.
+static int box_weights(int64_t start, int64_t end, int64_t unit, int *first,
+                       int16_t *weights, int max_taps) {
+  int64_t span = end - start;
+  int i0 = start / unit;
+  int count = 0, sum = 0, largest = 0;
+
+  for (int i = i0; (int64_t)i * unit < end; i++) {
+    if (count == max_taps)
+      return AVERROR(ENOSYS);
+    int64_t lo = FFMAX(start, (int64_t)i * unit);
+    int64_t hi = FFMIN(end, (int64_t)(i + 1) * unit);
+    weights[count] = (int16_t)(((hi - lo) * 64 + span / 2) / span);
+    sum += weights[count];
+    if (weights[count] > weights[largest])
+      largest = count;
+    count++;
+  }
+
+  weights[largest] += 64 - sum;
+  *first = i0;
+  return count;
+}
+
+// Source pixels a load must cover to produce `outputs` consecutive outputs
+// starting at a period boundary.
+static int window_span(const SimdPlaneScaler *p, int outputs) {
+  int span = 0;
+  for (int j = 0; j < outputs; j++) {
+    int phase = j % p->period_out;
+    int base = j / p->period_out * p->period_in;
+    for (int t = 0; t < p->htaps; t++) {
+      if (p->htap_weight[phase][t])
+        span = FFMAX(span, base + p->htap_offset[phase][t] + 1);
+    }
+  }
+  return span;
+}
+
+static int init_hfilter(SimdPlaneScaler *p, AVRational ratio) {
+  p->period_out = ratio.num;
+  p->period_in = ratio.den;
+  p->htaps = 0;
+
+  for (int j = 0; j < p->period_out; j++) {
+    int16_t w[SIMD_MAX_HTAPS];
+    int first;
+    int n = box_weights((int64_t)j * ratio.den, (int64_t)(j + 1) * ratio.den,
+                        ratio.num, &first, w, SIMD_MAX_HTAPS);
+    if (n < 0)
+      return n;
+    for (int t = 0; t < SIMD_MAX_HTAPS; t++) {
+      p->htap_offset[j][t] = t < n ? first + t : 0;
+      p->htap_weight[j][t] = t < n ? w[t] : 0;
+    }
+    p->htaps = FFMAX(p->htaps, n);
+  }
+
+  // Fit as many whole periods as possible into one 16-byte load; when eight
+  // outputs need more than that, split them over two loads.
+  int outputs = 8;
+  while (outputs >= 4 &&
+         (outputs % p->period_out || window_span(p, outputs) > 16))
+    outputs /= 2;
+  if (outputs < 4)
+    return AVERROR(ENOSYS);
+
+  p->windows = 8 / outputs;
+  p->window_inputs = outputs / p->period_out * p->period_in;
+  p->group_inputs = 8 / p->period_out * p->period_in;
+
+  for (int pair = 0; pair < 2; pair++) {
+    for (int win = 0; win < 2; win++)
+      memset(p->shuffle[pair][win], 0x80, 16);
+
+    for (int j = 0; j < 8; j++) {
+      int win = j / outputs;
+      int phase = j % p->period_out;
+      int base = (j % outputs) / p->period_out * p->period_in;
+      for (int k = 0; k < 2; k++) {
+        int t = pair * 2 + k;
+        if (p->htap_weight[phase][t]) {
+          p->shuffle[pair][win][j * 2 + k] = base + p->htap_offset[phase][t];
+        }
+        p->weights[pair][j * 2 + k] = p->htap_weight[phase][t];
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int init_vfilter(SimdPlaneScaler *p) {
+  p->vtap_first = av_malloc_array(p->dst_height, sizeof(int));
+  p->vtap_count = av_malloc_array(p->dst_height, sizeof(int));
+  p->vtap_weight =
+      av_malloc_array(p->dst_height * SIMD_MAX_VTAPS, sizeof(int16_t));
+  p->line = av_malloc(p->src_width + 64);
+  if (!p->vtap_first || !p->vtap_count || !p->vtap_weight || !p->line)
+    return AVERROR(ENOMEM);
+
+  for (int y = 0; y < p->dst_height; y++) {
+    int n = box_weights((int64_t)y * p->src_height,
+                        (int64_t)(y + 1) * p->src_height, p->dst_height,
+                        &p->vtap_first[y], &p->vtap_weight[y * SIMD_MAX_VTAPS],
+                        SIMD_MAX_VTAPS);
+    if (n < 0)
+      return n;
+    p->vtap_count[y] = n;
+  }
+
+  return 0;
+}
+
+// Maps a 1/64 filter sum to the output range as ((acc + bias) * mul >> 16) +
+// offset, which is exactly what _mm_mulhi_epu16 computes.
+static void init_range(SimdPlaneScaler *p, double scale, double offset) {
+  int off = (int)offset;
+  double frac = offset - off + 0.5;
+  p->range_mul = (uint16_t)(1024 * scale + 0.5);
+  p->range_bias = (uint16_t)(frac * 65536 / p->range_mul + 0.5);
+  p->range_offset = off;
+}
+
+static inline uint8_t range_map(const SimdPlaneScaler *p, int acc) {
+  int v = (((acc + p->range_bias) * p->range_mul) >> 16) + p->range_offset;
+  return v > 255 ? 255 : v;
+}
+
+static int is_supported_input(enum AVPixelFormat fmt) {
+  return fmt == AV_PIX_FMT_YUV420P || fmt == AV_PIX_FMT_YUVJ420P ||
+         fmt == AV_PIX_FMT_YUV422P || fmt == AV_PIX_FMT_YUVJ422P;
+}
+
+// Returns AVERROR(ENOSYS) when the formats or ratio are not one of the fused
+// cases; the caller is expected to fall back to swscale.
+int simd_scaler_init(SimdScaler *s, int src_width, int src_height,
+                     enum AVPixelFormat src_fmt, int dst_width, int dst_height,
+                     enum AVPixelFormat dst_fmt, SimdLevel level) {
+  memset(s, 0, sizeof(*s));
+  s->level = level;
+
+  if (!is_supported_input(src_fmt) || dst_fmt != AV_PIX_FMT_YUV420P)
+    return AVERROR(ENOSYS);
+
+  // Allow a pixel of rounding, e.g. 1920 * 4/9 = 853.3 for an 854 wide rung
+  const AVRational *ratio = NULL;
+  for (size_t i = 0; i < FF_ARRAY_ELEMS(SUPPORTED_RATIOS); i++) {
+    int64_t exact = (int64_t)src_width * SUPPORTED_RATIOS[i].num;
+    int64_t diff = exact - (int64_t)dst_width * SUPPORTED_RATIOS[i].den;
+    if (llabs(diff) <= SUPPORTED_RATIOS[i].den) {
+      ratio = &SUPPORTED_RATIOS[i];
+      break;
+    }
+  }
+  if (!ratio)
+    return AVERROR(ENOSYS);
+
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src_fmt);
+  int full_range = src_fmt == AV_PIX_FMT_YUVJ420P ||
+                   src_fmt == AV_PIX_FMT_YUVJ422P;
+
+  for (int i = 0; i < 3; i++) {
+    SimdPlaneScaler *p = &s->planes[i];
+    int chroma = i > 0;
+
+    p->src_width = chroma ? -((-src_width) >> desc->log2_chroma_w) : src_width;
+    p->src_height =
+        chroma ? -((-src_height) >> desc->log2_chroma_h) : src_height;
+    p->dst_width = chroma ? (dst_width + 1) >> 1 : dst_width;
+    p->dst_height = chroma ? (dst_height + 1) >> 1 : dst_height;
+
+    int ret = init_hfilter(p, *ratio);
+    if (ret >= 0)
+      ret = init_vfilter(p);
+    if (ret < 0) {
+      simd_scaler_free(s);
+      return ret;
+    }
+
+    if (!full_range)
+      init_range(p, 1.0, 0.0);
+    else if (!chroma)
+      init_range(p, 219.0 / 255.0, 16.0);
+    else
+      init_range(p, 224.0 / 255.0, 128.0 - 128.0 * 224.0 / 255.0);
+  }
+
+  return 0;
+}
+
+void simd_scaler_free(SimdScaler *s) {
+  for (int i = 0; i < 3; i++) {
+    SimdPlaneScaler *p = &s->planes[i];
+    av_freep(&p->vtap_first);
+    av_freep(&p->vtap_count);
+    av_freep(&p->vtap_weight);
+    av_freep(&p->line);
+  }
+}
+
+static int vscale_scalar(const uint8_t *const *rows, const int16_t *weights,
+                         int taps, uint8_t *dst, int x, int width) {
+  for (; x < width; x++) {
+    int acc = 32;
+    for (int t = 0; t < taps; t++)
+      acc += weights[t] * rows[t][x];
+    dst[x] = acc >> 6;
+  }
+  return x;
+}
+
+static int hscale_scalar(const SimdPlaneScaler *p, const uint8_t *src,
+                         uint8_t *dst, int x) {
+  for (; x < p->dst_width; x++) {
+    int phase = x % p->period_out;
+    int base = x / p->period_out * p->period_in;
+    int acc = 0;
+    for (int t = 0; t < p->htaps; t++) {
+      int idx = FFMIN(base + p->htap_offset[phase][t], p->src_width - 1);
+      acc += p->htap_weight[phase][t] * src[idx];
+    }
+    dst[x] = range_map(p, acc);
+  }
+  return x;
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse4.1"))) static int
+vscale_sse41(const uint8_t *const *rows, const int16_t *weights, int taps,
+             uint8_t *dst, int x, int width) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi16(32);
+
+  for (; x + 16 <= width; x += 16) {
+    __m128i lo = round, hi = round;
+    for (int t = 0; t < taps; t++) {
+      __m128i s = _mm_loadu_si128((const __m128i *)(rows[t] + x));
+      __m128i w = _mm_set1_epi16(weights[t]);
+      lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), w));
+      hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), w));
+    }
+    lo = _mm_srli_epi16(lo, 6);
+    hi = _mm_srli_epi16(hi, 6);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+  }
+  return x;
+}
+
+__attribute__((target("avx2"))) static int
+vscale_avx2(const uint8_t *const *rows, const int16_t *weights, int taps,
+            uint8_t *dst, int x, int width) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi16(32);
+
+  for (; x + 32 <= width; x += 32) {
+    __m256i lo = round, hi = round;
+    for (int t = 0; t < taps; t++) {
+      __m256i s = _mm256_loadu_si256((const __m256i *)(rows[t] + x));
+      __m256i w = _mm256_set1_epi16(weights[t]);
+      __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+      __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+      lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(s_lo, w));
+      hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(s_hi, w));
+    }
+    lo = _mm256_srli_epi16(lo, 6);
+    hi = _mm256_srli_epi16(hi, 6);
+    _mm256_storeu_si256((__m256i *)(dst + x), _mm256_packus_epi16(lo, hi));
+  }
+  return x;
+}
+
+// Eight outputs per iteration: gather each output's tap pairs with pshufb,
+// weight them with pmaddubsw and fold in the range mapping.
+__attribute__((target("sse4.1"))) static int
+hscale_sse41(const SimdPlaneScaler *p, const uint8_t *src, uint8_t *dst,
+             int x) {
+  const __m128i s00 = _mm_loadu_si128((const __m128i *)p->shuffle[0][0]);
+  const __m128i s01 = _mm_loadu_si128((const __m128i *)p->shuffle[0][1]);
+  const __m128i s10 = _mm_loadu_si128((const __m128i *)p->shuffle[1][0]);
+  const __m128i s11 = _mm_loadu_si128((const __m128i *)p->shuffle[1][1]);
+  const __m128i w0 = _mm_loadu_si128((const __m128i *)p->weights[0]);
+  const __m128i w1 = _mm_loadu_si128((const __m128i *)p->weights[1]);
+  const __m128i bias = _mm_set1_epi16(p->range_bias);
+  const __m128i mul = _mm_set1_epi16(p->range_mul);
+  const __m128i off = _mm_set1_epi16(p->range_offset);
+  const int reach = (p->windows - 1) * p->window_inputs + 16;
+
+  int in = x / p->period_out * p->period_in;
+  for (; in + reach <= p->src_width && x + 8 <= p->dst_width;
+       x += 8, in += p->group_inputs) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + in));
+    __m128i b = a;
+    if (p->windows > 1)
+      b = _mm_loadu_si128((const __m128i *)(src + in + p->window_inputs));
+    __m128i v =
+        _mm_or_si128(_mm_shuffle_epi8(a, s00), _mm_shuffle_epi8(b, s01));
+    __m128i acc = _mm_maddubs_epi16(v, w0);
+    if (p->htaps > 2) {
+      v = _mm_or_si128(_mm_shuffle_epi8(a, s10), _mm_shuffle_epi8(b, s11));
+      acc = _mm_add_epi16(acc, _mm_maddubs_epi16(v, w1));
+    }
+    acc = _mm_mulhi_epu16(_mm_add_epi16(acc, bias), mul);
+    acc = _mm_add_epi16(acc, off);
+    _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(acc, acc));
+  }
+  return x;
+}
+
+// Same as the SSE4.1 path with one group of eight outputs per 128-bit lane.
+__attribute__((target("avx2"))) static int
+hscale_avx2(const SimdPlaneScaler *p, const uint8_t *src, uint8_t *dst, int x) {
+#define LOAD_MASK(m) \
+  _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(m)))
+  const __m256i s00 = LOAD_MASK(p->shuffle[0][0]);
+  const __m256i s01 = LOAD_MASK(p->shuffle[0][1]);
+  const __m256i s10 = LOAD_MASK(p->shuffle[1][0]);
+  const __m256i s11 = LOAD_MASK(p->shuffle[1][1]);
+  const __m256i w0 = LOAD_MASK(p->weights[0]);
+  const __m256i w1 = LOAD_MASK(p->weights[1]);
+#undef LOAD_MASK
+  const __m256i bias = _mm256_set1_epi16(p->range_bias);
+  const __m256i mul = _mm256_set1_epi16(p->range_mul);
+  const __m256i off = _mm256_set1_epi16(p->range_offset);
+  const int reach = p->group_inputs + (p->windows - 1) * p->window_inputs + 16;
+
+  int in = x / p->period_out * p->period_in;
+  for (; in + reach <= p->src_width && x + 16 <= p->dst_width;
+       x += 16, in += 2 * p->group_inputs) {
+    const uint8_t *lane1 = src + in + p->group_inputs;
+    __m256i a = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + in))),
+        _mm_loadu_si128((const __m128i *)lane1), 1);
+    __m256i b = a;
+    if (p->windows > 1) {
+      b = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(_mm_loadu_si128(
+              (const __m128i *)(src + in + p->window_inputs))),
+          _mm_loadu_si128((const __m128i *)(lane1 + p->window_inputs)), 1);
+    }
+    __m256i v = _mm256_or_si256(_mm256_shuffle_epi8(a, s00),
+                                _mm256_shuffle_epi8(b, s01));
+    __m256i acc = _mm256_maddubs_epi16(v, w0);
+    if (p->htaps > 2) {
+      v = _mm256_or_si256(_mm256_shuffle_epi8(a, s10),
+                          _mm256_shuffle_epi8(b, s11));
+      acc = _mm256_add_epi16(acc, _mm256_maddubs_epi16(v, w1));
+    }
+    acc = _mm256_mulhi_epu16(_mm256_add_epi16(acc, bias), mul);
+    acc = _mm256_add_epi16(acc, off);
+    __m256i packed = _mm256_packus_epi16(acc, acc);
+    packed = _mm256_permute4x64_epi64(packed, 0x08);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm256_castsi256_si128(packed));
+  }
+  return x;
+}
+#endif
+
+static void scale_plane(SimdLevel level, SimdPlaneScaler *p,
+                        const uint8_t *src, int src_stride, uint8_t *dst,
+                        int dst_stride) {
+  const uint8_t *rows[SIMD_MAX_VTAPS];
+
+  for (int y = 0; y < p->dst_height; y++) {
+    const int16_t *weights = &p->vtap_weight[y * SIMD_MAX_VTAPS];
+    int taps = p->vtap_count[y];
+    const uint8_t *line;
+
+    for (int t = 0; t < taps; t++)
+      rows[t] = src + (ptrdiff_t)(p->vtap_first[y] + t) * src_stride;
+
+    // Vertical pass into a single cached line, unless it is a plain copy
+    if (taps == 1) {
+      line = rows[0];
+    } else {
+      int x = 0;
+#if HAVE_X86_SIMD
+      if (level >= SIMD_LEVEL_AVX2)
+        x = vscale_avx2(rows, weights, taps, p->line, x, p->src_width);
+      if (level >= SIMD_LEVEL_SSE41)
+        x = vscale_sse41(rows, weights, taps, p->line, x, p->src_width);
+#endif
+      vscale_scalar(rows, weights, taps, p->line, x, p->src_width);
+      line = p->line;
+    }
+
+    uint8_t *out = dst + (ptrdiff_t)y * dst_stride;
+    int x = 0;
+#if HAVE_X86_SIMD
+    if (level >= SIMD_LEVEL_AVX2)
+      x = hscale_avx2(p, line, out, x);
+    if (level >= SIMD_LEVEL_SSE41)
+      x = hscale_sse41(p, line, out, x);
+#endif
+    hscale_scalar(p, line, out, x);
+  }
+}
+
+void simd_scale(SimdScaler *s, const uint8_t *const src[],
+                const int src_stride[], uint8_t *const dst[],
+                const int dst_stride[]) {
+  for (int i = 0; i < 3; i++)
+    scale_plane(s->level, &s->planes[i], src[i], src_stride[i], dst[i],
+                dst_stride[i]);
+}
@@ -0,0 +1,332 @@
+// source.c
+#include "../include/source.h"
+#include "../include/frame_bus.h"
+#include "../include/v4l2_format.h"
+#include <libavdevice/avdevice.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/time.h>
+#include <math.h>
+
+static const char *SOURCE_NAMES[] = {
+    [SOURCE_V4L2] = "v4l2", [SOURCE_FILE] = "file", [SOURCE_LAVFI] = "lavfi",
+    [SOURCE_PIPE] = "pipe", [SOURCE_RAW] = "raw",     [SOURCE_BUS] = "bus",
+};
+
+int parse_source_type(const char *name, SourceType *type) {
+  for (size_t i = 0; i < FF_ARRAY_ELEMS(SOURCE_NAMES); i++) {
+    if (!strcmp(name, SOURCE_NAMES[i])) {
+      *type = (SourceType)i;
+      return 0;
+    }
+  }
+  return AVERROR(EINVAL);
+}
+
+const char *source_type_name(SourceType type) { return SOURCE_NAMES[type]; }
+
+// Live sources produce frames at their own pace and cannot be slowed down.
+// A frame bus runs at the pace of the capture behind it.
+int source_is_live(const SourceConfig *cfg) {
+  return cfg->type == SOURCE_V4L2 || cfg->type == SOURCE_BUS || cfg->realtime;
+}
+
+static const char *stdin_url(const char *url) {
+  return !url || !strcmp(url, "-") ? "pipe:0" : url;
+}
+
+// Resolves the demuxer, URL and demuxer options for the configured source.
+static int build_input(const SourceConfig *cfg, const char **format_name,
+                       const char **url, char *graph, size_t graph_size,
+                       AVDictionary **options) {
+  const char *size = cfg->video_size ? cfg->video_size : DEFAULT_VIDEO_SIZE;
+  *format_name = cfg->format;
+  *url = cfg->url;
+
+  switch (cfg->type) {
+  case SOURCE_V4L2: {
+    *format_name = cfg->format ? cfg->format : "v4l2";
+    *url = cfg->url ? cfg->url : DEFAULT_VIDEO_DEVICE;
+    const char *input_format = cfg->pixel_format;
+    AVRational rate = {0, 1};
+    int width, height, raw = 0;
+    if (cfg->framerate && av_parse_video_rate(&rate, cfg->framerate) < 0)
+      rate = (AVRational){0, 1};
+    if (!input_format || !strcmp(input_format, "auto")) {
+      if (av_parse_video_size(&width, &height, size) < 0) {
+        fprintf(stderr, "Invalid video size: %s\n", size);
+        return AVERROR(EINVAL);
+      }
+      raw = v4l2_negotiate_format(*url, width, height, &rate, &input_format);
+    }
+    av_dict_set(options, "input_format", input_format, 0);
+    av_dict_set(options, "video_size", size, 0);
+    // Let the camera use its native framerate unless one was asked for, or
+    // a raw mode needs the rate it was chosen for
+    if (cfg->framerate) {
+      av_dict_set(options, "framerate", cfg->framerate, 0);
+    } else if (raw) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%d/%d", rate.num, rate.den);
+      av_dict_set(options, "framerate", buf, 0);
+    }
+    // The capture thread dequeues as soon as a frame is ready; the extra
+    // buffers only absorb its own scheduling delays
+    av_dict_set_int(options, "num_buffers", V4L2_BUFFERS, 0);
+    break;
+  }
+
+  case SOURCE_FILE:
+    if (!cfg->url) {
+      fprintf(stderr, "File source needs an input path\n");
+      return AVERROR(EINVAL);
+    }
+    // Elementary stream demuxers (e.g. mjpeg) take their rate from here
+    if (cfg->framerate)
+      av_dict_set(options, "framerate", cfg->framerate, 0);
+    break;
+
+  case SOURCE_LAVFI:
+    *format_name = "lavfi";
+    if (!cfg->url) {
+      snprintf(graph, graph_size, "testsrc2=size=%s:rate=%s", size,
+               cfg->framerate ? cfg->framerate : DEFAULT_FRAMERATE);
+      *url = graph;
+    }
+    break;
+
+  case SOURCE_PIPE:
+    *url = stdin_url(cfg->url);
+    if (cfg->framerate)
+      av_dict_set(options, "framerate", cfg->framerate, 0);
+    break;
+
+  case SOURCE_BUS:
+    return AVERROR(EINVAL); // Not demuxed
+
+  case SOURCE_RAW:
+    *format_name = "rawvideo";
+    *url = stdin_url(cfg->url);
+    av_dict_set(options, "video_size", size, 0);
+    av_dict_set(options, "pixel_format",
+                cfg->pixel_format ? cfg->pixel_format : "yuv420p", 0);
+    av_dict_set(options, "framerate",
+                cfg->framerate ? cfg->framerate : DEFAULT_FRAMERATE, 0);
+    break;
+  }
+
+  return 0;
+}
+
+// True if the demuxer header already gave every video stream its size,
+// pixel format and frame rate, as v4l2 does for raw capture formats and
+// rawvideo always does. Probing would only throw frames away.
+static int stream_described(const AVFormatContext *input_ctx) {
+  int video = 0;
+  for (unsigned i = 0; i < input_ctx->nb_streams; i++) {
+    const AVStream *stream = input_ctx->streams[i];
+    const AVCodecParameters *par = stream->codecpar;
+    if (par->codec_type != AVMEDIA_TYPE_VIDEO)
+      continue;
+    if (!par->width || !par->height || par->format < 0 ||
+        (!stream->avg_frame_rate.num && !stream->r_frame_rate.num))
+      return 0;
+    video++;
+  }
+  return video > 0;
+}
+
+// Resets the per-input state and reports what was opened.
+static void input_opened(TranscoderContext *ctx, int width, int height,
+                         AVRational frame_rate) {
+  ctx->frame_rate = frame_rate;
+  ctx->frame_duration = av_q2d(av_inv_q(frame_rate));
+  ctx->last_pts = AV_NOPTS_VALUE;
+  ctx->pace_wall_start = AV_NOPTS_VALUE;
+  atomic_init(&ctx->capture.frames, 0);
+  atomic_init(&ctx->capture.driver_dropped, 0);
+  atomic_init(&ctx->capture.gaps, 0);
+  ctx->capture.last_ts = AV_NOPTS_VALUE;
+
+  printf("Input (%s%s): %dx%d @ %d/%d fps (%.3f ms per frame)\n",
+         source_type_name(ctx->source.type),
+         ctx->source.realtime ? ", paced" : "", width, height, frame_rate.num,
+         frame_rate.den, ctx->frame_duration * 1000);
+}
+
+// Frames from a bus are already decoded; there is nothing to probe.
+static int open_bus(TranscoderContext *ctx) {
+  AVRational frame_rate;
+  if (!ctx->source.url) {
+    fprintf(stderr, "Bus source needs the bus name as input\n");
+    return AVERROR(EINVAL);
+  }
+  int ret = frame_bus_attach(&ctx->bus, ctx->source.url, &ctx->time_base,
+                             &frame_rate);
+  if (ret < 0)
+    return ret;
+  if (!frame_rate.num || !frame_rate.den)
+    av_parse_video_rate(&frame_rate, DEFAULT_FRAMERATE);
+
+  AVCodecParameters *par = avcodec_parameters_alloc();
+  if (!par)
+    return AVERROR(ENOMEM);
+  frame_bus_describe(&ctx->bus, par);
+  ctx->video_stream_index = 0;
+  input_opened(ctx, par->width, par->height, frame_rate);
+  avcodec_parameters_free(&par);
+  return 0;
+}
+
+// Opens and, unless quick_probe finds the header describes it already,
+// probes the configured source.
+int source_open_demuxer(const SourceConfig *cfg, int quick_probe,
+                        AVFormatContext **input_ctx) {
+  avdevice_register_all();
+
+  const char *format_name, *url;
+  char graph[256];
+  AVDictionary *options = NULL;
+  int ret = build_input(cfg, &format_name, &url, graph, sizeof(graph),
+                        &options);
+  if (ret < 0)
+    return ret;
+
+  const AVInputFormat *input_format = NULL;
+  if (format_name) {
+    input_format = av_find_input_format(format_name);
+    if (!input_format) {
+      fprintf(stderr, "Input format %s not found\n", format_name);
+      av_dict_free(&options);
+      return AVERROR_DEMUXER_NOT_FOUND;
+    }
+  }
+
+  if (quick_probe) {
+    av_dict_set_int(&options, "probesize", FAST_START_PROBESIZE, 0);
+    av_dict_set(&options, "fpsprobesize", "0", 0);
+  }
+
+  ret = avformat_open_input(input_ctx, url, input_format, &options);
+  av_dict_free(&options);
+  if (ret < 0) {
+    fprintf(stderr, "Cannot open %s input %s: %s\n",
+            source_type_name(cfg->type), url, av_err2str(ret));
+    return ret;
+  }
+
+  if (!quick_probe || !stream_described(*input_ctx)) {
+    int64_t start = av_gettime_relative();
+    ret = avformat_find_stream_info(*input_ctx, NULL);
+    if (ret < 0) {
+      fprintf(stderr, "Cannot find stream info: %s\n", av_err2str(ret));
+      return ret;
+    }
+    if (quick_probe)
+      printf("Probed input in %.0f ms\n",
+             (av_gettime_relative() - start) / 1000.0);
+  }
+  return 0;
+}
+
+int open_input(TranscoderContext *ctx) {
+  if (ctx->source.type == SOURCE_BUS)
+    return open_bus(ctx);
+
+  // Every frame a live input spends on probing is lost, so stop as soon as
+  // one frame has filled in what the demuxer header left open
+  int quick_probe = ctx->fast_start && source_is_live(&ctx->source);
+  int ret = source_open_demuxer(&ctx->source, quick_probe, &ctx->input_ctx);
+  if (ret < 0)
+    return ret;
+
+  ctx->video_stream_index =
+      av_find_best_stream(ctx->input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (ctx->video_stream_index < 0) {
+    fprintf(stderr, "Cannot find video stream\n");
+    return AVERROR_STREAM_NOT_FOUND;
+  }
+
+  AVStream *stream = ctx->input_ctx->streams[ctx->video_stream_index];
+
+  // Calculate frame duration from actual stream timebase and framerate
+  AVRational frame_rate = stream->avg_frame_rate;
+  if (!frame_rate.num || !frame_rate.den)
+    frame_rate = stream->r_frame_rate;
+  if (!frame_rate.num || !frame_rate.den)
+    av_parse_video_rate(&frame_rate, DEFAULT_FRAMERATE);
+  ctx->time_base = stream->time_base;
+  input_opened(ctx, stream->codecpar->width, stream->codecpar->height,
+              frame_rate);
+  return 0;
+}
+
+// In realtime mode, holds each packet back until its timestamp is due
+// relative to the first packet, reproducing live capture timing.
+void pace_packet(TranscoderContext *ctx, const AVPacket *packet) {
+  if (!ctx->source.realtime || packet->stream_index != ctx->video_stream_index)
+    return;
+
+  int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+  if (ts == AV_NOPTS_VALUE)
+    return;
+
+  AVRational time_base = ctx->time_base;
+  int64_t now = av_gettime_relative();
+
+  if (ctx->pace_wall_start == AV_NOPTS_VALUE) {
+    ctx->pace_wall_start = now;
+    ctx->pace_pts_start = ts;
+    return;
+  }
+
+  int64_t due = ctx->pace_wall_start +
+                av_rescale_q(ts - ctx->pace_pts_start, time_base,
+                             AV_TIME_BASE_Q);
+  if (due > now)
+    av_usleep(due - now);
+}
+
+// Wall-clock time packet was captured, in microseconds. The v4l2 demuxer
+// turns the driver's buffer timestamps into wall-clock time, which is closer
+// to the exposure than the moment the read returned; frames from a bus carry
+// the time their producer captured them. Other sources, and drivers whose
+// clock is off, are stamped on arrival.
+static int64_t capture_time(TranscoderContext *ctx, const AVPacket *packet) {
+  int64_t now = av_gettime();
+  if (ctx->source.type == SOURCE_BUS && packet->opaque)
+    return (intptr_t)packet->opaque;
+  if (ctx->source.type != SOURCE_V4L2 || packet->pts == AV_NOPTS_VALUE)
+    return now;
+
+  int64_t ts = av_rescale_q(packet->pts, ctx->time_base, AV_TIME_BASE_Q);
+  return llabs(now - ts) < CAPTURE_CLOCK_SKEW * AV_TIME_BASE ? ts : now;
+}
+
+// Counts a captured packet, stamps it with its capture time and infers
+// driver drops from the gap since the previous one. The v4l2 demuxer does
+// not pass on buffer sequence numbers, but its timestamps come from the
+// driver, so a gap of several frame intervals means the frames in between
+// were never dequeued.
+void capture_note_packet(TranscoderContext *ctx, AVPacket *packet) {
+  CaptureStats *capture = &ctx->capture;
+  if (packet->stream_index != ctx->video_stream_index)
+    return;
+  atomic_fetch_add(&capture->frames, 1);
+
+  // Decoder and encoder carry this to the muxed packet (COPY_OPAQUE)
+  packet->opaque = (void *)(intptr_t)capture_time(ctx, packet);
+
+  if (ctx->source.type != SOURCE_V4L2 || packet->pts == AV_NOPTS_VALUE)
+    return;
+  int64_t ts = av_rescale_q(packet->pts, ctx->time_base, AV_TIME_BASE_Q);
+  int64_t last = capture->last_ts;
+  capture->last_ts = ts;
+  if (last == AV_NOPTS_VALUE)
+    return;
+
+  double intervals = (ts - last) / (ctx->frame_duration * AV_TIME_BASE);
+  if (intervals >= CAPTURE_GAP) {
+    atomic_fetch_add(&capture->driver_dropped, llrint(intervals) - 1);
+    atomic_fetch_add(&capture->gaps, 1);
+  }
+}
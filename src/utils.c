@@ -2,7 +2,6 @@
 // utils.c
 #include "../include/utils.h"
 #include "../include/config.h"
-#include "../include/presets.h"
 #include <stdio.h>
 
 char *ts_to_str(int64_t ts) {
@@ -40,7 +39,33 @@ void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt) {
          pkt->stream_index);
 }
 
-void write_master_playlist(const char *output_dir) {
+// With audio, every rendition refers to the one audio-only rendition rather
+// than carrying audio of its own.
+void print_master_playlist(AVBPrint *bp, const QualityPreset *presets,
+                           int count, int audio) {
+  av_bprintf(bp, "#EXTM3U\n");
+  av_bprintf(bp, "#EXT-X-VERSION:7\n");
+  if (audio)
+    av_bprintf(bp,
+               "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"audio\",NAME=\"audio\","
+               "DEFAULT=YES,AUTOSELECT=YES,CHANNELS=\"%d\","
+               "URI=\"audio/stream.m3u8\"\n",
+               AUDIO_CHANNELS);
+
+  for (int i = 0; i < count; i++) {
+    av_bprintf(bp,
+               "#EXT-X-STREAM-INF:BANDWIDTH=%d,RESOLUTION=%dx%d,"
+               "FRAME-RATE=%d%s\n",
+               presets[i].bitrate + (audio ? AUDIO_BITRATE : 0),
+               presets[i].width, presets[i].height, presets[i].fps,
+               audio ? ",AUDIO=\"audio\"" : "");
+    av_bprintf(bp, "%s/stream.m3u8\n", presets[i].name);
+  }
+}
+
+void write_master_playlist(const char *output_dir,
+                           const QualityPreset *presets, int count,
+                           int audio) {
   char master_path[1024];
   snprintf(master_path, sizeof(master_path), "%s/master.m3u8", output_dir);
 
@@ -48,16 +73,11 @@ void write_master_playlist(const char *output_dir) {
   if (!f)
     return;
 
-  fprintf(f, "#EXTM3U\n");
-  fprintf(f, "#EXT-X-VERSION:7\n");
-
-  for (int i = 0; i < MAX_QUALITY_LEVELS; i++) {
-    fprintf(f,
-            "#EXT-X-STREAM-INF:BANDWIDTH=%d,RESOLUTION=%dx%d,FRAME-RATE=%d\n",
-            QUALITY_PRESETS[i].bitrate, QUALITY_PRESETS[i].width,
-            QUALITY_PRESETS[i].height, QUALITY_PRESETS[i].fps);
-    fprintf(f, "%s/stream.m3u8\n", QUALITY_PRESETS[i].name);
-  }
+  AVBPrint bp;
+  av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+  print_master_playlist(&bp, presets, count, audio);
+  fwrite(bp.str, 1, bp.len, f);
+  av_bprint_finalize(&bp, NULL);
 
   fclose(f);
 }
@@ -0,0 +1,143 @@
+// v4l2_format.c
+// Picks the camera's capture format. Raw modes skip the JPEG decode and its
+// colour conversion entirely, but need several times the bus bandwidth, so
+// they are only used when the camera offers them at the wanted size and
+// frame rate and the bus can carry them.
+#include "../include/v4l2_format.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/videodev2.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+typedef struct RawFormat {
+  uint32_t fourcc;
+  const char *name; // As the v4l2 demuxer's input_format
+  int bits;         // Per pixel
+} RawFormat;
+
+// In order of preference: NV12 is half the size of YUYV and already planar
+static const RawFormat RAW_FORMATS[] = {
+    {V4L2_PIX_FMT_NV12, "nv12", 12},
+    {V4L2_PIX_FMT_YUYV, "yuyv422", 16},
+};
+
+static int xioctl(int fd, unsigned long request, void *arg) {
+  int ret;
+  while ((ret = ioctl(fd, request, arg)) < 0 && errno == EINTR)
+    ;
+  return ret;
+}
+
+static int has_format(int fd, uint32_t fourcc) {
+  struct v4l2_fmtdesc desc = {.type = V4L2_BUF_TYPE_VIDEO_CAPTURE};
+  for (; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++)
+    if (desc.pixelformat == fourcc)
+      return 1;
+  return 0;
+}
+
+static int has_size(int fd, uint32_t fourcc, int width, int height) {
+  struct v4l2_frmsizeenum size = {.pixel_format = fourcc};
+  for (; xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+    if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+      if (size.discrete.width == (uint32_t)width &&
+          size.discrete.height == (uint32_t)height)
+        return 1;
+      continue;
+    }
+    // Stepwise and continuous ranges are reported as a single entry
+    struct v4l2_frmsize_stepwise *s = &size.stepwise;
+    return width >= (int)s->min_width && width <= (int)s->max_width &&
+           height >= (int)s->min_height && height <= (int)s->max_height &&
+           (width - s->min_width) % FFMAX(s->step_width, 1) == 0 &&
+           (height - s->min_height) % FFMAX(s->step_height, 1) == 0;
+  }
+  return 0;
+}
+
+// Highest frame rate fourcc offers at width x height, or 0/1 if it does not
+// offer that size.
+static AVRational max_rate(int fd, uint32_t fourcc, int width, int height) {
+  AVRational best = {0, 1};
+  if (!has_format(fd, fourcc) || !has_size(fd, fourcc, width, height))
+    return best;
+
+  struct v4l2_frmivalenum ival = {
+      .pixel_format = fourcc, .width = width, .height = height};
+  for (; xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++) {
+    // Frame rates are the inverse of the intervals
+    struct v4l2_fract *f = ival.type == V4L2_FRMIVAL_TYPE_DISCRETE
+                               ? &ival.discrete
+                               : &ival.stepwise.min;
+    AVRational rate = {f->denominator, f->numerator};
+    if (rate.den && av_cmp_q(rate, best) > 0)
+      best = rate;
+    if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+      break;
+  }
+  return best;
+}
+
+// Usable bytes per second on the bus the camera hangs off, or 0 if it is not
+// a USB device (CSI cameras have bandwidth to spare).
+static double bus_bandwidth(const char *device) {
+  char real[PATH_MAX], path[PATH_MAX + 64];
+  if (!realpath(device, real))
+    return 0;
+  snprintf(path, sizeof(path), "/sys/class/video4linux/%s/device/../speed",
+           basename(real));
+
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return 0;
+  double mbps = 0;
+  if (fscanf(file, "%lf", &mbps) != 1)
+    mbps = 0;
+  fclose(file);
+  return mbps * 1e6 / 8 * V4L2_BUS_USABLE;
+}
+
+// Chooses between MJPEG and the raw modes of device at width x height.
+// *rate is the wanted frame rate, or 0/1 for the fastest MJPEG offers; it is
+// set to the rate to request when a raw mode is chosen. *format is set to
+// the demuxer's input_format. Returns 1 if a raw mode was chosen.
+int v4l2_negotiate_format(const char *device, int width, int height,
+                          AVRational *rate, const char **format) {
+  *format = "mjpeg";
+  if (!V4L2_PREFER_RAW)
+    return 0;
+
+  int fd = open(device, O_RDWR | O_NONBLOCK);
+  if (fd < 0)
+    return 0; // Opening the input will report it
+
+  AVRational want = rate->num ? *rate : max_rate(fd, V4L2_PIX_FMT_MJPEG,
+                                                 width, height);
+  double bus = bus_bandwidth(device);
+  int raw = 0;
+
+  for (size_t i = 0; i < FF_ARRAY_ELEMS(RAW_FORMATS) && !raw; i++) {
+    const RawFormat *f = &RAW_FORMATS[i];
+    AVRational offered = max_rate(fd, f->fourcc, width, height);
+    if (!offered.num || (want.num && av_cmp_q(offered, want) < 0))
+      continue;
+
+    AVRational use = want.num ? want : offered;
+    double bytes = (double)width * height * f->bits / 8 * av_q2d(use);
+    if (bus && bytes > bus) {
+      printf("V4L2: %s needs %.0f MB/s, bus carries %.0f MB/s\n", f->name,
+             bytes / 1e6, bus / 1e6);
+      continue;
+    }
+
+    *rate = use;
+    *format = f->name;
+    raw = 1;
+  }
+  close(fd);
+
+  printf("V4L2: capturing %s at %dx%d\n", *format, width, height);
+  return raw;
+}
@@ -0,0 +1,244 @@
+// workpool.c
+// Work-stealing thread pool shared by every channel's decode and encode
+// tasks, sized to the machine instead of to the number of renditions.
+#include "../include/workpool.h"
+#include "../include/cores.h"
+#include <libavutil/cpu.h>
+
+typedef struct WorkerArgs {
+  WorkPool *pool;
+  int index;
+} WorkerArgs;
+
+// Set on pool threads so that schedulers and blocked producers know which
+// queue is theirs.
+static _Thread_local WorkPool *current_pool;
+static _Thread_local int current_index;
+
+static int queue_push(WorkQueue *q, Task *task, int oldest) {
+  pthread_mutex_lock(&q->lock);
+  if (q->count == q->capacity) {
+    size_t capacity = q->capacity ? q->capacity * 2 : 16;
+    Task **tasks = av_malloc_array(capacity, sizeof(*tasks));
+    if (!tasks) {
+      pthread_mutex_unlock(&q->lock);
+      return AVERROR(ENOMEM);
+    }
+    for (size_t i = 0; i < q->count; i++)
+      tasks[i] = q->tasks[(q->head + i) % q->capacity];
+    av_free(q->tasks);
+    q->tasks = tasks;
+    q->head = 0;
+    q->capacity = capacity;
+  }
+
+  if (oldest) {
+    q->head = (q->head + q->capacity - 1) % q->capacity;
+    q->tasks[q->head] = task;
+  } else {
+    q->tasks[(q->head + q->count) % q->capacity] = task;
+  }
+  q->count++;
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+// Takes the newest task, or the oldest one when stealing.
+static Task *queue_pop(WorkQueue *q, int oldest) {
+  pthread_mutex_lock(&q->lock);
+  Task *task = NULL;
+  if (q->count) {
+    if (oldest) {
+      task = q->tasks[q->head];
+      q->head = (q->head + 1) % q->capacity;
+    } else {
+      task = q->tasks[(q->head + q->count - 1) % q->capacity];
+    }
+    q->count--;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return task;
+}
+
+static void run_task(WorkPool *pool, Task *task);
+
+static void enqueue(WorkPool *pool, Task *task, int oldest) {
+  int index = current_pool == pool
+                  ? current_index
+                  : (int)(atomic_fetch_add(&pool->next_queue, 1) %
+                          pool->thread_count);
+
+  // Only fails if the queue cannot grow; the task then runs right here
+  if (queue_push(&pool->queues[index], task, oldest) < 0) {
+    run_task(pool, task);
+    return;
+  }
+
+  atomic_fetch_add(&pool->pending, 1);
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static Task *find_task(WorkPool *pool, int index) {
+  Task *task = queue_pop(&pool->queues[index], 0);
+  for (int i = 1; !task && i < pool->thread_count; i++) {
+    task = queue_pop(&pool->queues[(index + i) % pool->thread_count], 1);
+    if (task)
+      atomic_fetch_add(&pool->steals, 1);
+  }
+  if (task)
+    atomic_fetch_sub(&pool->pending, 1);
+  return task;
+}
+
+static void run_task(WorkPool *pool, Task *task) {
+  atomic_store(&task->state, TASK_RUNNING);
+  task->run(task);
+  atomic_fetch_add(&pool->runs, 1);
+
+  // Scheduled again while running: go behind whatever else is waiting
+  int expected = TASK_RUNNING;
+  if (!atomic_compare_exchange_strong(&task->state, &expected, TASK_IDLE)) {
+    atomic_store(&task->state, TASK_QUEUED);
+    enqueue(pool, task, 1);
+  }
+}
+
+static void *worker_thread_func(void *arg) {
+  WorkerArgs *args = arg;
+  WorkPool *pool = args->pool;
+  current_pool = pool;
+  current_index = args->index;
+  av_free(args);
+
+  char name[16];
+  snprintf(name, sizeof(name), "pool-%d", current_index);
+  cores_pin_thread(NULL, name);
+
+  for (;;) {
+    Task *task = find_task(pool, current_index);
+    if (task) {
+      run_task(pool, task);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (!atomic_load(&pool->pending) && !atomic_load(&pool->stopping))
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (atomic_load(&pool->stopping) && !atomic_load(&pool->pending))
+      break;
+  }
+
+  return NULL;
+}
+
+// Starts threads workers, or one per CPU if threads is 0. Workers inherit
+// the caller's CPU affinity.
+int work_pool_init(WorkPool *pool, int threads) {
+  if (threads <= 0)
+    threads = av_cpu_count();
+
+  pool->queues = av_calloc(threads, sizeof(*pool->queues));
+  pool->threads = av_calloc(threads, sizeof(*pool->threads));
+  if (!pool->queues || !pool->threads)
+    return AVERROR(ENOMEM);
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  atomic_init(&pool->pending, 0);
+  atomic_init(&pool->next_queue, 0);
+  atomic_init(&pool->stopping, 0);
+  atomic_init(&pool->runs, 0);
+  atomic_init(&pool->steals, 0);
+  for (int i = 0; i < threads; i++)
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+
+  // Queues must exist for all workers before the first one can steal
+  pool->thread_count = threads;
+  for (int i = 0; i < threads; i++) {
+    WorkerArgs *args = av_malloc(sizeof(*args));
+    if (args) {
+      args->pool = pool;
+      args->index = i;
+    }
+    if (!args || pthread_create(&pool->threads[i], NULL, worker_thread_func,
+                                args) != 0) {
+      av_free(args);
+      fprintf(stderr, "Could not start pool thread %d\n", i);
+      pool->started = i;
+      return -1;
+    }
+  }
+  pool->started = threads;
+
+  printf("Work pool: %d threads\n", threads);
+  return 0;
+}
+
+// Waits for queued tasks to run, then stops the workers.
+void work_pool_uninit(WorkPool *pool) {
+  if (!pool->queues)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  atomic_store(&pool->stopping, 1);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->started; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  for (int i = 0; i < pool->thread_count; i++) {
+    pthread_mutex_destroy(&pool->queues[i].lock);
+    av_free(pool->queues[i].tasks);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  av_freep(&pool->queues);
+  av_freep(&pool->threads);
+}
+
+void task_init(Task *task, void (*run)(Task *task), void *opaque) {
+  task->run = run;
+  task->opaque = opaque;
+  atomic_init(&task->state, TASK_IDLE);
+}
+
+// Makes sure task runs (again) after this call. Scheduling a task that is
+// already queued does nothing; scheduling a running one makes it run once
+// more when it returns. Callable from any thread.
+void work_pool_schedule(WorkPool *pool, Task *task) {
+  int state = atomic_load(&task->state);
+  for (;;) {
+    if (state == TASK_IDLE) {
+      if (atomic_compare_exchange_weak(&task->state, &state, TASK_QUEUED)) {
+        enqueue(pool, task, 0);
+        return;
+      }
+    } else if (state == TASK_RUNNING) {
+      if (atomic_compare_exchange_weak(&task->state, &state, TASK_RERUN))
+        return;
+    } else {
+      return;
+    }
+  }
+}
+
+int work_pool_on_worker(void) { return current_pool != NULL; }
+
+// Runs one queued task on the calling pool thread. Producers on pool threads
+// call this instead of sleeping on a full queue, since the task that would
+// drain it may be waiting for this very thread. Returns 0 if there was
+// nothing to run.
+int work_pool_help(void) {
+  if (!current_pool)
+    return 0;
+
+  Task *task = find_task(current_pool, current_index);
+  if (!task)
+    return 0;
+  run_task(current_pool, task);
+  return 1;
+}